@@ -8,34 +8,1596 @@
 //===-------------------------------------------------------------------===//
 
 #include "hextype.h"
+#include <errno.h>
 #include <string.h>
+#include <unistd.h>
+#include <algorithm>
+#include <vector>
 
-__attribute__((always_inline))
-  inline ObjTypeMapEntry *findObjInfo(uptr* SrcAddr) {
-    uint32_t MapIndex = getHash((uptr)SrcAddr);
-    if (ObjTypeMap[MapIndex].ObjAddr == SrcAddr) {
+static std::mutex PhantomInfoLock;
+static std::mutex ReleaseLock;
+static std::mutex SpillLock;
+static std::mutex TypeTableLock;
+static std::mutex CastSetLock;
+static std::once_flag ShadowMemoryFlag;
+static uint32_t NumTypeId = 1;
+static std::atomic<uint32_t> ZeroHashTypeId;
+static std::atomic<uint32_t> PhantomGeneration;
+static std::atomic<uint32_t> TypeGeneration;
+static std::atomic<TypeLabelTable *> ObjTypeLabels;
+static rbtree ObjTypeMapSpill;
+static pthread_rwlock_t RangeLock = PTHREAD_RWLOCK_INITIALIZER;
+static AddrBounds RangeBounds;
+static pthread_rwlock_t GlobalTableLock = PTHREAD_RWLOCK_INITIALIZER;
+static std::mutex GlobalMergeLock;
+static std::vector<std::pair<const GlobalObjDesc *, uint64_t>> *NewGlobalTables;
+static GlobalObjTable *GlobalObjs;
+static std::atomic<bool> HasNewGlobalTable;
+static AddrBounds GlobalObjBounds;
+static std::set<uint64_t *> *TypeSections;
+static pthread_key_t ThreadDataKey;
+static std::once_flag ThreadDataKeyFlag;
+
+// Registered stack frames of this thread, outermost first. The stack
+// grows down, so their addresses decrease.
+static __thread FrameRecord *FrameStack;
+static __thread uint32_t FrameDepth;
+static __thread uint32_t FrameCapacity;
+
+// Stack objects of this thread, open addressing with linear probing. Only
+// the owning thread touches it, so it needs no lock.
+static __thread uptr ThreadStackBottom;
+static __thread uptr ThreadStackTop;
+static __thread StackMapEntry *StackMap;
+static __thread uptr StackMapMask;
+static __thread uptr StackMapSize;
+
+// Calls of functions that trace stack objects without removing them,
+// outermost first. Each call gets a new generation on entry, so the
+// entries of a call die once its frame is popped, even if another call
+// reuses the same frame address.
+static __thread StackFrameGen *FrameGens;
+static __thread uint32_t FrameGenDepth;
+static __thread uint32_t FrameGenCapacity;
+static __thread uint32_t LastFrameGen;
+static __thread bool ThreadDataSet;
+
+// One lock covers a whole probe group, so every slot an object may be
+// stored in is guarded by the same sequence counter.
+inline std::atomic<uint32_t> *getSlotSeq(uptr MapIndex) {
+  return &ObjTypeMapLock[(MapIndex / MAPGROUP) & (NUMMAPLOCK - 1)].Seq;
+}
+
+inline void lockSlot(uptr MapIndex) {
+  std::atomic<uint32_t> *Seq = getSlotSeq(MapIndex);
+  for (;;) {
+    uint32_t Cur = Seq->load(std::memory_order_relaxed);
+    if (!(Cur & 1) &&
+        Seq->compare_exchange_weak(Cur, Cur + 1, std::memory_order_acquire))
+      break;
+    __builtin_ia32_pause();
+  }
+  std::atomic_thread_fence(std::memory_order_release);
+}
+
+inline void unlockSlot(uptr MapIndex) {
+  getSlotSeq(MapIndex)->fetch_add(1, std::memory_order_release);
+}
+
+// Lock-free snapshot of a direct slot; retries while a writer holds the
+// stripe so the copied fields always belong to the same object.
+inline void readSlot(uptr MapIndex, ObjTypeMapEntry *Result) {
+  std::atomic<uint32_t> *Seq = getSlotSeq(MapIndex);
+  for (;;) {
+    uint32_t Begin = Seq->load(std::memory_order_acquire);
+    if (Begin & 1) {
+      __builtin_ia32_pause();
+      continue;
+    }
+    *Result = ObjTypeMap[MapIndex];
+    std::atomic_thread_fence(std::memory_order_acquire);
+    if (Seq->load(std::memory_order_relaxed) == Begin)
+      return;
+  }
+}
+
+inline uptr getBucket(uptr MapIndex) {
+  return MapIndex & ~(uptr)(MAPWAYS - 1);
+}
+
+inline uptr getGroup(uptr MapIndex) {
+  return MapIndex & ~(uptr)(MAPGROUP - 1);
+}
+
+inline MapBucketInfo *getBucketInfo(uptr MapIndex) {
+  return &ObjTypeMapInfo[MapIndex / MAPWAYS];
+}
+
+inline bool inHomeBucket(ObjTypeMapEntry *Slot) {
+  return getBucket(Slot - ObjTypeMap) ==
+    getBucket(getHash((uptr)Slot->ObjAddr));
+}
+
+// Search the probe group of SrcAddr: its home slot, the rest of the home
+// bucket and, only if entries were displaced from this bucket, the other
+// buckets of the group. Returns 1 for the home slot, 2 for any other slot
+// and 0 if the object is not in the group.
+static int searchGroup(uptr MapIndex, uptr* SrcAddr, ObjTypeMapEntry **Result) {
+  if (ObjTypeMap[MapIndex].ObjAddr == SrcAddr) {
+    *Result = &ObjTypeMap[MapIndex];
+    return 1;
+  }
+
+  uptr Bucket = getBucket(MapIndex);
+  for (uptr i = Bucket; i < Bucket + MAPWAYS; i++)
+    if (ObjTypeMap[i].ObjAddr == SrcAddr) {
+      *Result = &ObjTypeMap[i];
+      return 2;
+    }
+
+  if (getBucketInfo(MapIndex)->Displaced == 0)
+    return 0;
+
+  uptr Group = getGroup(MapIndex);
+  for (uptr i = Group; i < Group + MAPGROUP; i++)
+    if (ObjTypeMap[i].ObjAddr == SrcAddr) {
+      *Result = &ObjTypeMap[i];
+      return 2;
+    }
+  return 0;
+}
+
+inline ObjTypeInfo *getTypeInfo(const ObjTypeMapEntry *Entry) {
+  return &ObjTypeTable[Entry->TypeId];
+}
+
+// Type ids are found by hash without a lock: a writer fills TypeId
+// before it publishes Hash, and a grown index is published only once it
+// is complete. The hash 0 marks an empty slot, so a type with hash 0
+// keeps its id aside.
+static uint32_t lookupTypeId(const uint64_t TypeHashValue) {
+  if (TypeHashValue == 0)
+    return ZeroHashTypeId.load(std::memory_order_acquire);
+  TypeIdIndex *Index = ObjTypeIdIndex.load(std::memory_order_acquire);
+  uptr Pos = TypeHashValue & Index->Mask;
+  while (true) {
+    uint64_t Hash = Index->Entry[Pos].Hash.load(std::memory_order_acquire);
+    if (Hash == TypeHashValue)
+      return Index->Entry[Pos].TypeId;
+    if (Hash == 0)
+      return 0;
+    Pos = (Pos + 1) & Index->Mask;
+  }
+}
+
+static TypeIdIndex *allocTypeIdIndex(const uptr Size) {
+  TypeIdIndex *Index = (TypeIdIndex *)calloc(
+    1, sizeof(TypeIdIndex) + Size * sizeof(TypeIdIndexEntry));
+  Index->Mask = Size - 1;
+  return Index;
+}
+
+static void insertTypeIdIndex(TypeIdIndex *Index,
+                              const uint64_t TypeHashValue,
+                              const uint32_t TypeId) {
+  uptr Pos = TypeHashValue & Index->Mask;
+  while (Index->Entry[Pos].Hash.load(std::memory_order_relaxed) != 0)
+    Pos = (Pos + 1) & Index->Mask;
+  Index->Entry[Pos].TypeId = TypeId;
+  Index->Entry[Pos].Hash.store(TypeHashValue, std::memory_order_release);
+}
+
+// Needs TypeTableLock
+static uint32_t registerTypeLocked(const uint64_t TypeHashValue,
+                                   uptr* const RuleAddr) {
+  uint32_t TypeId = lookupTypeId(TypeHashValue);
+  if (TypeId != 0) {
+    if (ObjTypeTable[TypeId].RuleAddr == nullptr && RuleAddr != nullptr) {
+      ObjTypeTable[TypeId].RuleAddr = RuleAddr;
+      TypeGeneration.fetch_add(1, std::memory_order_release);
+    }
+    return TypeId;
+  }
+
+  if (NumTypeId >= MAXTYPEID) {
+    fprintf(stderr, "== HexType: too many types (%u)\n", NumTypeId);
+    TERMINATE
+  }
+  TypeId = NumTypeId++;
+  ObjTypeTable[TypeId].TypeHashValue = TypeHashValue;
+  ObjTypeTable[TypeId].RuleAddr = RuleAddr;
+  if (RuleAddr != nullptr)
+    TypeGeneration.fetch_add(1, std::memory_order_release);
+
+  if (TypeHashValue == 0) {
+    ZeroHashTypeId.store(TypeId, std::memory_order_release);
+    return TypeId;
+  }
+
+  // Keep the index at most half full. The old one may still be read by
+  // other threads and is not freed.
+  TypeIdIndex *Index = ObjTypeIdIndex.load(std::memory_order_relaxed);
+  if (2 * (uptr)NumTypeId > Index->Mask) {
+    TypeIdIndex *NewIndex = allocTypeIdIndex(2 * (Index->Mask + 1));
+    for (uint32_t i = 1; i < TypeId; i++)
+      if (ObjTypeTable[i].TypeHashValue != 0)
+        insertTypeIdIndex(NewIndex, ObjTypeTable[i].TypeHashValue, i);
+    ObjTypeIdIndex.store(NewIndex, std::memory_order_release);
+    Index = NewIndex;
+  }
+  insertTypeIdIndex(Index, TypeHashValue, TypeId);
+  return TypeId;
+}
+
+static uint32_t registerType(const uint64_t TypeHashValue,
+                             uptr* const RuleAddr) {
+  std::lock_guard<std::mutex> Guard(TypeTableLock);
+  return registerTypeLocked(TypeHashValue, RuleAddr);
+}
+
+// Dense id of a type. Every type record the compiler emits has a slot for
+// it right before RuleAddr, so only the first use of a type in a module
+// goes through registerType. RuleAddr is null for a type the module has
+// no rules for; it never points into the record of another type.
+inline uint32_t getTypeId(const uint64_t TypeHashValue,
+                          uptr* const RuleAddr) {
+  if (RuleAddr == nullptr)
+    return registerType(TypeHashValue, nullptr);
+  uint64_t *TypeIdSlot = (uint64_t *)RuleAddr - 1;
+  uint64_t TypeId = __atomic_load_n(TypeIdSlot, __ATOMIC_ACQUIRE);
+  if (TypeId == 0) {
+    TypeId = registerType(TypeHashValue, RuleAddr);
+    __atomic_store_n(TypeIdSlot, TypeId, __ATOMIC_RELEASE);
+  }
+  return (uint32_t)TypeId;
+}
+
+// Phantom classes are the equivalence classes of the phantom relation.
+// Each type carries the id of its class, so a union relabels the members
+// of the smaller class and a lookup is a single load. Needs
+// PhantomInfoLock.
+inline uint32_t getPhantomClass(const uint32_t TypeId) {
+  return __atomic_load_n(&ObjTypeTable[TypeId].PhantomClass,
+                         __ATOMIC_RELAXED);
+}
+
+static void unionPhantomLocked(const uint32_t A, const uint32_t B) {
+  for (uint32_t Id : {A, B})
+    if (ObjTypeTable[Id].PhantomClass == 0) {
+      ObjTypeTable[Id].PhantomNext = Id;
+      ObjTypeTable[Id].PhantomSize = 1;
+      __atomic_store_n(&ObjTypeTable[Id].PhantomClass, Id, __ATOMIC_RELAXED);
+    }
+  uint32_t Into = ObjTypeTable[A].PhantomClass;
+  uint32_t From = ObjTypeTable[B].PhantomClass;
+  if (Into == From)
+    return;
+  if (ObjTypeTable[Into].PhantomSize < ObjTypeTable[From].PhantomSize)
+    std::swap(Into, From);
+
+  uint32_t Id = From;
+  do {
+    __atomic_store_n(&ObjTypeTable[Id].PhantomClass, Into, __ATOMIC_RELAXED);
+    Id = ObjTypeTable[Id].PhantomNext;
+  } while (Id != From);
+  std::swap(ObjTypeTable[Into].PhantomNext, ObjTypeTable[From].PhantomNext);
+  ObjTypeTable[Into].PhantomSize += ObjTypeTable[From].PhantomSize;
+}
+
+static CastSet *buildCastSet(const uint32_t TypeId) {
+  std::lock_guard<std::mutex> Guard(CastSetLock);
+  CastSet *Set = __atomic_load_n(&ObjCastTable[TypeId], __ATOMIC_ACQUIRE);
+  if (Set && Set->Generation ==
+      PhantomGeneration.load(std::memory_order_acquire))
+    return Set;
+
+  uptr* RuleAddr = ObjTypeTable[TypeId].RuleAddr;
+  if (RuleAddr == nullptr)
+    return nullptr;
+
+  // A phantom class is in the set if any of its members is a rule
+  uint32_t Generation = PhantomGeneration.load(std::memory_order_acquire);
+  std::vector<uint32_t> Targets;
+  uint64_t RuleSize = *RuleAddr;
+  for (uint64_t i = 1; i <= RuleSize; i++) {
+    uint64_t RuleHash = ((uint64_t *)RuleAddr)[i];
+    uint32_t RuleTypeId = lookupTypeId(RuleHash);
+    if (RuleTypeId == 0)
+      RuleTypeId = registerType(RuleHash, nullptr);
+    Targets.push_back(RuleTypeId);
+    uint32_t RuleClass = getPhantomClass(RuleTypeId);
+    if (RuleClass != 0)
+      Targets.push_back(RuleClass);
+  }
+  std::sort(Targets.begin(), Targets.end());
+  Targets.erase(std::unique(Targets.begin(), Targets.end()), Targets.end());
+
+  uint32_t NumChunk = 0, NumWord = 0;
+  for (uint32_t i = 0; i < Targets.size(); i++)
+    if (i == 0 || (Targets[i] >> 6) != (Targets[i - 1] >> 6))
+      NumWord++;
+  if (!Targets.empty())
+    NumChunk = (Targets.back() >> 12) + 1;
+
+  // one allocation: header, Presence, Words, Rank
+  uptr Size = sizeof(CastSet) + (NumChunk + NumWord) * sizeof(uint64_t) +
+    NumChunk * sizeof(uint32_t);
+  char *Buf = (char *)calloc(1, Size);
+  Set = (CastSet *)Buf;
+  Set->Generation = Generation;
+  Set->NumChunk = NumChunk;
+  Set->Presence = (uint64_t *)(Buf + sizeof(CastSet));
+  Set->Words = Set->Presence + NumChunk;
+  Set->Rank = (uint32_t *)(Set->Words + NumWord);
+
+  int32_t Word = -1;
+  for (uint32_t i = 0; i < Targets.size(); i++) {
+    uint32_t Block = Targets[i] >> 6;
+    if (i == 0 || Block != (Targets[i - 1] >> 6)) {
+      Word++;
+      if (!(Set->Presence[Block >> 6]))
+        Set->Rank[Block >> 6] = Word;
+      Set->Presence[Block >> 6] |= 1ULL << (Block & 63);
+    }
+    Set->Words[Word] |= 1ULL << (Targets[i] & 63);
+  }
+
+  // A replaced set may still be read by other threads; it is not freed.
+  __atomic_store_n(&ObjCastTable[TypeId], Set, __ATOMIC_RELEASE);
+#ifdef HEX_LOG
+  IncVal(numCastSet, 1);
+  IncVal(numCastSetByte, Size);
+#endif
+  return Set;
+}
+
+inline const CastSet *getCastSet(const uint32_t TypeId) {
+  CastSet *Set = __atomic_load_n(&ObjCastTable[TypeId], __ATOMIC_ACQUIRE);
+  if (Set && Set->Generation ==
+      PhantomGeneration.load(std::memory_order_acquire))
+    return Set;
+  return buildCastSet(TypeId);
+}
+
+inline bool testCastSet(const CastSet *Set, const uint32_t TypeId) {
+  uint32_t Block = TypeId >> 6;
+  uint32_t Chunk = Block >> 6;
+  if (Chunk >= Set->NumChunk)
+    return false;
+  uint64_t Present = Set->Presence[Chunk];
+  uint64_t BlockBit = 1ULL << (Block & 63);
+  if (!(Present & BlockBit))
+    return false;
+  uint32_t Word = Set->Rank[Chunk] +
+    __builtin_popcountll(Present & (BlockBit - 1));
+  return (Set->Words[Word] >> (TypeId & 63)) & 1;
+}
+
+// The parent of a type in a single inheritance chain: the type whose
+// rules are exactly those of TypeId without TypeId itself. Returns
+// TypeId for a root and 0 if there is no such parent. Rules are sorted,
+// so dropping one hash keeps them aligned. Needs TypeTableLock.
+static uint32_t getChainParent(const uint32_t TypeId) {
+  uint64_t *Rules = (uint64_t *)ObjTypeTable[TypeId].RuleAddr;
+  uint64_t TypeHash = ObjTypeTable[TypeId].TypeHashValue;
+  uint64_t RuleSize = Rules[0];
+  if (std::count(&Rules[1], &Rules[RuleSize + 1], TypeHash) != 1)
+    return 0;
+  if (RuleSize == 1)
+    return TypeId;
+
+  for (uint64_t i = 1; i <= RuleSize; i++) {
+    if (Rules[i] == TypeHash)
+      continue;
+    uint32_t ParentId = lookupTypeId(Rules[i]);
+    if (ParentId == 0)
+      continue;
+    uint64_t *ParentRules = (uint64_t *)ObjTypeTable[ParentId].RuleAddr;
+    if (ParentRules == nullptr || ParentRules[0] + 1 != RuleSize)
+      continue;
+    uint64_t j = 1;
+    bool Same = true;
+    for (uint64_t k = 1; k <= RuleSize && Same; k++)
+      if (Rules[k] != TypeHash)
+        Same = ParentRules[j++] == Rules[k];
+    if (Same)
+      return ParentId;
+  }
+  return 0;
+}
+
+// Number the types that form single inheritance trees, in DFS pre and
+// post order. Rebuilt once per loaded module whose types got rules, not
+// on the cast path; a type that got its rules since is not labeled and
+// its casts go to the cast set. A replaced table may still be read by
+// other threads and is not freed. Needs TypeTableLock.
+static void buildTypeLabelsLocked() {
+  uint32_t Generation = TypeGeneration.load(std::memory_order_acquire);
+  TypeLabelTable *Table = ObjTypeLabels.load(std::memory_order_relaxed);
+  if (Table && Table->Generation == Generation)
+    return;
+
+  uint32_t NumType = NumTypeId;
+  std::vector<std::vector<uint32_t>> Children(NumType);
+  std::vector<uint32_t> Roots;
+  for (uint32_t Id = 1; Id < NumType; Id++) {
+    if (ObjTypeTable[Id].RuleAddr == nullptr)
+      continue;
+    uint32_t ParentId = getChainParent(Id);
+    if (ParentId == Id)
+      Roots.push_back(Id);
+    else if (ParentId != 0)
+      Children[ParentId].push_back(Id);
+  }
+
+  Table = (TypeLabelTable *)calloc(
+    1, sizeof(TypeLabelTable) + NumType * sizeof(TypeLabel));
+  Table->Generation = Generation;
+  Table->NumType = NumType;
+  uint32_t Counter = 0;
+  std::vector<std::pair<uint32_t, size_t>> Stack;
+  for (uint32_t Root : Roots) {
+    Table->Label[Root].Pre = ++Counter;
+    Stack.push_back(std::make_pair(Root, 0));
+    while (!Stack.empty()) {
+      uint32_t Id = Stack.back().first;
+      size_t Next = Stack.back().second++;
+      if (Next < Children[Id].size()) {
+        uint32_t Child = Children[Id][Next];
+        Table->Label[Child].Pre = ++Counter;
+        Stack.push_back(std::make_pair(Child, 0));
+      } else {
+        Table->Label[Id].Post = ++Counter;
+        Stack.pop_back();
+      }
+    }
+  }
+  ObjTypeLabels.store(Table, std::memory_order_release);
+}
+
+// Two compares when both types are in single inheritance trees: Dst is
+// an ancestor of Src or, having no phantom class, cannot be cast to.
+// Returns -1 when the cast set has to decide.
+inline int checkTypeLabel(const uint32_t SrcTypeId, const uint32_t DstTypeId) {
+  const TypeLabelTable *Table = ObjTypeLabels.load(std::memory_order_acquire);
+  if (Table == nullptr || SrcTypeId >= Table->NumType ||
+      DstTypeId >= Table->NumType)
+    return -1;
+  TypeLabel Src = Table->Label[SrcTypeId];
+  TypeLabel Dst = Table->Label[DstTypeId];
+  if (Src.Pre == 0 || Dst.Pre == 0)
+    return -1;
+  if (Dst.Pre <= Src.Pre && Src.Post <= Dst.Post)
+    return SAFECASTUPCAST;
+  if (getPhantomClass(DstTypeId) == 0)
+    return BADCAST;
+  return -1;
+}
+
+// Whether an object of type SrcTypeId may be used as DstTypeHashValue:
+// SAFECASTUPCAST, BADCAST or FAILINFO when there are no rules for it.
+static char checkCastRule(const uint32_t SrcTypeId,
+                          const uint64_t DstTypeHashValue) {
+  uint32_t DstTypeId = lookupTypeId(DstTypeHashValue);
+  if (DstTypeId != 0) {
+    int LabelResult = checkTypeLabel(SrcTypeId, DstTypeId);
+    if (LabelResult >= 0) {
+#ifdef HEX_LOG
+      IncVal(numCastLabel, 1);
+#endif
+      return LabelResult;
+    }
+  }
+
+  const CastSet *Set = getCastSet(SrcTypeId);
+  if (Set == nullptr)
+    return FAILINFO;
+  // building the set registers the types of its rules
+  if (DstTypeId == 0)
+    DstTypeId = lookupTypeId(DstTypeHashValue);
+  if (testCastSet(Set, DstTypeId))
+    return SAFECASTUPCAST;
+  uint32_t DstClass = getPhantomClass(DstTypeId);
+  if (DstClass != 0 && testCastSet(Set, DstClass))
+    return SAFECASTUPCAST;
+  return BADCAST;
+}
+
+inline int lookupLocalCache(const uint32_t CacheSet, const uint32_t SrcTypeId,
+                            const uint64_t DstTypeHashValue) {
+  LocalResultEntry *Entry = &LocalResultCache[getLocalCacheIndex(CacheSet)];
+  if (Entry->DstHValue == DstTypeHashValue && Entry->SrcTypeId == SrcTypeId)
+    return Entry->VerifyResult;
+  return -1;
+}
+
+// Like VerifyResultCache, only safe results are kept: they stay safe when
+// rules or phantom info are added later, while a bad cast or missing
+// rules may not, and the inlined check trusts this cache without asking.
+inline void insertLocalCache(const uint32_t CacheSet, const uint32_t SrcTypeId,
+                             const uint64_t DstTypeHashValue,
+                             const char VerifyResult) {
+  if (VerifyResult != SAFECASTUPCAST && VerifyResult != SAFECASTSAME)
+    return;
+  LocalResultEntry *Entry = &LocalResultCache[getLocalCacheIndex(CacheSet)];
+  Entry->DstHValue = DstTypeHashValue;
+  Entry->SrcTypeId = SrcTypeId;
+  Entry->VerifyResult = VerifyResult;
+}
+
+// Returns the cached result for (SrcTypeId, DstTypeHashValue), or -1.
+// A way is only used if its Meta was even and unchanged around the read
+// of DstHValue, so a concurrent insert is seen either whole or not at all.
+inline int lookupVerifyCache(const uint32_t SrcTypeId,
+                             const uint64_t DstTypeHashValue) {
+  VerifyResultEntry *Ways = getVerifyCacheWays(SrcTypeId, DstTypeHashValue);
+  for (int i = 0; i < CACHEWAYS; i++) {
+    uint64_t Meta = Ways[i].Meta.load(std::memory_order_acquire);
+    if (getCacheMetaId(Meta) != SrcTypeId || (getCacheMetaSeq(Meta) & 1))
+      continue;
+    uint64_t WayDst = Ways[i].DstHValue.load(std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_acquire);
+    if (WayDst == DstTypeHashValue &&
+        Ways[i].Meta.load(std::memory_order_relaxed) == Meta)
+      return getCacheMetaResult(Meta);
+  }
+  return -1;
+}
+
+// Only safe results are shared; bad casts are few and are re-checked so
+// that every thread reports them. An empty way is taken first, otherwise
+// each thread evicts ways in turn. The writer claims the way by making
+// its sequence odd and gives up if another thread got there first.
+static void insertVerifyCache(const uint32_t SrcTypeId,
+                              const uint64_t DstTypeHashValue,
+                              const char VerifyResult) {
+  static __thread uint32_t EvictClock;
+  if (VerifyResult != SAFECASTUPCAST && VerifyResult != SAFECASTSAME)
+    return;
+
+  VerifyResultEntry *Ways = getVerifyCacheWays(SrcTypeId, DstTypeHashValue);
+  VerifyResultEntry *Victim = nullptr;
+  uint64_t Meta = 0;
+  for (int i = 0; i < CACHEWAYS; i++) {
+    Meta = Ways[i].Meta.load(std::memory_order_relaxed);
+    if (getCacheMetaId(Meta) == 0) {
+      Victim = &Ways[i];
+      break;
+    }
+  }
+  if (Victim == nullptr) {
+    Victim = &Ways[EvictClock++ & (CACHEWAYS - 1)];
+    Meta = Victim->Meta.load(std::memory_order_relaxed);
+#ifdef HEX_LOG
+    IncVal(numCastEvict, 1);
+#endif
+  }
+
+  uint32_t Seq = getCacheMetaSeq(Meta);
+  if ((Seq & 1) ||
+      !Victim->Meta.compare_exchange_strong(
+        Meta, makeCacheMeta(getCacheMetaId(Meta), 0, Seq + 1),
+        std::memory_order_acquire))
+    return;
+  std::atomic_thread_fence(std::memory_order_release);
+  Victim->DstHValue.store(DstTypeHashValue, std::memory_order_relaxed);
+  Victim->Meta.store(makeCacheMeta(SrcTypeId, VerifyResult, Seq + 2),
+                     std::memory_order_release);
+}
+
+// Whether Addr may be in one of the records the bounds cover. Read
+// without a lock, so a miss outside of them never touches the lock.
+inline bool inAddrBounds(const AddrBounds *Bounds, uptr Addr) {
+  return Addr >= Bounds->Begin.load(std::memory_order_relaxed) &&
+    Addr < Bounds->End.load(std::memory_order_relaxed);
+}
+
+// Callers hold the write lock of the records
+static void extendAddrBounds(AddrBounds *Bounds, uptr Begin, uptr End) {
+  if (Bounds->End.load(std::memory_order_relaxed) == 0 ||
+      Begin < Bounds->Begin.load(std::memory_order_relaxed))
+    Bounds->Begin.store(Begin, std::memory_order_relaxed);
+  if (End > Bounds->End.load(std::memory_order_relaxed))
+    Bounds->End.store(End, std::memory_order_relaxed);
+}
+
+// Large arrays are kept as one range record instead of one ObjTypeMap
+// entry per element. Ranges of the subobjects of one array overlap, but
+// never those of different arrays, so walking back from the closest base
+// can stop at the first range that does not cover SrcAddr.
+static bool lookupRange(uptr* SrcAddr, ObjTypeMapEntry *Result) {
+  bool Found = false;
+  pthread_rwlock_rdlock(&RangeLock);
+  auto it = ObjRangeMap->upper_bound((uptr)SrcAddr);
+  while (it != ObjRangeMap->begin()) {
+    --it;
+    ObjRangeEntry *Range = &it->second;
+    uptr Delta = (uptr)SrcAddr - it->first;
+    if (Delta >= (uptr)Range->Stride * Range->Count)
+      break;
+    if (Delta % Range->Stride == 0) {
+      Result->ObjAddr = SrcAddr;
+      Result->TypeId = Range->TypeId;
+      Result->HeapArraySize = 0;
+      Result->Offset = Range->Offset;
+      Found = true;
+      break;
+    }
+  }
+  pthread_rwlock_unlock(&RangeLock);
+  return Found;
+}
+
+static void insertRange(uptr* const AllocAddr, const uint32_t TypeId,
+                        const int Offset, const uint32_t TypeSize,
+                        const unsigned long ArraySize) {
+  ObjRangeEntry Range;
+  Range.TypeId = TypeId;
+  Range.Count = ArraySize;
+  Range.Stride = TypeSize;
+  Range.Offset = Offset;
+
+  pthread_rwlock_wrlock(&RangeLock);
+  if (ObjRangeMap == nullptr)
+    ObjRangeMap = new std::map<uptr, ObjRangeEntry>;
+  (*ObjRangeMap)[(uptr)AllocAddr] = Range;
+  extendAddrBounds(&RangeBounds, (uptr)AllocAddr,
+                   (uptr)AllocAddr + (uptr)TypeSize * ArraySize);
+  pthread_rwlock_unlock(&RangeLock);
+}
+
+// Returns the number of elements of the removed range, or 0.
+static uint64_t removeRange(uptr* const ObjectAddr) {
+  uint64_t Count = 0;
+  pthread_rwlock_wrlock(&RangeLock);
+  auto it = ObjRangeMap->find((uptr)ObjectAddr);
+  if (it != ObjRangeMap->end()) {
+    Count = it->second.Count;
+    ObjRangeMap->erase(it);
+    // the bounds only shrink once there is no range left
+    if (ObjRangeMap->empty()) {
+      RangeBounds.End.store(0, std::memory_order_relaxed);
+      RangeBounds.Begin.store(0, std::memory_order_relaxed);
+    }
+  }
+  pthread_rwlock_unlock(&RangeLock);
+  return Count;
+}
+
+// Fill the keys of Table in order of Index: an in-order walk of the
+// implicit tree, from its leftmost node.
+static void fillGlobalObjTree(GlobalObjTable *Table) {
+  const size_t Num = Table->Index.size();
+  Table->Tree.resize(Num + 1);
+  size_t k = 1;
+  while (2 * k <= Num)
+    k = 2 * k;
+  for (size_t Rank = 0; Rank < Num; Rank++) {
+    Table->Tree[k].ObjAddr = (uptr)Table->Index[Rank]->ObjAddr;
+    Table->Tree[k].Rank = Rank;
+    if (2 * k + 1 <= Num) {
+      // leftmost node of the right subtree
+      k = 2 * k + 1;
+      while (2 * k <= Num)
+        k = 2 * k;
+    } else {
+      // first ancestor whose left subtree this is
+      while (k & 1)
+        k >>= 1;
+      k >>= 1;
+    }
+  }
+}
+
+// Position in Index of the first entry starting above Addr, as
+// std::upper_bound would return it. The keys are laid out as an implicit
+// tree (children of k at 2k and 2k+1), so the loop has no data dependent
+// branch and the top levels share a few cache lines; the grandchildren
+// of k are one line, fetched two levels ahead.
+static size_t searchGlobalObjTree(const GlobalObjTable *Table,
+                                  const uptr Addr) {
+  const GlobalObjKey *Tree = Table->Tree.data();
+  const size_t Num = Table->Tree.size() - 1;
+  size_t k = 1;
+  while (k <= Num) {
+    __builtin_prefetch(&Tree[4 * k]);
+    k = 2 * k + (Tree[k].ObjAddr <= Addr);
+  }
+  // Drop the trailing right turns and the last left one
+  k >>= __builtin_ffsl(~k);
+  return k ? Tree[k].Rank : Num;
+}
+
+// Global objects are not entered one by one: each module registers its
+// table once, and the tables registered since the last lookup are merged
+// when a lookup needs it. The merged table is built aside while lookups
+// keep using the current one, and swapped in under the write lock. A
+// lookup that needs the new tables waits here for the merge.
+static void mergeGlobalTables() {
+  std::lock_guard<std::mutex> Guard(GlobalMergeLock);
+  std::vector<std::pair<const GlobalObjDesc *, uint64_t>> Tables;
+  pthread_rwlock_wrlock(&GlobalTableLock);
+  Tables.swap(*NewGlobalTables);
+  GlobalObjTable *Old = GlobalObjs;
+  pthread_rwlock_unlock(&GlobalTableLock);
+  if (Tables.empty())
+    return;
+
+  // Only merges replace GlobalObjs, so Old can be read without the lock
+  auto ByAddr = [](const GlobalObjDesc *A, const GlobalObjDesc *B) {
+    return A->ObjAddr < B->ObjAddr;
+  };
+  std::vector<const GlobalObjDesc *> Added;
+  for (auto &Table : Tables)
+    for (uint64_t i = 0; i < Table.second; i++)
+      Added.push_back(&Table.first[i]);
+  std::sort(Added.begin(), Added.end(), ByAddr);
+  GlobalObjTable *Merged = new GlobalObjTable;
+  Merged->Index.resize(Old->Index.size() + Added.size());
+  std::merge(Old->Index.begin(), Old->Index.end(), Added.begin(), Added.end(),
+             Merged->Index.begin(), ByAddr);
+  fillGlobalObjTree(Merged);
+
+  pthread_rwlock_wrlock(&GlobalTableLock);
+  GlobalObjs = Merged;
+  HasNewGlobalTable.store(!NewGlobalTables->empty(),
+                          std::memory_order_release);
+  pthread_rwlock_unlock(&GlobalTableLock);
+  // lookups only read a table under the read lock
+  delete Old;
+}
+
+// Same walk as lookupRange: the entries of one global overlap, those of
+// different globals do not.
+static bool lookupGlobalTable(uptr* SrcAddr, ObjTypeMapEntry *Result) {
+  if (HasNewGlobalTable.load(std::memory_order_acquire))
+    mergeGlobalTables();
+
+  bool Found = false;
+  pthread_rwlock_rdlock(&GlobalTableLock);
+  auto Begin = GlobalObjs->Index.begin();
+  auto it = Begin + searchGlobalObjTree(GlobalObjs, (uptr)SrcAddr);
+  while (it != Begin) {
+    --it;
+    const GlobalObjDesc *Desc = *it;
+    uptr Delta = (uptr)SrcAddr - (uptr)Desc->ObjAddr;
+    if (Delta >= (uptr)Desc->Stride * Desc->Count)
+      break;
+    if (Delta % Desc->Stride == 0) {
+      Result->ObjAddr = SrcAddr;
+      Result->TypeId = getTypeId(Desc->TypeHashValue, Desc->RuleAddr);
+      Result->HeapArraySize = 0;
+      Result->Offset = Desc->Offset;
+      Found = true;
+      break;
+    }
+  }
+  pthread_rwlock_unlock(&GlobalTableLock);
+  return Found;
+}
+
+// Runs at thread exit, still on the exiting thread
+static void freeThreadData(void *) {
+  free(FrameStack);
+  free(StackMap);
+  free(FrameGens);
+  FrameStack = nullptr;
+  StackMap = nullptr;
+  FrameGens = nullptr;
+  FrameDepth = FrameCapacity = 0;
+  StackMapMask = StackMapSize = 0;
+  FrameGenDepth = FrameGenCapacity = 0;
+  ThreadDataSet = false;
+}
+
+static void createThreadDataKey() {
+  pthread_key_create(&ThreadDataKey, freeThreadData);
+}
+
+// Any non-null value makes freeThreadData run at thread exit
+static void setThreadDataKey() {
+  if (ThreadDataSet)
+    return;
+  std::call_once(ThreadDataKeyFlag, createThreadDataKey);
+  pthread_setspecific(ThreadDataKey, (void *)1);
+  ThreadDataSet = true;
+}
+
+static void growFrameStack() {
+  uint32_t Capacity = FrameCapacity ? FrameCapacity * 2 : MINFRAMESTACK;
+  FrameRecord *Stack =
+    (FrameRecord *)realloc(FrameStack, Capacity * sizeof(FrameRecord));
+  if (Stack == nullptr) {
+    fprintf(stderr, "== HexType: cannot grow the stack frame table\n");
+    TERMINATE
+  }
+  setThreadDataKey();
+  FrameStack = Stack;
+  FrameCapacity = Capacity;
+}
+
+// Frames at or below FrameAddr are gone: the one being left, and any
+// that an exception or longjmp skipped without unregistering.
+inline void popFrames(uptr FrameAddr) {
+  while (FrameDepth != 0 && FrameStack[FrameDepth - 1].FrameAddr <= FrameAddr) {
+    FrameDepth--;
+#ifdef HEX_LOG
+    IncVal(numStackRm, FrameStack[FrameDepth].Desc->NumObj);
+#endif
+  }
+}
+
+// Resolve a local of a registered frame of this thread from its frame
+// descriptor. Addresses outside the frames are rejected with one compare
+// against the innermost and outermost frame. Frames below the runtime's
+// own were skipped by a throw or longjmp and are dropped first.
+static bool lookupFrame(uptr* SrcAddr, ObjTypeMapEntry *Result) {
+  popFrames((uptr)__builtin_frame_address(0) - 1);
+  if (FrameDepth == 0)
+    return false;
+  uptr Addr = (uptr)SrcAddr;
+  const FrameRecord *Outer = &FrameStack[0];
+  if (Addr < FrameStack[FrameDepth - 1].FrameAddr ||
+      Addr >= Outer->FrameAddr + Outer->Desc->FrameSize)
+    return false;
+
+  for (uint32_t i = FrameDepth; i-- > 0;) {
+    const FrameRecord *Frame = &FrameStack[i];
+    if (Addr < Frame->FrameAddr)
+      return false;
+    uptr Delta = Addr - Frame->FrameAddr;
+    if (Delta >= Frame->Desc->FrameSize)
+      continue;
+    for (uint32_t j = 0; j < Frame->Desc->NumEntry; j++) {
+      const FrameDescEntry *Entry = &Frame->Desc->Entry[j];
+      if (Delta < Entry->FrameOffset)
+        continue;
+      uptr ObjDelta = Delta - Entry->FrameOffset;
+      if (ObjDelta < (uptr)Entry->Stride * Entry->Count &&
+          ObjDelta % Entry->Stride == 0) {
+        Result->ObjAddr = SrcAddr;
+        Result->TypeId = getTypeId(Entry->TypeHashValue, Entry->RuleAddr);
+        Result->HeapArraySize = 0;
+        Result->Offset = Entry->Offset;
+        return true;
+      }
+    }
+    return false;
+  }
+  return false;
+}
+
+static void initThreadStack() {
+  pthread_attr_t Attr;
+  void *Bottom;
+  size_t Size;
+  if (pthread_getattr_np(pthread_self(), &Attr) != 0 ||
+      pthread_attr_getstack(&Attr, &Bottom, &Size) != 0) {
+    // unknown bounds: every stack object goes to ObjTypeMap
+    ThreadStackBottom = ThreadStackTop = 1;
+    return;
+  }
+  pthread_attr_destroy(&Attr);
+  ThreadStackBottom = (uptr)Bottom;
+  ThreadStackTop = (uptr)Bottom + Size;
+}
+
+// Whether Addr is on the stack of the calling thread. Objects on other
+// stacks, such as a sigaltstack, stay in ObjTypeMap.
+inline bool isThreadStack(uptr Addr) {
+  if (ThreadStackTop == 0)
+    initThreadStack();
+  return Addr - ThreadStackBottom < ThreadStackTop - ThreadStackBottom;
+}
+
+inline uptr getStackMapIndex(uptr Addr) {
+  return (Addr >> 3) & StackMapMask;
+}
+
+// Frames below the caller's stack pointer have returned
+inline void popFrameGens(uptr StackSP) {
+  while (FrameGenDepth != 0 && FrameGens[FrameGenDepth - 1].FrameAddr < StackSP)
+    FrameGenDepth--;
+}
+
+// New generation for a call whose frame is at FrameAddr. Frames at or
+// below it have returned, including an earlier call at the same address.
+static uint32_t pushFrameGen(uptr FrameAddr) {
+  while (FrameGenDepth != 0 &&
+         FrameGens[FrameGenDepth - 1].FrameAddr <= FrameAddr)
+    FrameGenDepth--;
+
+  if (FrameGenDepth == FrameGenCapacity) {
+    uint32_t Capacity = FrameGenCapacity ? FrameGenCapacity * 2 : MINFRAMESTACK;
+    StackFrameGen *Gens =
+      (StackFrameGen *)realloc(FrameGens, Capacity * sizeof(StackFrameGen));
+    if (Gens == nullptr) {
+      fprintf(stderr, "== HexType: cannot grow the stack frame table\n");
+      TERMINATE
+    }
+    setThreadDataKey();
+    FrameGens = Gens;
+    FrameGenCapacity = Capacity;
+  }
+  // generation 0 marks entries that are removed explicitly
+  if (++LastFrameGen == 0)
+    LastFrameGen = 1;
+  FrameGens[FrameGenDepth].FrameAddr = FrameAddr;
+  FrameGens[FrameGenDepth].Gen = LastFrameGen;
+  return FrameGens[FrameGenDepth++].Gen;
+}
+
+// Whether the frame of Entry is still live. StackSP is the stack pointer
+// of the runtime, below every live frame of the thread, so an object
+// below it is dead whether or not it was removed.
+static bool isStackEntryLive(const StackMapEntry *Entry, uptr StackSP) {
+  if ((uptr)Entry->ObjAddr < StackSP)
+    return false;
+  if (Entry->Gen == 0)
+    return true;
+  if (Entry->FrameAddr < StackSP)
+    return false;
+  uint32_t Low = 0, High = FrameGenDepth;
+  while (Low < High) {
+    uint32_t Mid = (Low + High) / 2;
+    if (FrameGens[Mid].FrameAddr > Entry->FrameAddr)
+      Low = Mid + 1;
+    else
+      High = Mid;
+  }
+  return Low < FrameGenDepth && FrameGens[Low].FrameAddr == Entry->FrameAddr &&
+    FrameGens[Low].Gen == Entry->Gen;
+}
+
+static void insertStackSlot(const StackMapEntry *Entry);
+
+// Dead entries are dropped here rather than at removal; the table only
+// grows if it is still a quarter full without them.
+static void growStackMap() {
+  StackMapEntry *OldMap = StackMap;
+  uptr OldCapacity = OldMap ? StackMapMask + 1 : 0;
+  uptr OldSize = StackMapSize;
+  uptr StackSP = (uptr)__builtin_frame_address(0);
+  uptr NumLive = 0;
+  popFrameGens(StackSP);
+  for (uptr i = 0; i < OldCapacity; i++)
+    if (OldMap[i].ObjAddr != nullptr && isStackEntryLive(&OldMap[i], StackSP))
+      NumLive++;
+
+  uptr Capacity = OldCapacity;
+  if (Capacity == 0)
+    Capacity = MINSTACKMAP;
+  else if (NumLive * 4 >= Capacity)
+    Capacity *= 2;
+  StackMap = (StackMapEntry *)calloc(Capacity, sizeof(StackMapEntry));
+  if (StackMap == nullptr) {
+    fprintf(stderr, "== HexType: cannot grow the stack object table\n");
+    TERMINATE
+  }
+  setThreadDataKey();
+  StackMapMask = Capacity - 1;
+  StackMapSize = 0;
+  for (uptr i = 0; i < OldCapacity; i++)
+    if (OldMap[i].ObjAddr != nullptr && isStackEntryLive(&OldMap[i], StackSP))
+      insertStackSlot(&OldMap[i]);
+  free(OldMap);
+#ifdef HEX_LOG
+  IncVal(numStackLazyRm, OldSize - NumLive);
+  if (Capacity != OldCapacity)
+    IncVal(numStackMapGrow, 1);
+#endif
+}
+
+static void insertStackSlot(const StackMapEntry *Entry) {
+  if ((StackMapSize + 1) * 2 > (StackMap ? StackMapMask + 1 : 0))
+    growStackMap();
+  uptr i = getStackMapIndex((uptr)Entry->ObjAddr);
+  while (StackMap[i].ObjAddr != nullptr &&
+         StackMap[i].ObjAddr != Entry->ObjAddr)
+    i = (i + 1) & StackMapMask;
+  if (StackMap[i].ObjAddr == nullptr)
+    StackMapSize++;
+  StackMap[i] = *Entry;
+}
+
+static StackMapEntry *lookupStackSlot(uptr* const SrcAddr) {
+  if (StackMap == nullptr)
+    return nullptr;
+  for (uptr i = getStackMapIndex((uptr)SrcAddr); StackMap[i].ObjAddr != nullptr;
+       i = (i + 1) & StackMapMask)
+    if (StackMap[i].ObjAddr == SrcAddr)
+      return &StackMap[i];
+  return nullptr;
+}
+
+// Backward shift deletion: entries after the hole that may live there
+// move up, so probing never needs tombstones.
+static bool removeStackSlot(uptr* const TargetAddr) {
+  StackMapEntry *Slot = lookupStackSlot(TargetAddr);
+  if (Slot == nullptr)
+    return false;
+  uptr i = Slot - StackMap;
+  for (uptr j = (i + 1) & StackMapMask; StackMap[j].ObjAddr != nullptr;
+       j = (j + 1) & StackMapMask) {
+    uptr Home = getStackMapIndex((uptr)StackMap[j].ObjAddr);
+    if (((j - Home) & StackMapMask) >= ((j - i) & StackMapMask)) {
+      StackMap[i] = StackMap[j];
+      i = j;
+    }
+  }
+  StackMap[i].ObjAddr = nullptr;
+  StackMapSize--;
+  return true;
+}
+
+// Find the entry of SrcAddr without touching the statistics. The probe
+// group is read lock-free; the spill tree is searched under its lock.
+// Returns 3 for elements of a range record, 4 for locals of a registered
+// stack frame, 5 for entries of the thread's stack table and 6 for
+// objects of a global object table. Entries of single objects come first:
+// a placement new over a frame local or a global takes precedence over
+// the static type in the descriptor.
+inline int lookupObjInfo(uptr* SrcAddr, ObjTypeMapEntry *Result) {
+  if (StackMapSize != 0 && isThreadStack((uptr)SrcAddr)) {
+    StackMapEntry *Slot = lookupStackSlot(SrcAddr);
+    if (Slot != nullptr) {
+      uptr StackSP = (uptr)__builtin_frame_address(0);
+      if (isStackEntryLive(Slot, StackSP)) {
+        Result->ObjAddr = SrcAddr;
+        Result->TypeId = Slot->TypeId;
+        Result->HeapArraySize = 0;
+        Result->Offset = Slot->Offset;
+        return 5;
+      }
+      popFrameGens(StackSP);
+      removeStackSlot(SrcAddr);
+#ifdef HEX_LOG
+      IncVal(numStackLazyRm, 1);
+#endif
+    }
+  }
+
+  uptr MapIndex = getHash((uptr)SrcAddr);
+  std::atomic<uint32_t> *Seq = getSlotSeq(MapIndex);
+  int Found;
+  bool Spilled;
+  for (;;) {
+    uint32_t Begin = Seq->load(std::memory_order_acquire);
+    if (Begin & 1) {
+      __builtin_ia32_pause();
+      continue;
+    }
+    ObjTypeMapEntry *Slot;
+    Found = searchGroup(MapIndex, SrcAddr, &Slot);
+    if (Found)
+      *Result = *Slot;
+    Spilled = !Found && getBucketInfo(MapIndex)->Spilled != 0;
+    std::atomic_thread_fence(std::memory_order_acquire);
+    if (Seq->load(std::memory_order_relaxed) == Begin)
+      break;
+  }
+
+  if (Spilled) {
+    std::lock_guard<std::mutex> Guard(SpillLock);
+    ObjTypeMapEntry *FindValue =
+      (ObjTypeMapEntry *)rbtree_lookup(ObjTypeMapSpill, SrcAddr);
+    if (FindValue != nullptr) {
+      *Result = *FindValue;
+      Found = 2;
+    }
+  }
+
+  if (!Found && FrameDepth != 0 && lookupFrame(SrcAddr, Result))
+    Found = 4;
+  if (!Found && inAddrBounds(&RangeBounds, (uptr)SrcAddr) &&
+      lookupRange(SrcAddr, Result))
+    Found = 3;
+  if (!Found && inAddrBounds(&GlobalObjBounds, (uptr)SrcAddr) &&
+      lookupGlobalTable(SrcAddr, Result))
+    Found = 6;
+  return Found;
+}
+
+// Store an entry that lost its home slot: first a free way of its home
+// bucket, then any free slot of the probe group, and only if the whole
+// group is taken the spill tree. Callers hold the group lock.
+static void storeDisplaced(const ObjTypeMapEntry *Entry) {
+  uptr MapIndex = getHash((uptr)Entry->ObjAddr);
+  uptr Bucket = getBucket(MapIndex);
+  uptr Group = getGroup(MapIndex);
+  for (uptr i = Bucket; i < Bucket + MAPWAYS; i++)
+    if (ObjTypeMap[i].ObjAddr == nullptr) {
+      ObjTypeMap[i] = *Entry;
+      return;
+    }
+  for (uptr i = Group; i < Group + MAPGROUP; i++)
+    if (ObjTypeMap[i].ObjAddr == nullptr) {
+      ObjTypeMap[i] = *Entry;
+      getBucketInfo(MapIndex)->Displaced++;
+      return;
+    }
+
+#ifdef HEX_LOG
+  IncVal(numUpdateSpill, 1);
+#endif
+  ObjTypeMapEntry *ObjValue =
+    (ObjTypeMapEntry*)malloc(sizeof(ObjTypeMapEntry));
+  memcpy(ObjValue, Entry, sizeof(ObjTypeMapEntry));
+  std::lock_guard<std::mutex> Guard(SpillLock);
+  if (ObjTypeMapSpill == nullptr)
+    ObjTypeMapSpill = rbtree_create();
+  rbtree_insert(ObjTypeMapSpill, ObjValue->ObjAddr, ObjValue);
+  getBucketInfo(MapIndex)->Spilled++;
+}
+
+// Callers hold the group lock. Returns 1 if the object was in its home
+// slot, 2 if it was found elsewhere and 0 if it was not tracked.
+static int removeSlot(uptr MapIndex, uptr* const TargetAddr) {
+  ObjTypeMapEntry *Slot;
+  int Found = searchGroup(MapIndex, TargetAddr, &Slot);
+  if (Found) {
+    if (!inHomeBucket(Slot))
+      getBucketInfo(MapIndex)->Displaced--;
+    Slot->ObjAddr = nullptr;
+    return Found;
+  }
+
+  MapBucketInfo *Info = getBucketInfo(MapIndex);
+  if (Info->Spilled == 0)
+    return 0;
+  std::lock_guard<std::mutex> Guard(SpillLock);
+  ObjTypeMapEntry *FindValue =
+    (ObjTypeMapEntry *)rbtree_lookup(ObjTypeMapSpill, TargetAddr);
+  if (FindValue == nullptr)
+    return 0;
+  rbtree_delete(ObjTypeMapSpill, TargetAddr);
+  free(FindValue);
+  Info->Spilled--;
+  return 2;
+}
+
+// Callers hold the group lock. The newest object always takes its home
+// slot, which is the only slot the inlined checks look at; a different
+// object found there moves to another slot of the group.
+static void insertSlot(uptr MapIndex, uptr* const AllocAddr,
+                       const uint32_t TypeId, const int Offset,
+                       const uint32_t ArraySize) {
+  ObjTypeMapEntry *Slot = &ObjTypeMap[MapIndex];
+  if (Slot->ObjAddr != AllocAddr) {
+    // Drop an older entry of the same object stored outside its home slot.
+    removeSlot(MapIndex, AllocAddr);
+
+    if (Slot->ObjAddr != nullptr) {
+#ifdef HEX_LOG
+      IncVal(numUpdateMiss, 1);
+#endif
+      bool WasDisplaced = !inHomeBucket(Slot);
+      uptr *OldAddr = Slot->ObjAddr;
+      storeDisplaced(Slot);
+      if (WasDisplaced)
+        getBucketInfo(getHash((uptr)OldAddr))->Displaced--;
+    }
+  }
+  Slot->ObjAddr = AllocAddr;
+  Slot->TypeId = TypeId;
+  Slot->HeapArraySize = ArraySize > 1 ? ArraySize : 0;
+  Slot->Offset = Offset;
+}
+
+// ObjTypeMap is searched before the ranges, so entries left at the
+// element addresses of a new range, e.g. by objects freed without
+// removal, would shadow it. Most elements have none: a group whose page
+// of ObjTypeMap was never touched holds no entry and none of its bucket
+// was spilled, and the other groups are read under the sequence lock and
+// only locked to remove an entry.
+static void clearRangeSlots(uptr* const AllocAddr, const uint32_t TypeSize,
+                            const unsigned long ArraySize) {
+  uptr LastAddr = (uptr)AllocAddr + (uptr)TypeSize * (ArraySize - 1);
+  uptr FirstPage = (uptr)&ObjTypeMap[getGroup(getHash((uptr)AllocAddr))] &
+    ~((uptr)MAPPAGESIZE - 1);
+  uptr LastPage = (uptr)&ObjTypeMap[getHash(LastAddr)] &
+    ~((uptr)MAPPAGESIZE - 1);
+  std::vector<unsigned char> Resident;
+  if (getHashRegion((uptr)AllocAddr) == getHashRegion(LastAddr) &&
+      LastPage >= FirstPage) {
+    Resident.resize((LastPage - FirstPage) / MAPPAGESIZE + 1);
+    if (mincore((void *)FirstPage, LastPage + MAPPAGESIZE - FirstPage,
+                Resident.data()) != 0)
+      Resident.clear();
+  }
+
+  for (unsigned long i = 0; i < ArraySize; i++) {
+    uptr *addr = (uptr *)((char *)AllocAddr + (uptr)TypeSize * i);
+    uptr MapIndex = getHash((uptr)addr);
+    if (!Resident.empty()) {
+      uptr Page = (uptr)&ObjTypeMap[getGroup(MapIndex)] &
+        ~((uptr)MAPPAGESIZE - 1);
+      if (!(Resident[(Page - FirstPage) / MAPPAGESIZE] & 1)) {
+        // skip the other elements of this page; slots are 8 bytes of
+        // address apart within a region
+        uptr NextIndex = (Page + MAPPAGESIZE - (uptr)ObjTypeMap) /
+          sizeof(ObjTypeMapEntry);
+        uptr Skip = (NextIndex - MapIndex) * 8 / TypeSize;
+        if (Skip > 1)
+          i += Skip - 1;
+        continue;
+      }
+    }
+    std::atomic<uint32_t> *Seq = getSlotSeq(MapIndex);
+    bool Tracked;
+    for (;;) {
+      uint32_t Begin = Seq->load(std::memory_order_acquire);
+      if (Begin & 1) {
+        __builtin_ia32_pause();
+        continue;
+      }
+      ObjTypeMapEntry *Slot;
+      Tracked = searchGroup(MapIndex, addr, &Slot) != 0 ||
+        getBucketInfo(MapIndex)->Spilled != 0;
+      std::atomic_thread_fence(std::memory_order_acquire);
+      if (Seq->load(std::memory_order_relaxed) == Begin)
+        break;
+    }
+    if (!Tracked)
+      continue;
+    lockSlot(MapIndex);
+    removeSlot(MapIndex, addr);
+    unlockSlot(MapIndex);
+  }
+}
+// ObjTypeMap and the type tables are reserved like sanitizer shadow
+// memory: nothing is committed until a page is touched for the first time.
+static void *reserveShadowMemory(uptr Size, const char *Name) {
+  void *Res = mmap(nullptr, Size, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  if (Res == MAP_FAILED) {
+    fprintf(stderr, "== HexType: failed to reserve %zu bytes for %s\n",
+            (size_t)Size, Name);
+    TERMINATE
+  }
+  return Res;
+}
+
+#ifndef MAP_FIXED_NOREPLACE
+#define MAP_FIXED_NOREPLACE 0x100000
+#endif
+
+// Like reserveShadowMemory, but at Addr. Kernels without
+// MAP_FIXED_NOREPLACE take Addr as a hint, so the result is checked.
+static void *reserveFixedShadowMemory(uptr Addr, uptr Size, const char *Name) {
+  if (Addr == 0)
+    return reserveShadowMemory(Size, Name);
+  void *Res = mmap((void *)Addr, Size, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE |
+                   MAP_FIXED_NOREPLACE, -1, 0);
+  if (Res != (void *)Addr) {
+    if (Res != MAP_FAILED)
+      munmap(Res, Size);
+    fprintf(stderr, "== HexType: failed to reserve %zu bytes for %s at %p, "
+            "rebuild with another OBJTYPEMAPBASE\n",
+            (size_t)Size, Name, (void *)Addr);
+    TERMINATE
+  }
+  return Res;
+}
+
+// Give one page of ObjTypeMap back to the kernel if no live entry
+// (including entries straddling the page boundary) is stored in it.
+static bool releaseMapPage(char *PageAddr) {
+  char *MapBase = (char *)ObjTypeMap;
+  uptr First = (PageAddr - MapBase) / sizeof(ObjTypeMapEntry);
+  uptr Last = (PageAddr + MAPPAGESIZE - 1 - MapBase) / sizeof(ObjTypeMapEntry);
+  if (Last >= getMapSize())
+    Last = getMapSize() - 1;
+
+  // Only one releaser runs at a time (ReleaseLock), so taking several
+  // stripes here cannot deadlock with the single-stripe writers.
+  for (uptr i = getGroup(First); i <= Last; i += MAPGROUP)
+    lockSlot(i);
+
+  bool Empty = true;
+  for (uptr i = First; i <= Last && Empty; i++)
+    if (ObjTypeMap[i].ObjAddr != nullptr)
+      Empty = false;
+
+  // Pages that still read as zero were never committed (or only mapped
+  // the shared zero page while a neighbour was checked).
+  if (Empty) {
+    uptr *Word = (uptr *)PageAddr;
+    uptr *WordEnd = (uptr *)(PageAddr + MAPPAGESIZE);
+    while (Word < WordEnd && *Word == 0)
+      Word++;
+    if (Word == WordEnd)
+      Empty = false;
+  }
+
+  if (Empty) {
+    madvise(PageAddr, MAPPAGESIZE, MADV_DONTNEED);
 #ifdef HEX_LOG
-      IncVal(numLookHit, 1);
+    IncVal(numReleasedPage, 1);
 #endif
-      return &ObjTypeMap[MapIndex];
+  }
+
+  for (uptr i = getGroup(First); i <= Last; i += MAPGROUP)
+    unlockSlot(i);
+  return Empty;
+}
+
+static uptr releaseMapRange(uptr FirstIndex, uptr LastIndex) {
+  uptr Begin = (uptr)&ObjTypeMap[FirstIndex];
+  uptr End = (uptr)&ObjTypeMap[LastIndex + 1];
+  Begin = (Begin + MAPPAGESIZE - 1) & ~((uptr)MAPPAGESIZE - 1);
+  End &= ~((uptr)MAPPAGESIZE - 1);
+
+  uptr Released = 0;
+  std::lock_guard<std::mutex> Guard(ReleaseLock);
+  for (uptr Page = Begin; Page < End; Page += MAPPAGESIZE)
+    if (releaseMapPage((char *)Page))
+      Released++;
+  return Released;
+}
+
+// Call Fn on every resident page of ObjTypeMap. Callers hold ReleaseLock,
+// which also guards the residency buffer.
+template <typename Callback>
+static void forEachResidentMapPage(Callback Fn) {
+  uptr MapSize = getMapSize() * sizeof(ObjTypeMapEntry);
+  uptr MapBegin = (uptr)ObjTypeMap;
+  static unsigned char Resident[MINCORECHUNK / MAPPAGESIZE];
+  for (uptr Chunk = 0; Chunk < MapSize; Chunk += MINCORECHUNK) {
+    uptr ChunkSize = MapSize - Chunk;
+    if (ChunkSize > MINCORECHUNK)
+      ChunkSize = MINCORECHUNK;
+    ChunkSize &= ~((uptr)MAPPAGESIZE - 1);
+    if (mincore((void *)(MapBegin + Chunk), ChunkSize, Resident) != 0)
+      continue;
+    for (uptr Page = 0; Page < ChunkSize / MAPPAGESIZE; Page++)
+      if (Resident[Page] & 1)
+        Fn((char *)(MapBegin + Chunk + Page * MAPPAGESIZE));
+  }
+}
+
+// Walk the resident part of ObjTypeMap and release every page that became
+// empty. Returns the number of released pages.
+extern "C" SANITIZER_INTERFACE_ATTRIBUTE
+uptr __hextype_release_empty_pages() {
+  if (ObjTypeMap == nullptr)
+    return 0;
+
+  uptr Released = 0;
+  std::lock_guard<std::mutex> Guard(ReleaseLock);
+  forEachResidentMapPage([&](char *Page) {
+    if (releaseMapPage(Page))
+      Released++;
+  });
+  return Released;
+}
+
+typedef struct MapSweepStat {
+  uptr Entry;
+  uptr Resident;
+  uptr Depth[4];    // home slot, home bucket, probe group, spill tree
+  uptr SpillHeight;
+  uptr Stale;
+  uptr Removed;
+  uptr Compacted;
+  uptr MappedPage;
+  uptr UnmappedPage;
+  uptr StackSP;
+} MapSweepStat;
+
+// An entry is certainly stale if its object's memory is no longer mapped,
+// or it lies on the sweeping thread's stack below the sweeper's frame.
+// Objects freed back to the allocator cannot be told apart from live ones.
+static bool isStaleObject(uptr ObjAddr, MapSweepStat *Stat) {
+  if (isThreadStack(ObjAddr))
+    return ObjAddr < Stat->StackSP;
+  uptr Page = ObjAddr & ~((uptr)MAPPAGESIZE - 1);
+  if (Page == Stat->MappedPage)
+    return false;
+  if (Page == Stat->UnmappedPage)
+    return true;
+  unsigned char Resident;
+  if (mincore((void *)Page, MAPPAGESIZE, &Resident) != 0 && errno == ENOMEM) {
+    Stat->UnmappedPage = Page;
+    return true;
+  }
+  Stat->MappedPage = Page;
+  return false;
+}
+
+static void sweepGroup(uptr Group, MapSweepStat *Stat, bool Compact) {
+  lockSlot(Group);
+  for (uptr i = Group; i < Group + MAPGROUP; i++) {
+    ObjTypeMapEntry *Slot = &ObjTypeMap[i];
+    if (Slot->ObjAddr == nullptr)
+      continue;
+    if (isStaleObject((uptr)Slot->ObjAddr, Stat)) {
+      Stat->Stale++;
+      if (Compact) {
+        if (!inHomeBucket(Slot))
+          getBucketInfo(getHash((uptr)Slot->ObjAddr))->Displaced--;
+        Slot->ObjAddr = nullptr;
+        Stat->Removed++;
+        continue;
+      }
+    }
+    Stat->Entry++;
+    if (i == getHash((uptr)Slot->ObjAddr))
+      Stat->Depth[0]++;
+    else if (inHomeBucket(Slot))
+      Stat->Depth[1]++;
+    else
+      Stat->Depth[2]++;
+  }
+  unlockSlot(Group);
+}
+
+typedef struct SpillKeys {
+  std::vector<uptr *> Keys;
+  uptr Height;
+} SpillKeys;
+
+static void collectSpillKey(void *Key, void *, int Depth, void *Arg) {
+  SpillKeys *Spill = (SpillKeys *)Arg;
+  Spill->Keys.push_back((uptr *)Key);
+  if ((uptr)Depth > Spill->Height)
+    Spill->Height = Depth;
+}
+
+// Move spilled entries back into their probe group where a slot became
+// free, and drop the stale ones. Spilled entries that stay are counted at
+// depth 3.
+static void sweepSpill(MapSweepStat *Stat, bool Compact) {
+  SpillKeys Spill;
+  Spill.Height = 0;
+  {
+    std::lock_guard<std::mutex> Guard(SpillLock);
+    if (ObjTypeMapSpill == nullptr)
+      return;
+    rbtree_walk(ObjTypeMapSpill, collectSpillKey, &Spill);
+  }
+  Stat->SpillHeight = Spill.Height;
+
+  for (uptr *Key : Spill.Keys) {
+    uptr MapIndex = getHash((uptr)Key);
+    lockSlot(MapIndex);
+    {
+      std::lock_guard<std::mutex> Guard(SpillLock);
+      ObjTypeMapEntry *Entry =
+        (ObjTypeMapEntry *)rbtree_lookup(ObjTypeMapSpill, Key);
+      ObjTypeMapEntry *Free = nullptr;
+      bool Stale = Entry && isStaleObject((uptr)Entry->ObjAddr, Stat);
+      if (Entry && Compact && !Stale) {
+        uptr Group = getGroup(MapIndex);
+        for (uptr i = Group; i < Group + MAPGROUP && !Free; i++)
+          if (ObjTypeMap[i].ObjAddr == nullptr)
+            Free = &ObjTypeMap[i];
+      }
+      if (Entry && Stale)
+        Stat->Stale++;
+      if (Entry && Compact && (Stale || Free)) {
+        if (Free) {
+          *Free = *Entry;
+          if (!inHomeBucket(Free))
+            getBucketInfo(MapIndex)->Displaced++;
+          Stat->Compacted++;
+          Stat->Entry++;
+          Stat->Depth[inHomeBucket(Free) ? 1 : 2]++;
+        } else {
+          Stat->Removed++;
+        }
+        rbtree_delete(ObjTypeMapSpill, Key);
+        free(Entry);
+        getBucketInfo(MapIndex)->Spilled--;
+      } else if (Entry) {
+        Stat->Entry++;
+        Stat->Depth[3]++;
+      }
     }
+    unlockSlot(MapIndex);
+  }
+}
+
+// Scan the resident part of ObjTypeMap and the spill tree for occupancy
+// and stale entries. With Compact, stale entries are removed, spilled
+// entries move back into free group slots, and emptied pages are released.
+static uptr sweepMap(bool Compact) {
+  MapSweepStat Stat;
+  memset(&Stat, 0, sizeof(Stat));
+  Stat.StackSP = (uptr)__builtin_frame_address(0);
+  Stat.MappedPage = Stat.UnmappedPage = 1;
+
+  std::lock_guard<std::mutex> Guard(ReleaseLock);
+  forEachResidentMapPage([&](char *Page) {
+    uptr First = (Page - (char *)ObjTypeMap) / sizeof(ObjTypeMapEntry);
+    Stat.Resident += MAPPAGESIZE / sizeof(ObjTypeMapEntry);
+    for (uptr Group = First;
+         Group < First + MAPPAGESIZE / sizeof(ObjTypeMapEntry);
+         Group += MAPGROUP)
+      sweepGroup(Group, &Stat, Compact);
+  });
+  sweepSpill(&Stat, Compact);
+  if (Compact)
+    forEachResidentMapPage([&](char *Page) { releaseMapPage(Page); });
 
-    if (ObjTypeMap[MapIndex].HexTree != nullptr &&
-        ObjTypeMap[MapIndex].HexTree->root != nullptr) {
-      ObjTypeMapEntry *FindValue =
-        (ObjTypeMapEntry *)rbtree_lookup(ObjTypeMap[MapIndex].HexTree, SrcAddr);
 #ifdef HEX_LOG
-      if (FindValue != nullptr)
-        IncVal(numLookMiss, 1);
-      else
-        IncVal(numLookFail, 1);
+  IncVal(numSweep, 1);
+  SetVal(numMapSlot, getMapSize());
+  SetVal(numMapEntry, Stat.Entry);
+  SetVal(numMapResident, Stat.Resident);
+  SetVal(numMapDepthHome, Stat.Depth[0]);
+  SetVal(numMapDepthBucket, Stat.Depth[1]);
+  SetVal(numMapDepthGroup, Stat.Depth[2]);
+  SetVal(numMapDepthSpill, Stat.Depth[3]);
+  SetVal(numSpillHeight, Stat.SpillHeight);
+  SetVal(numMapStale, Stat.Stale);
+  IncVal(numSweepRemoved, Stat.Removed);
+  IncVal(numSweepCompacted, Stat.Compacted);
 #endif
-      return FindValue;
-    }
+  return Stat.Removed + Stat.Compacted;
+}
+
+// Remove stale entries and compact the spill tree. Returns the number of
+// entries removed or moved back into ObjTypeMap.
+extern "C" SANITIZER_INTERFACE_ATTRIBUTE
+uptr __hextype_sweep_map() {
+  if (ObjTypeMap == nullptr)
+    return 0;
+  return sweepMap(true);
+}
+
+static void *sweepLoop(void *Arg) {
+  unsigned Interval = (unsigned)(uptr)Arg;
+  for (;;) {
+    sleep(Interval);
+    sweepMap(true);
+  }
+  return nullptr;
+}
+
+// HEXTYPE_SWEEP_INTERVAL=<seconds> sweeps ObjTypeMap in the background
+static void startSweeper() {
+  const char *Interval = getenv("HEXTYPE_SWEEP_INTERVAL");
+  if (Interval == nullptr || atoi(Interval) <= 0)
+    return;
+  pthread_t Sweeper;
+  pthread_attr_t Attr;
+  pthread_attr_init(&Attr);
+  pthread_attr_setdetachstate(&Attr, PTHREAD_CREATE_DETACHED);
+  if (pthread_create(&Sweeper, &Attr, sweepLoop,
+                     (void *)(uptr)atoi(Interval)) != 0)
+    fprintf(stderr, "== HexType: cannot start the map sweeper\n");
+  pthread_attr_destroy(&Attr);
+}
+
 #ifdef HEX_LOG
-    IncVal(numLookFail, 1);
+// Registered after the statistics printer, so it runs first
+static void sweepAtExit() {
+  sweepMap(false);
+}
 #endif
-    return nullptr;
+
+__attribute__((always_inline))
+  inline bool findObjInfo(uptr* SrcAddr, ObjTypeMapEntry *Result) {
+    int Found = lookupObjInfo(SrcAddr, Result);
+#ifdef HEX_LOG
+    if (Found == 1)
+      IncVal(numLookHit, 1);
+    else if (Found == 2)
+      IncVal(numLookMiss, 1);
+    else if (Found == 3)
+      IncVal(numLookRange, 1);
+    else if (Found == 4)
+      IncVal(numLookFrame, 1);
+    else if (Found == 5)
+      IncVal(numLookStack, 1);
+    else if (Found == 6)
+      IncVal(numLookGlobal, 1);
+    else
+      IncVal(numLookFail, 1);
+#endif
+    return Found != 0;
   }
 
 __attribute__((always_inline))
@@ -46,8 +1608,9 @@ __attribute__((always_inline))
 #ifdef HEX_LOG
     IncVal(numCasting, 1);
 #endif
-    ObjTypeMapEntry *FindValue = findObjInfo(SrcAddr);
-    if (!FindValue)
+    ObjTypeMapEntry SrcEntry;
+    ObjTypeMapEntry *FindValue = &SrcEntry;
+    if (!findObjInfo(SrcAddr, FindValue))
       return DstAddr;
 #ifdef HEX_LOG
     IncVal(numVerifiedCasting, 1);
@@ -58,10 +1621,11 @@ __attribute__((always_inline))
         OffsetTmp = 0;
       long offset = ((char *)DstAddr - ((char *)SrcAddr - OffsetTmp));
 
-      FindValue = findObjInfo(DstAddr);
+      if (!findObjInfo(DstAddr, FindValue))
+        FindValue = nullptr;
       if (offset < 0) {
         if (FindValue) {
-          uint64_t SrcTypeHashValue = FindValue->TypeHashValue;
+          uint64_t SrcTypeHashValue = getTypeInfo(FindValue)->TypeHashValue;
           if (SrcTypeHashValue == DstTypeHashValue) {
 #ifdef HEX_LOG
             IncVal(numCastSame, 1);
@@ -92,120 +1656,62 @@ __attribute__((always_inline))
       }
     }
 
-    uint64_t SrcTypeHashValue = FindValue->TypeHashValue;
-    uint64_t CacheIndex;
-    CacheIndex = (SrcTypeHashValue & 0xfff);
-    CacheIndex <<= 12;
-    CacheIndex |= (DstTypeHashValue & 0xfff);
-
+    uint32_t SrcTypeId = FindValue->TypeId;
+    uint64_t SrcTypeHashValue = getTypeInfo(FindValue)->TypeHashValue;
     if (SrcTypeHashValue == DstTypeHashValue) {
 #ifdef HEX_LOG
       IncVal(numCastNoCacheUse, 1);
       IncVal(numCastSame, 1);
 #endif
-      VerifyResultCache[CacheIndex].SrcHValue = SrcTypeHashValue;
-      VerifyResultCache[CacheIndex].DstHValue = DstTypeHashValue;
-      VerifyResultCache[CacheIndex].VerifyResult = SAFECASTSAME;
       return DstAddr;
     }
 
-    if (VerifyResultCache[CacheIndex].SrcHValue == SrcTypeHashValue &&
-        VerifyResultCache[CacheIndex].DstHValue == DstTypeHashValue) {
+    uint32_t CacheSet = getCacheSet(SrcTypeId, DstTypeHashValue);
+    int CacheResult = lookupLocalCache(CacheSet, SrcTypeId, DstTypeHashValue);
+    if (CacheResult >= 0) {
 #ifdef HEX_LOG
-      IncVal(numCastHit, 1);
+      IncVal(numCastLocalHit, 1);
 #endif
-      if (VerifyResultCache[CacheIndex].VerifyResult != BADCAST) {
+    } else {
+      CacheResult = lookupVerifyCache(SrcTypeId, DstTypeHashValue);
+      if (CacheResult >= 0) {
 #ifdef HEX_LOG
-        char VerifyResult = VerifyResultCache[CacheIndex].VerifyResult;
-        switch (VerifyResult) {
-        case SAFECASTUPCAST:
-          IncVal(numCastNonBadCast, 1);
-          break;
-        case SAFECASTSAME:
-          IncVal(numCastSame, 1);
-          break;
-        case FAILINFO:
-          IncVal(numMissFindObj, 1);
-          break;
-        }
+        IncVal(numCastHit, 1);
 #endif
-        return DstAddr;
+        insertLocalCache(CacheSet, SrcTypeId, DstTypeHashValue, CacheResult);
       }
     }
 
+    // the caches hold safe results only
+    if (CacheResult >= 0) {
+#ifdef HEX_LOG
+      if (CacheResult == SAFECASTSAME)
+        IncVal(numCastSame, 1);
+      else
+        IncVal(numCastNonBadCast, 1);
+#endif
+      return DstAddr;
+    }
+
     else {
 #ifdef HEX_LOG
       IncVal(numCastMiss, 1);
 #endif
-      uptr* RuleAddr = FindValue->RuleAddr;
-      if (RuleAddr) {
-        uint64_t RuleHash;
-        char *BaseAddr = (char *)RuleAddr;
-        uint64_t RuleSize = *(FindValue->RuleAddr);
-        uint64_t start = 1, end = RuleSize, middle;
-        middle = (start + end) / 2;
-
-        while (start <= end) {
-          RuleHash = *((uint64_t *)(BaseAddr + (sizeof(uint64_t) * middle)));
-
-          if (RuleHash < DstTypeHashValue)
-            start = middle + 1;
-          else if(RuleHash == DstTypeHashValue) {
-            VerifyResultCache[CacheIndex].SrcHValue = SrcTypeHashValue;
-            VerifyResultCache[CacheIndex].DstHValue = DstTypeHashValue;
-            VerifyResultCache[CacheIndex].VerifyResult = SAFECASTUPCAST;
+      char VerifyResult = checkCastRule(SrcTypeId, DstTypeHashValue);
+      insertLocalCache(CacheSet, SrcTypeId, DstTypeHashValue, VerifyResult);
+      insertVerifyCache(SrcTypeId, DstTypeHashValue, VerifyResult);
+      if (VerifyResult == SAFECASTUPCAST) {
 #ifdef HEX_LOG
-            IncVal(numCastNonBadCast, 1);
+        IncVal(numCastNonBadCast, 1);
 #endif
-            return DstAddr;
-          }
-          else
-            end = middle - 1;
-          middle = (start + end) /2;
-        }
-      } else {
-        VerifyResultCache[CacheIndex].SrcHValue = SrcTypeHashValue;
-        VerifyResultCache[CacheIndex].DstHValue = DstTypeHashValue;
-        VerifyResultCache[CacheIndex].VerifyResult = FAILINFO;
+        return DstAddr;
+      }
+      if (VerifyResult == FAILINFO) {
 #ifdef HEX_LOG
         IncVal(numMissFindObj, 1);
 #endif
         return nullptr;
       }
-
-      std::unordered_map<uint64_t, PhantomHashSet*>::iterator it;
-      it = ObjPhantomInfo->find(DstTypeHashValue);
-      if (it != ObjPhantomInfo->end()) {
-        PhantomHashSet *TargetPhantomHashSet = it->second;
-        char *BaseAddr = (char *)RuleAddr;
-        uint64_t RuleSize = *(FindValue->RuleAddr);
-        uint64_t RuleHash;
-        for (uint64_t PhantomHash : *TargetPhantomHashSet) {
-          uint64_t start = 1, end = RuleSize, middle;
-          middle = (start + end) / 2;
-          while (start <= end) {
-            RuleHash = *((uint64_t *)(BaseAddr + (sizeof(uint64_t) * middle)));
-            if (RuleHash < PhantomHash)
-              start = middle + 1;
-            else if(RuleHash == PhantomHash) {
-              VerifyResultCache[CacheIndex].SrcHValue = SrcTypeHashValue;
-              VerifyResultCache[CacheIndex].DstHValue = DstTypeHashValue;
-              VerifyResultCache[CacheIndex].VerifyResult = SAFECASTUPCAST;
-#ifdef HEX_LOG
-              IncVal(numCastNonBadCast, 1);
-#endif
-              return DstAddr;
-            }
-            else
-              end = middle - 1;
-            middle = (start + end) /2;
-          }
-        }
-      }
-
-      VerifyResultCache[CacheIndex].SrcHValue = SrcTypeHashValue;
-      VerifyResultCache[CacheIndex].DstHValue = DstTypeHashValue;
-      VerifyResultCache[CacheIndex].VerifyResult = BADCAST;
     }
 
 #if defined(PRINT_BAD_CASTING) || defined(PRINT_BAD_CASTING_FILE)
@@ -219,98 +1725,66 @@ __attribute__((always_inline))
     return nullptr;
   }
 
+// Called by the inlined check when the thread's LocalResultCache had no
+// entry for the source type id it read from ObjTypeMap[ObjMapIndex].
+// Returns the result so the caller can fill the cache of its cast site.
 extern "C" SANITIZER_INTERFACE_ATTRIBUTE
-void __type_casting_verification_inline(const uint64_t SrcTypeHashValue,
+int __type_casting_verification_inline(const uint64_t SrcTypeId,
                                          const uint64_t DstTypeHashValue,
                                          const uint64_t ObjMapIndex,
-                                         const uint64_t CacheIndex) {
+                                         const uint64_t CacheSet) {
 #ifdef HEX_LOG
   IncVal(numCasting, 1);
   IncVal(numVerifiedCasting, 1);
   IncVal(numLookHit, 1);
-  IncVal(numCastMiss, 1);
 #endif
 
+  int CacheResult = lookupVerifyCache(SrcTypeId, DstTypeHashValue);
+  if (CacheResult >= 0) {
+#ifdef HEX_LOG
+    IncVal(numCastHit, 1);
+    IncVal(CacheResult == SAFECASTSAME ? numCastSame : numCastNonBadCast, 1);
+#endif
+    insertLocalCache(CacheSet, SrcTypeId, DstTypeHashValue, CacheResult);
+    return CacheResult;
+  }
+
+#ifdef HEX_LOG
+  IncVal(numCastMiss, 1);
+#endif
+  uint64_t SrcTypeHashValue = ObjTypeTable[SrcTypeId].TypeHashValue;
   if (SrcTypeHashValue == DstTypeHashValue) {
 #ifdef HEX_LOG
     IncVal(numCastSame, 1);
 #endif
-    VerifyResultCache[CacheIndex].SrcHValue = SrcTypeHashValue;
-    VerifyResultCache[CacheIndex].DstHValue = DstTypeHashValue;
-    VerifyResultCache[CacheIndex].VerifyResult = SAFECASTSAME;
-    return;
+    insertLocalCache(CacheSet, SrcTypeId, DstTypeHashValue, SAFECASTSAME);
+    insertVerifyCache(SrcTypeId, DstTypeHashValue, SAFECASTSAME);
+    return SAFECASTSAME;
   }
 
-  ObjTypeMapEntry *FindValue = &ObjTypeMap[ObjMapIndex];
-  uptr* RuleAddr = FindValue->RuleAddr;
-  if (RuleAddr) {
-    uint64_t RuleHash;
-    char *BaseAddr = (char *)RuleAddr;
-    uint64_t RuleSize = *(FindValue->RuleAddr);
-    uint64_t start = 1, end = RuleSize, middle;
-    middle = (start + end) / 2;
-
-    while (start <= end) {
-      RuleHash = *((uint64_t *)(BaseAddr + (sizeof(uint64_t) * middle)));
-
-      if (RuleHash < DstTypeHashValue)
-        start = middle + 1;
-      else if(RuleHash == DstTypeHashValue) {
-        VerifyResultCache[CacheIndex].SrcHValue = SrcTypeHashValue;
-        VerifyResultCache[CacheIndex].DstHValue = DstTypeHashValue;
-        VerifyResultCache[CacheIndex].VerifyResult = SAFECASTUPCAST;
+  // The inlined check read the slot without the lock; only trust the rules
+  // if the slot still holds an object of the same type.
+  ObjTypeMapEntry SrcEntry;
+  ObjTypeMapEntry *FindValue = &SrcEntry;
+  readSlot(ObjMapIndex, FindValue);
+  if (FindValue->ObjAddr == nullptr || FindValue->TypeId != SrcTypeId)
+    return FAILINFO;
+  char VerifyResult = checkCastRule(SrcTypeId, DstTypeHashValue);
+  insertLocalCache(CacheSet, SrcTypeId, DstTypeHashValue, VerifyResult);
+  insertVerifyCache(SrcTypeId, DstTypeHashValue, VerifyResult);
+  if (VerifyResult == SAFECASTUPCAST) {
 #ifdef HEX_LOG
-        IncVal(numCastNonBadCast, 1);
+    IncVal(numCastNonBadCast, 1);
 #endif
-        return;
-      }
-      else
-        end = middle - 1;
-      middle = (start + end) /2;
-    }
-  } else {
-    VerifyResultCache[CacheIndex].SrcHValue = SrcTypeHashValue;
-    VerifyResultCache[CacheIndex].DstHValue = DstTypeHashValue;
-    VerifyResultCache[CacheIndex].VerifyResult = FAILINFO;
+    return VerifyResult;
+  }
+  if (VerifyResult == FAILINFO) {
 #ifdef HEX_LOG
     IncVal(numMissFindObj, 1);
 #endif
-    return;
-  }
-
-  std::unordered_map<uint64_t, PhantomHashSet*>::iterator it;
-  it = ObjPhantomInfo->find(DstTypeHashValue);
-  if (it != ObjPhantomInfo->end()) {
-    PhantomHashSet *TargetPhantomHashSet = it->second;
-    char *BaseAddr = (char *)RuleAddr;
-    uint64_t RuleSize = *(FindValue->RuleAddr);
-    uint64_t RuleHash;
-    for (uint64_t PhantomHash : *TargetPhantomHashSet) {
-      uint64_t start = 1, end = RuleSize, middle;
-      middle = (start + end) / 2;
-      while (start <= end) {
-        RuleHash = *((uint64_t *)(BaseAddr + (sizeof(uint64_t) * middle)));
-        if (RuleHash < PhantomHash)
-          start = middle + 1;
-        else if(RuleHash == PhantomHash) {
-          VerifyResultCache[CacheIndex].SrcHValue = SrcTypeHashValue;
-          VerifyResultCache[CacheIndex].DstHValue = DstTypeHashValue;
-          VerifyResultCache[CacheIndex].VerifyResult = SAFECASTUPCAST;
-#ifdef HEX_LOG
-          IncVal(numCastNonBadCast, 1);
-#endif
-          return;
-        }
-        else
-          end = middle - 1;
-        middle = (start + end) /2;
-      }
-    }
+    return VerifyResult;
   }
 
-  VerifyResultCache[CacheIndex].SrcHValue = SrcTypeHashValue;
-  VerifyResultCache[CacheIndex].DstHValue = DstTypeHashValue;
-  VerifyResultCache[CacheIndex].VerifyResult = BADCAST;
 #if defined(PRINT_BAD_CASTING) || defined(PRINT_BAD_CASTING_FILE)
   IncVal(numBadCastType4, 1);
   printTypeConfusion(4, SrcTypeHashValue, DstTypeHashValue);
@@ -318,14 +1792,7 @@ void __type_casting_verification_inline(const uint64_t SrcTypeHashValue,
 #ifdef HEX_LOG
   IncVal(numCastBadCast, 1);
 #endif
-  return;
-}
-
-extern "C" SANITIZER_INTERFACE_ATTRIBUTE
-void __type_casting_verification_print_cache_result(const uint64_t index) {
-#ifdef PRINT_BAD_CASTING
-  printf("== HexType Type confusion Report\n");
-#endif
+  return VerifyResult;
 }
 
 extern "C" SANITIZER_INTERFACE_ATTRIBUTE
@@ -347,6 +1814,33 @@ void __type_casting_verification_changing(uptr* const SrcAddr,
   verifyTypeCasting(SrcAddr, DstAddr, DstTypeHashValue);
 }
 
+// Same as calling __type_casting_verification on each of Count object
+// pointers stored Stride bytes apart from Ptrs, for checks hoisted out of
+// a counted loop. The map indices of a batch are computed in one loop the
+// compiler can vectorize, and their slots are prefetched before the first
+// one is read.
+extern "C" SANITIZER_INTERFACE_ATTRIBUTE
+void __type_casting_verification_batch(uptr** const Ptrs,
+                                       const uint64_t Count,
+                                       const int64_t Stride,
+                                       const uint64_t DstTypeHashValue) {
+  uptr *Objs[VERIFYBATCH];
+  uint32_t MapIndex[VERIFYBATCH];
+  for (uint64_t i = 0; i < Count; i += VERIFYBATCH) {
+    uint64_t BatchSize = Count - i < VERIFYBATCH ? Count - i : VERIFYBATCH;
+    for (uint64_t j = 0; j < BatchSize; j++)
+      Objs[j] = *(uptr **)((char *)Ptrs + (int64_t)(i + j) * Stride);
+    for (uint64_t j = 0; j < BatchSize; j++)
+      MapIndex[j] = getHash((uptr)Objs[j]);
+    for (uint64_t j = 0; j < BatchSize; j++) {
+      __builtin_prefetch(getSlotSeq(MapIndex[j]));
+      __builtin_prefetch(&ObjTypeMap[getBucket(MapIndex[j])]);
+    }
+    for (uint64_t j = 0; j < BatchSize; j++)
+      verifyTypeCasting(Objs[j], Objs[j], DstTypeHashValue);
+  }
+}
+
 extern "C" SANITIZER_INTERFACE_ATTRIBUTE
 void* __dynamic_casting_verification(uptr* const SrcAddr,
                                      const uint64_t DstTypeHashValue,
@@ -360,57 +1854,73 @@ void __update_direct_oinfo(uptr* const AllocAddr, const uint64_t TypeHashValue,
                            const int Offset,
                            uptr* const RuleAddr) {
   uptr MapIndex = getHash((uptr)AllocAddr);
-  if (ObjTypeMap[MapIndex].ObjAddr == nullptr ||
-      ObjTypeMap[MapIndex].ObjAddr == AllocAddr) {
-    ObjTypeMap[MapIndex].ObjAddr = AllocAddr;
-    ObjTypeMap[MapIndex].TypeHashValue = TypeHashValue;
-    ObjTypeMap[MapIndex].Offset = Offset;
-    ObjTypeMap[MapIndex].HeapArraySize = 1;
-    ObjTypeMap[MapIndex].RuleAddr = RuleAddr;
-    return;
+  uint32_t TypeId = getTypeId(TypeHashValue, RuleAddr);
+  lockSlot(MapIndex);
+  insertSlot(MapIndex, AllocAddr, TypeId, Offset, 1);
+  unlockSlot(MapIndex);
+}
+
+// Called once from the global constructor of a module built with
+// -global-table-opt, instead of one __update_direct_oinfo per object.
+extern "C" SANITIZER_INTERFACE_ATTRIBUTE
+void __update_global_table(const GlobalObjDesc *Table, const uint64_t Num) {
+  pthread_rwlock_wrlock(&GlobalTableLock);
+  if (NewGlobalTables == nullptr) {
+    NewGlobalTables =
+      new std::vector<std::pair<const GlobalObjDesc *, uint64_t>>;
+    GlobalObjs = new GlobalObjTable;
+    GlobalObjs->Tree.resize(1);
   }
+  NewGlobalTables->push_back(std::make_pair(Table, Num));
+  for (uint64_t i = 0; i < Num; i++)
+    extendAddrBounds(&GlobalObjBounds, (uptr)Table[i].ObjAddr,
+                     (uptr)Table[i].ObjAddr +
+                     (uptr)Table[i].Stride * Table[i].Count);
+  HasNewGlobalTable.store(true, std::memory_order_release);
+  pthread_rwlock_unlock(&GlobalTableLock);
 #ifdef HEX_LOG
-  IncVal(numUpdateMiss, 1);
+  for (uint64_t i = 0; i < Num; i++)
+    IncVal(numGloUp, Table[i].Count);
 #endif
-  if (ObjTypeMap[MapIndex].HexTree == nullptr)
-    ObjTypeMap[MapIndex].HexTree = rbtree_create();
-
-  ObjTypeMapEntry *ObjValue =
-    (ObjTypeMapEntry*)malloc(sizeof(ObjTypeMapEntry));
-  memcpy(ObjValue, &ObjTypeMap[MapIndex], sizeof(ObjTypeMapEntry));
-
-  rbtree_insert(ObjTypeMap[MapIndex].HexTree,
-                ObjTypeMap[MapIndex].ObjAddr, ObjValue);
-  ObjTypeMap[MapIndex].ObjAddr = AllocAddr;
-  ObjTypeMap[MapIndex].TypeHashValue = TypeHashValue;
-  ObjTypeMap[MapIndex].Offset = Offset;
-  ObjTypeMap[MapIndex].HeapArraySize = 1;
-  ObjTypeMap[MapIndex].RuleAddr = RuleAddr;
 }
 
+// Slow path of the inlined update: the slot was taken by another object
+// when it was checked. It may have changed since, so check it again.
 extern "C" SANITIZER_INTERFACE_ATTRIBUTE
 void __update_direct_oinfo_inline(uptr* const AllocAddr,
                                   const uint64_t TypeHashValue,
                                   const int Offset,
                                   uptr* RuleAddr,
                                   const uint64_t MapIndex) {
-#ifdef HEX_LOG
-  IncVal(numUpdateMiss, 1);
-#endif
-  if (ObjTypeMap[MapIndex].HexTree == nullptr)
-    ObjTypeMap[MapIndex].HexTree = rbtree_create();
-
-  ObjTypeMapEntry *ObjValue =
-    (ObjTypeMapEntry*)malloc(sizeof(ObjTypeMapEntry));
-  memcpy(ObjValue, &ObjTypeMap[MapIndex], sizeof(ObjTypeMapEntry));
+  uint32_t TypeId = getTypeId(TypeHashValue, RuleAddr);
+  lockSlot(MapIndex);
+  insertSlot(MapIndex, AllocAddr, TypeId, Offset, 1);
+  unlockSlot(MapIndex);
+}
 
-  rbtree_insert(ObjTypeMap[MapIndex].HexTree,
-                ObjTypeMap[MapIndex].ObjAddr, ObjValue);
-  ObjTypeMap[MapIndex].ObjAddr = AllocAddr;
-  ObjTypeMap[MapIndex].TypeHashValue = TypeHashValue;
-  ObjTypeMap[MapIndex].Offset = Offset;
-  ObjTypeMap[MapIndex].HeapArraySize = 1;
-  ObjTypeMap[MapIndex].RuleAddr = RuleAddr;
+// An object on the calling thread's stack goes to its stack table, which
+// is searched before ObjTypeMap, whenever the table is in use: with
+// StackLocal (modules built with -stack-local-opt or -stack-lazy-opt) or
+// once a traced local created it. The entry has no frame; it dies with
+// the stack above it or when the object is removed. Other addresses,
+// including those on the stack of another thread, go to ObjTypeMap.
+static void handleReinterpretCast(uptr* const AllocAddr,
+                                  const uint64_t TypeHashValue,
+                                  uptr* const RuleAddr,
+                                  const bool StackLocal) {
+  ObjTypeMapEntry FindValue;
+  if (findObjInfo(AllocAddr, &FindValue)) {
+    if (FindValue.Offset != -1)
+      return;
+    //  verifyTypeCasting(AllocAddr, AllocAddr, TypeHashValue);
+  }
+  if ((StackLocal || StackMap != nullptr) && isThreadStack((uptr)AllocAddr)) {
+    StackMapEntry Entry = {AllocAddr, getTypeId(TypeHashValue, RuleAddr),
+                           -1, 0, 0};
+    insertStackSlot(&Entry);
+    return;
+  }
+  __update_direct_oinfo(AllocAddr, TypeHashValue, -1, RuleAddr);
 }
 
 extern "C" SANITIZER_INTERFACE_ATTRIBUTE
@@ -418,13 +1928,18 @@ void __handle_reinterpret_cast(uptr* const AllocAddr,
                                const uint64_t TypeHashValue,
                                const int Offset,
                                uptr* const RuleAddr) {
-  ObjTypeMapEntry *FindValue = findObjInfo(AllocAddr);
-  if (FindValue) {
-    if (FindValue->Offset != -1)
-      return;
-    //  verifyTypeCasting(AllocAddr, AllocAddr, TypeHashValue);
-  }
-  __update_direct_oinfo(AllocAddr, TypeHashValue, -1, RuleAddr);
+  handleReinterpretCast(AllocAddr, TypeHashValue, RuleAddr, false);
+}
+
+// Called instead of __handle_reinterpret_cast by modules whose stack
+// objects are removed from the thread's table, so an entry on this
+// thread's stack never lands in ObjTypeMap where no removal reaches it.
+extern "C" SANITIZER_INTERFACE_ATTRIBUTE
+void __handle_stack_reinterpret_cast(uptr* const AllocAddr,
+                                     const uint64_t TypeHashValue,
+                                     const int Offset,
+                                     uptr* const RuleAddr) {
+  handleReinterpretCast(AllocAddr, TypeHashValue, RuleAddr, true);
 }
 
 extern "C" SANITIZER_INTERFACE_ATTRIBUTE
@@ -432,39 +1947,20 @@ void __update_oinfo(uptr* const AllocAddr, const uint64_t TypeHashValue,
                     const int Offset,
                     const uint32_t TypeSize, const unsigned long ArraySize,
                     uptr* const RuleAddr) {
+  uint32_t TypeId = getTypeId(TypeHashValue, RuleAddr);
+  if (ArraySize >= RANGEMINSIZE && TypeSize != 0) {
+    insertRange(AllocAddr, TypeId, Offset, TypeSize, ArraySize);
+    clearRangeSlots(AllocAddr, TypeSize, ArraySize);
+    return;
+  }
+
   for (uint32_t i=0;i<ArraySize;i++) {
     uptr *addr = (uptr *)((char *)AllocAddr + (TypeSize*i));
     uptr MapIndex = getHash((uptr)addr);
 
-    if (ObjTypeMap[MapIndex].ObjAddr == nullptr ||
-        ObjTypeMap[MapIndex].ObjAddr == addr) {
-      ObjTypeMap[MapIndex].ObjAddr = addr;
-      ObjTypeMap[MapIndex].TypeHashValue = TypeHashValue;
-      ObjTypeMap[MapIndex].Offset = Offset;
-      ObjTypeMap[MapIndex].HeapArraySize  = ArraySize;
-      ObjTypeMap[MapIndex].RuleAddr = RuleAddr;
-      continue;
-    }
-
-    else {
-#ifdef HEX_LOG
-      IncVal(numUpdateMiss, 1);
-#endif
-      if (ObjTypeMap[MapIndex].HexTree == nullptr)
-        ObjTypeMap[MapIndex].HexTree = rbtree_create();
-
-      ObjTypeMapEntry *ObjValue =
-        (ObjTypeMapEntry*)malloc(sizeof(ObjTypeMapEntry));
-      memcpy(ObjValue, &ObjTypeMap[MapIndex], sizeof(ObjTypeMapEntry));
-
-      rbtree_insert(ObjTypeMap[MapIndex].HexTree,
-                    ObjTypeMap[MapIndex].ObjAddr, ObjValue);
-      ObjTypeMap[MapIndex].ObjAddr = addr;
-      ObjTypeMap[MapIndex].TypeHashValue = TypeHashValue;
-      ObjTypeMap[MapIndex].Offset = Offset;
-      ObjTypeMap[MapIndex].HeapArraySize = ArraySize;
-      ObjTypeMap[MapIndex].RuleAddr = RuleAddr;
-    }
+    lockSlot(MapIndex);
+    insertSlot(MapIndex, addr, TypeId, Offset, ArraySize);
+    unlockSlot(MapIndex);
   }
 }
 
@@ -472,58 +1968,46 @@ extern "C" SANITIZER_INTERFACE_ATTRIBUTE
 void __remove_direct_oinfo(uptr* const TargetAddr) {
   uptr MapIndex = getHash((uptr)TargetAddr);
 
-  if (ObjTypeMap[MapIndex].ObjAddr == TargetAddr) {
-    ObjTypeMap[MapIndex].ObjAddr = nullptr;
-    return;
-  }
+  lockSlot(MapIndex);
+  int Hit = removeSlot(MapIndex, TargetAddr);
+  unlockSlot(MapIndex);
 #ifdef HEX_LOG
-  IncVal(numRemoveMiss, 1);
+  if (Hit != 1)
+    IncVal(numRemoveMiss, 1);
 #endif
-  if (ObjTypeMap[MapIndex].HexTree != nullptr &&
-      ObjTypeMap[MapIndex].HexTree->root != nullptr) {
-    ObjTypeMapEntry* FindValue =
-      (ObjTypeMapEntry *)rbtree_lookup(ObjTypeMap[MapIndex].HexTree, TargetAddr);
-    if (FindValue != nullptr) {
-      free(FindValue);
-      rbtree_delete(ObjTypeMap[MapIndex].HexTree, TargetAddr);
-    }
-  }
 }
 
 extern "C" SANITIZER_INTERFACE_ATTRIBUTE
 void __remove_direct_oinfo_inline(uptr* const TargetAddr,
                                   const uint64_t MapIndex) {
-  if (ObjTypeMap[MapIndex].HexTree != nullptr &&
-      ObjTypeMap[MapIndex].HexTree->root != nullptr) {
-    ObjTypeMapEntry* FindValue =
-      (ObjTypeMapEntry *)rbtree_lookup(ObjTypeMap[MapIndex].HexTree, TargetAddr);
-    if (FindValue != nullptr) {
-      free(FindValue);
-      rbtree_delete(ObjTypeMap[MapIndex].HexTree, TargetAddr);
-    }
-  }
+  lockSlot(MapIndex);
+  removeSlot(MapIndex, TargetAddr);
+  unlockSlot(MapIndex);
 }
 
 extern "C" SANITIZER_INTERFACE_ATTRIBUTE
 void __remove_oinfo(uptr* const ObjectAddr, const uint32_t TypeSize,
                     unsigned long ArraySize, const uint32_t AllocType) {
-  if (AllocType == HEAPALLOC || AllocType == REALLOC) {
-    uptr MapIndex = getHash((uptr)ObjectAddr);
-    if (ObjTypeMap[MapIndex].ObjAddr == ObjectAddr)
-      ArraySize = ObjTypeMap[MapIndex].HeapArraySize;
-    else {
-      if (ObjTypeMap[MapIndex].HexTree != nullptr &&
-          ObjTypeMap[MapIndex].HexTree->root != nullptr) {
-        ObjTypeMapEntry* FindValue =
-          (ObjTypeMapEntry *)rbtree_lookup(ObjTypeMap[MapIndex].HexTree, ObjectAddr);
-        if (FindValue != nullptr)
-          ArraySize = FindValue->HeapArraySize;
-      }
-      else
-        ArraySize = 1;
+  if (inAddrBounds(&RangeBounds, (uptr)ObjectAddr)) {
+    uint64_t RangeSize = removeRange(ObjectAddr);
+    if (RangeSize != 0) {
+#ifdef HEX_LOG
+      if (AllocType == HEAPALLOC || AllocType == REALLOC)
+        IncVal(numHeapRm, RangeSize);
+#endif
+      return;
     }
   }
 
+  if (AllocType == HEAPALLOC || AllocType == REALLOC) {
+    ObjTypeMapEntry FindValue;
+    int Found = lookupObjInfo(ObjectAddr, &FindValue);
+    if ((Found == 1 || Found == 2) && FindValue.HeapArraySize > 1)
+      ArraySize = FindValue.HeapArraySize;
+    else
+      ArraySize = 1;
+  }
+
   for (uint32_t i=0;i<ArraySize;i++) {
     uptr *addr = (uptr *)((char *)ObjectAddr + (TypeSize*i));
     uptr MapIndex = getHash((uptr)addr);
@@ -535,68 +2019,233 @@ void __remove_oinfo(uptr* const ObjectAddr, const uint32_t TypeSize,
       break;
     }
 #endif
-    if (ObjTypeMap[MapIndex].ObjAddr == addr)
-      ObjTypeMap[MapIndex].ObjAddr = nullptr;
-    else {
+    lockSlot(MapIndex);
+    int Hit = removeSlot(MapIndex, addr);
+    unlockSlot(MapIndex);
 #ifdef HEX_LOG
+    if (Hit != 1)
       IncVal(numRemoveMiss, 1);
 #endif
-      if (ObjTypeMap[MapIndex].HexTree != nullptr &&
-          ObjTypeMap[MapIndex].HexTree->root != nullptr) {
-        ObjTypeMapEntry* FindValue =
-          (ObjTypeMapEntry *)rbtree_lookup(ObjTypeMap[MapIndex].HexTree, addr);
-        if (FindValue != nullptr) {
-          free(FindValue);
-          rbtree_delete(ObjTypeMap[MapIndex].HexTree, addr);
-        }
-      }
-    }
+  }
+
+  // Large arrays cover a contiguous run of map slots; hand the pages
+  // that became empty back to the kernel.
+  if (ArraySize > 1) {
+    uptr LastAddr = (uptr)ObjectAddr + (uptr)TypeSize * (ArraySize - 1);
+    uptr FirstIndex = getHash((uptr)ObjectAddr);
+    uptr LastIndex = getHash(LastAddr);
+    if (getHashRegion((uptr)ObjectAddr) == getHashRegion(LastAddr) &&
+        LastIndex > FirstIndex &&
+        (LastIndex - FirstIndex) * sizeof(ObjTypeMapEntry) >= 2 * MAPPAGESIZE)
+      releaseMapRange(FirstIndex, LastIndex);
   }
 }
 
+// Stack objects go to the table of their thread, so stack churn never
+// touches the shared ObjTypeMap lines.
 extern "C" SANITIZER_INTERFACE_ATTRIBUTE
-void __update_phantom_info(uint64_t *const PhantomInfo) {
-  if (ObjTypeMap == nullptr) {
+void __update_stack_oinfo(uptr* const AllocAddr, const uint64_t TypeHashValue,
+                          const int Offset, uptr* const RuleAddr) {
+  if (!isThreadStack((uptr)AllocAddr)) {
+    __update_direct_oinfo(AllocAddr, TypeHashValue, Offset, RuleAddr);
+    return;
+  }
+  StackMapEntry Entry = {AllocAddr, getTypeId(TypeHashValue, RuleAddr),
+                         Offset, 0, 0};
+  insertStackSlot(&Entry);
+}
+
+// Called on entry of a function with lazily traced locals. Returns the
+// generation its traces pass to __update_stack_oinfo_lazy.
+extern "C" SANITIZER_INTERFACE_ATTRIBUTE
+uint32_t __enter_stack_frame(const uptr FrameAddr) {
+  return pushFrameGen(FrameAddr);
+}
+
+// Like __update_stack_oinfo, for objects that are never removed. FrameAddr
+// and Gen are those the registering function got on entry; the entry
+// dies when that call returns.
+extern "C" SANITIZER_INTERFACE_ATTRIBUTE
+void __update_stack_oinfo_lazy(uptr* const AllocAddr,
+                               const uint64_t TypeHashValue,
+                               const int Offset, uptr* const RuleAddr,
+                               const uptr FrameAddr, const uint32_t Gen) {
+  if (!isThreadStack((uptr)AllocAddr)) {
+    __update_direct_oinfo(AllocAddr, TypeHashValue, Offset, RuleAddr);
+    return;
+  }
+  StackMapEntry Entry = {AllocAddr, getTypeId(TypeHashValue, RuleAddr),
+                         Offset, FrameAddr, Gen};
+  insertStackSlot(&Entry);
+}
+
+extern "C" SANITIZER_INTERFACE_ATTRIBUTE
+void __remove_stack_oinfo(uptr* const TargetAddr) {
+  if (!isThreadStack((uptr)TargetAddr)) {
+    __remove_direct_oinfo(TargetAddr);
+    return;
+  }
+  bool Hit = removeStackSlot(TargetAddr);
+#ifdef HEX_LOG
+  if (!Hit)
+    IncVal(numRemoveMiss, 1);
+#endif
+}
+
+// Called on entry of a function whose traced locals were merged into one
+// frame object at FrameAddr.
+extern "C" SANITIZER_INTERFACE_ATTRIBUTE
+void __register_stack_frame(uptr* const FrameAddr, const FrameDesc *Desc) {
+  popFrames((uptr)FrameAddr);
+  if (FrameDepth == FrameCapacity)
+    growFrameStack();
+  FrameStack[FrameDepth].FrameAddr = (uptr)FrameAddr;
+  FrameStack[FrameDepth].Desc = Desc;
+  FrameDepth++;
 #ifdef HEX_LOG
-    InstallAtExitHandler();
+  IncVal(numStackFrame, 1);
+  IncVal(numStackUp, Desc->NumObj);
 #endif
-    ObjTypeMap = new ObjTypeMapEntry[NUMMAP];
+}
+
+extern "C" SANITIZER_INTERFACE_ATTRIBUTE
+void __unregister_stack_frame(uptr* const FrameAddr) {
+  popFrames((uptr)FrameAddr);
+}
+
+// HEXTYPE_MAP_BITS=<n> sizes ObjTypeMap to 2^n slots of 16 bytes. Small
+// services save address space and page tables; programs with many live
+// objects avoid spilling. The map does not grow afterwards.
+static void initMapSize() {
+  uptr Bits = DEFMAPBITS;
+  const char *Env = getenv("HEXTYPE_MAP_BITS");
+  if (Env && *Env) {
+    int Val = atoi(Env);
+    if (Val < MINMAPBITS || Val > MAXMAPBITS)
+      fprintf(stderr, "== HexType: HEXTYPE_MAP_BITS must be in [%d, %d]\n",
+              MINMAPBITS, MAXMAPBITS);
+    else
+      Bits = Val;
+  }
+  __atomic_store_n(&ObjTypeMapMask, ((uptr)1 << Bits) - 1, __ATOMIC_RELEASE);
+}
+
+// HEXTYPE_CACHE_BITS=<n> sizes VerifyResultCache to 2^n sets of 64 bytes.
+// Programs with more hot (source, destination) pairs than the default
+// 16384 entries otherwise keep evicting them.
+static void initCacheSize() {
+  uptr Bits = DEFCACHEBITS;
+  const char *Env = getenv("HEXTYPE_CACHE_BITS");
+  if (Env && *Env) {
+    int Val = atoi(Env);
+    if (Val < MINCACHEBITS || Val > MAXCACHEBITS)
+      fprintf(stderr, "== HexType: HEXTYPE_CACHE_BITS must be in [%d, %d]\n",
+              MINCACHEBITS, MAXCACHEBITS);
+    else
+      Bits = Val;
   }
+  VerifyCacheShift = 64 - Bits;
+  VerifyResultCache = (VerifyResultEntry *)reserveShadowMemory(
+    ((uptr)1 << Bits) * CACHEWAYS * sizeof(VerifyResultEntry),
+    "VerifyResultCache");
+}
+
+static void initShadowMemory() {
+#ifdef HEX_LOG
+  InstallAtExitHandler();
+  atexit(sweepAtExit);
+#endif
+  initMapSize();
+  ObjTypeMap = (ObjTypeMapEntry *)reserveFixedShadowMemory(
+    OBJTYPEMAPBASE, getMapSize() * sizeof(ObjTypeMapEntry), "ObjTypeMap");
+  ObjTypeMapInfo = (MapBucketInfo *)reserveShadowMemory(
+    getMapSize() / MAPWAYS * sizeof(MapBucketInfo), "ObjTypeMapInfo");
+  ObjTypeTable = (ObjTypeInfo *)reserveShadowMemory(
+    (uptr)MAXTYPEID * sizeof(ObjTypeInfo), "ObjTypeTable");
+  ObjTypeIdIndex.store(allocTypeIdIndex(MINTYPEINDEX),
+                       std::memory_order_release);
+  ObjCastTable = (CastSet **)reserveShadowMemory(
+    (uptr)MAXTYPEID * sizeof(CastSet *), "ObjCastTable");
+  initCacheSize();
+  startSweeper();
+}
+
+// Register one type record, (hash, id, n, parents...), and fill its id
+// slot. Returns the number of words in the record.
+static uint64_t registerTypeRecordLocked(uint64_t *const Record) {
+  uint64_t RuleSize = Record[2];
+  uint32_t TypeId = registerTypeLocked(Record[0], (uptr *)&Record[2]);
+  __atomic_store_n(&Record[1], (uint64_t)TypeId, __ATOMIC_RELEASE);
+  for (uint64_t j=0;j<RuleSize;j++)
+    registerTypeLocked(Record[3 + j], nullptr);
+  return RuleSize + 3;
+}
 
-  if (VerifyResultCache == nullptr)
-    VerifyResultCache = new VerifyResultEntry[NUMCACHE];
+// Merge one phantom record, (hash, n, phantom hashes...), into the
+// phantom classes. Returns the number of words in the record.
+static uint64_t addPhantomRecordLocked(uint64_t *const Record) {
+  uint64_t PhantomNum = Record[1];
+  uint32_t TypeId = registerType(Record[0], nullptr);
+  for (uint64_t j=0;j<PhantomNum;j++)
+    unionPhantomLocked(TypeId, registerType(Record[2 + j], nullptr));
+  return PhantomNum + 2;
+}
 
-  if (ObjPhantomInfo == nullptr)
-    ObjPhantomInfo = new std::unordered_map<uint64_t, PhantomHashSet*>;
+// Called from the constructor of every instrumented module with its type
+// info array, [N, (hash, id, n, parents...)*]. Types get their dense ids
+// here, parents right after their children, and the id slots are filled
+// so the inlined update path never has to ask the runtime.
+extern "C" SANITIZER_INTERFACE_ATTRIBUTE
+void __update_type_info(uint64_t *const TypeInfo) {
+  std::call_once(ShadowMemoryFlag, initShadowMemory);
+  std::lock_guard<std::mutex> Guard(TypeTableLock);
+  uint64_t pos = 0;
+  uint64_t TotalNum = TypeInfo[pos++];
+  for (uint64_t i=0;i<TotalNum;i++)
+    pos += registerTypeRecordLocked(&TypeInfo[pos]);
+  buildTypeLabelsLocked();
+}
 
+extern "C" SANITIZER_INTERFACE_ATTRIBUTE
+void __update_phantom_info(uint64_t *const PhantomInfo) {
+  std::call_once(ShadowMemoryFlag, initShadowMemory);
+  std::lock_guard<std::mutex> Guard(PhantomInfoLock);
   uint64_t pos = 0;
   uint64_t TotalNum = PhantomInfo[pos++];
-  for (uint64_t i=0;i<TotalNum;i++) {
-    uint64_t TypeHash = PhantomInfo[pos++];
-    uint64_t PhantomNum = PhantomInfo[pos++];
-    PhantomHashSet* PhantomSet;
-    auto it = ObjPhantomInfo->find(TypeHash);
-    bool isExist = false;
-    if (it == ObjPhantomInfo->end()) {
-      PhantomSet = new PhantomHashSet();
-    } else {
-      isExist = true;
-      PhantomSet = it->second;
-    }
-    for (uint64_t j=0;j<PhantomNum;j++) {
-      uint64_t innerHash = PhantomInfo[pos++];
-      auto it2 = ObjPhantomInfo->find(innerHash);
-      if (it2 != ObjPhantomInfo->end()) {
-        if (it2->second != NULL && it2->second != PhantomSet)
-          PhantomSet->insert(it2->second->begin(), it2->second->end());
-        ObjPhantomInfo->erase(it2);
-        ObjPhantomInfo->insert(make_pair(innerHash, PhantomSet));
-      }
-      PhantomSet->insert(innerHash);
-    }
-    if(!isExist)
-      ObjPhantomInfo->insert(make_pair(TypeHash, PhantomSet));
+  for (uint64_t i=0;i<TotalNum;i++)
+    pos += addPhantomRecordLocked(&PhantomInfo[pos]);
+  // cast sets built from older phantom info are rebuilt on next use
+  PhantomGeneration.fetch_add(1, std::memory_order_release);
+}
+
+// Modules built with -type-section-opt put their type and phantom records
+// in the hextype_rules and hextype_phantoms sections, one COMDAT per
+// distinct record, so the linker keeps one copy per executable or shared
+// library. Every module of that object passes the same section bounds;
+// the first call registers the whole section and the others return.
+extern "C" SANITIZER_INTERFACE_ATTRIBUTE
+void __update_type_section(uint64_t *const RuleBegin,
+                           uint64_t *const RuleEnd,
+                           uint64_t *const PhantomBegin,
+                           uint64_t *const PhantomEnd) {
+  std::call_once(ShadowMemoryFlag, initShadowMemory);
+  {
+    std::lock_guard<std::mutex> Guard(TypeTableLock);
+    if (TypeSections == nullptr)
+      TypeSections = new std::set<uint64_t *>;
+    if (!TypeSections->insert(RuleBegin).second)
+      return;
+    for (uint64_t *Record = RuleBegin; Record < RuleEnd;)
+      Record += registerTypeRecordLocked(Record);
+    buildTypeLabelsLocked();
   }
+
+  if (PhantomBegin == PhantomEnd)
+    return;
+  std::lock_guard<std::mutex> Guard(PhantomInfoLock);
+  for (uint64_t *Record = PhantomBegin; Record < PhantomEnd;)
+    Record += addPhantomRecordLocked(Record);
+  PhantomGeneration.fetch_add(1, std::memory_order_release);
 }
 
 #ifdef HEX_LOG
@@ -605,7 +2254,7 @@ void __lookup_success_count(char VerifyResult) {
   IncVal(numCasting, 1);
   IncVal(numVerifiedCasting, 1);
   IncVal(numLookHit, 1);
-  IncVal(numCastHit, 1);
+  IncVal(numCastLocalHit, 1);
 
   switch (VerifyResult) {
   case BADCAST:
@@ -623,6 +2272,18 @@ void __lookup_success_count(char VerifyResult) {
   }
 }
 
+// Called by the inlined check of a cast site with whether the source type
+// was one of the types already verified at that site.
+extern "C" SANITIZER_INTERFACE_ATTRIBUTE
+void __site_cache_count(void *Site, const char *Location, char Hit) {
+  if (Hit) {
+    IncVal(numCasting, 1);
+    IncVal(numVerifiedCasting, 1);
+    IncVal(numLookHit, 1);
+  }
+  IncSiteVal(Site, Location, Hit);
+}
+
 extern "C" SANITIZER_INTERFACE_ATTRIBUTE
 void __obj_update_count(uint32_t objUpdateType, uint64_t vla) {
   switch (objUpdateType) {
@@ -1,8 +1,72 @@
 #include "hextype_report.h"
+#include <sys/mman.h>
+#include <mutex>
+#include <map>
+#include <pthread.h>
 #include <unordered_map>
 
-#define NUMMAP 268435460
-#define NUMCACHE 16777220
+// ObjTypeMap has 2^HEXTYPE_MAP_BITS slots, chosen at startup
+#define DEFMAPBITS 28
+#define MINMAPBITS 12
+#define MAXMAPBITS 32
+#define NUMMAPLOCK 4096
+
+// ObjTypeMap is mapped at this address, so code built with
+// -fixed-shadow-opt indexes it without loading ObjTypeMap first. It must
+// match OBJTYPEMAPBASE in HexTypeUtil.h; 0 lets the kernel place the map.
+// The default needs a 64-bit immediate and so a register; a base below
+// 2GB (e.g. ASan's 0x7fff8000) is folded into the slot address instead.
+#ifndef OBJTYPEMAPBASE
+#define OBJTYPEMAPBASE 0x100000000000ULL
+#endif
+
+// ObjTypeMap is split into 4-way buckets of one cache line. An object
+// whose home bucket is full may be stored anywhere in its probe group of
+// four buckets; only when the whole group is taken does it go to the
+// spill tree.
+#define MAPWAYS 4
+#define MAPGROUP 16
+#define MAPREGIONSHIFT 31
+#define MAPREGIONMIX 0x9e3779b1UL
+
+// VerifyResultCache is 4-way set associative with 2^HEXTYPE_CACHE_BITS
+// sets of one cache line, chosen at startup (256KB by default). The set
+// is picked from the source type id and the full destination hash.
+#define CACHEWAYS 4
+#define DEFCACHEBITS 12
+#define MINCACHEBITS 8
+#define MAXCACHEBITS 22
+#define CACHESETMIX 0x9e3779b97f4a7c15ULL
+
+// The instrumentation computes the set number as if there were 2^12
+// sets, whatever the size of VerifyResultCache, and passes it on.
+#define CACHESETSHIFT 12
+
+// Each thread first checks a direct-mapped cache of its own, indexed by
+// the low bits of the set number. Only this thread writes it, so repeated
+// checks of one cast site never touch a shared line.
+#define LOCALCACHESHIFT 6
+#define NUMLOCALCACHE (1 << LOCALCACHESHIFT)
+
+// __type_casting_verification_batch looks objects up this many at a time
+#define VERIFYBATCH 16
+
+// Arrays with at least this many elements are tracked as one range
+#define RANGEMINSIZE 64
+
+// Initial number of registered frames per thread
+#define MINFRAMESTACK 64
+
+// Initial capacity of the per-thread stack object table. When it is half
+// full, dead entries are dropped and it is doubled if still a quarter full.
+#define MINSTACKMAP 1024
+
+// TypeId is a 24-bit field of ObjTypeMapEntry; id 0 means unknown
+#define MAXTYPEID (1U << 24)
+#define MINTYPEINDEX 4096
+
+#define MAPPAGESIZE 4096
+#define MINCORECHUNK (1UL << 30)
 
 #define BADCAST 0
 #define FAILINFO 1
@@ -17,13 +81,76 @@
 #define PLACEMENTNEW 5
 #define REINTERPRET 6
 
+// Number of ObjTypeMap slots minus one. Instrumented code reads it too.
+__attribute__ ((visibility ("default"))) uptr ObjTypeMapMask;
+
+// 64 minus the number of set bits of VerifyResultCache, set at startup
+static uptr VerifyCacheShift = 64 - DEFCACHEBITS;
+__attribute__ ((visibility ("default"))) VerifyResultEntry *VerifyResultCache;
+
+inline uptr getMapSize() {
+  return ObjTypeMapMask + 1;
+}
+
+inline uptr getHashRegion(uptr a) {
+  return a >> MAPREGIONSHIFT;
+}
+
+// Objects 2GB apart would otherwise map to the same slot; the region
+// number moves each region to its own offset but keeps addresses within
+// a region contiguous in the map.
 inline uint32_t getHash(uptr a) {
-  return (((a >> 3) & 0xfffffff));
+  return (((a >> 3) + getHashRegion(a) * MAPREGIONMIX) & ObjTypeMapMask);
 }
 
-// Stoarge for phantom class information
-typedef std::set<uint64_t> PhantomHashSet;
-static std::unordered_map<uint64_t, PhantomHashSet*> *ObjPhantomInfo;
+inline uint32_t getCacheSet(uint32_t SrcTypeId, uint64_t DstTypeHashValue) {
+  return ((DstTypeHashValue ^ SrcTypeId) * CACHESETMIX) >> (64 - CACHESETSHIFT);
+}
+
+inline VerifyResultEntry *getVerifyCacheWays(uint32_t SrcTypeId,
+                                             uint64_t DstTypeHashValue) {
+  uint64_t Set = ((DstTypeHashValue ^ SrcTypeId) * CACHESETMIX) >>
+    VerifyCacheShift;
+  return &VerifyResultCache[Set * CACHEWAYS];
+}
+
+inline uint32_t getLocalCacheIndex(uint32_t CacheSet) {
+  return CacheSet & (NUMLOCALCACHE - 1);
+}
+
+inline uint64_t makeCacheMeta(uint32_t SrcTypeId, char VerifyResult,
+                              uint32_t Seq) {
+  return SrcTypeId | (uint64_t)(uint8_t)VerifyResult << 24 |
+    (uint64_t)Seq << 32;
+}
+
+inline uint32_t getCacheMetaId(uint64_t Meta) {
+  return Meta & 0xffffff;
+}
+
+inline char getCacheMetaResult(uint64_t Meta) {
+  return (Meta >> 24) & 0xff;
+}
+
+inline uint32_t getCacheMetaSeq(uint64_t Meta) {
+  return Meta >> 32;
+}
+
+// Range records of large arrays, keyed by the address of the first element
+static std::map<uptr, ObjRangeEntry> *ObjRangeMap;
+
+// Type hash to dense type id, open addressing
+static std::atomic<TypeIdIndex *> ObjTypeIdIndex;
+
+// Cast rules of each type id, built on the first cache miss
+static CastSet **ObjCastTable;
 
 __attribute__ ((visibility ("default"))) ObjTypeMapEntry *ObjTypeMap;
-__attribute__ ((visibility ("default"))) VerifyResultEntry *VerifyResultCache;
+// Per-bucket counts of entries stored outside their home bucket. The
+// inlined update reads them too.
+__attribute__ ((visibility ("default"))) MapBucketInfo *ObjTypeMapInfo;
+__attribute__ ((visibility ("default"))) ObjTypeInfo *ObjTypeTable;
+__attribute__ ((visibility ("default"), tls_model ("initial-exec")))
+__thread LocalResultEntry LocalResultCache[NUMLOCALCACHE];
+__attribute__ ((visibility ("default"), aligned (64)))
+MapSlotLock ObjTypeMapLock[NUMMAPLOCK];
@@ -105,8 +105,8 @@ static int compare(void* left, void* right);
 
 int compare(void* leftp, void* rightp) {
 
-  int left = (int)(size_t)leftp;
-  int right = (int)(size_t)rightp;
+  uptr left = (uptr)leftp;
+  uptr right = (uptr)rightp;
   if (left < right)
     return -1;
   else if (left > right)
@@ -141,6 +141,18 @@ void* rbtree_lookup(rbtree t, void* key) {
   return n == NULL ? NULL : n->value;
 }
 
+static void walk_node(node n, int depth,
+                      void (*fn)(void*, void*, int, void*), void* arg) {
+  for (; n != NULL; n = n->right, depth++) {
+    walk_node(n->left, depth + 1, fn, arg);
+    fn(n->key, n->value, depth, arg);
+  }
+}
+
+void rbtree_walk(rbtree t, void (*fn)(void*, void*, int, void*), void* arg) {
+  walk_node(t->root, 1, fn, arg);
+}
+
 void rotate_left(rbtree t, node n) {
   node r = n->right;
   replace_node(t, n, r);
@@ -1,6 +1,8 @@
 #include "sanitizer_common/sanitizer_stacktrace.h"
+#include <atomic>
 #include <map>
 #include <set>
+#include <vector>
 
 #define MAXPATH 1000
 
@@ -31,23 +33,181 @@ typedef struct rbtree_t {
   rbtree_node root;
 } *rbtree;
 
+// 16 bytes, four entries (one bucket) per cache line. The type hash and
+// rules live in ObjTypeTable, indexed by TypeId.
 typedef struct ObjTypeMapEntry {
   uptr* ObjAddr;
-  uptr* RuleAddr;
-  uint64_t TypeHashValue;
-  uint32_t HeapArraySize;
+  uint32_t TypeId : 24;
+  uint32_t HeapArraySize : 8;   // element count of small arrays, else 0
   int Offset;
-  rbtree HexTree;
 } ObjTypeMapEntry;
 
+// PhantomClass is the id of the phantom class of the type (0 if it has no
+// phantom relation); members of a class are linked through PhantomNext,
+// and the class id type keeps the number of members in PhantomSize.
+typedef struct ObjTypeInfo {
+  uint64_t TypeHashValue;
+  uptr* RuleAddr;
+  uint32_t PhantomClass;
+  uint32_t PhantomNext;
+  uint32_t PhantomSize;
+} ObjTypeInfo;
+
+// Pre/post-order numbers of a type in the tree of single inheritance
+// chains; Pre is 0 for types that are not in it. Ancestors of a type are
+// those whose interval encloses its own.
+typedef struct TypeLabel {
+  uint32_t Pre;
+  uint32_t Post;
+} TypeLabel;
+
+typedef struct TypeLabelTable {
+  uint32_t Generation;
+  uint32_t NumType;
+  TypeLabel Label[];
+} TypeLabelTable;
+
+typedef struct TypeIdIndexEntry {
+  std::atomic<uint64_t> Hash;
+  uint32_t TypeId;
+} TypeIdIndexEntry;
+
+typedef struct TypeIdIndex {
+  uptr Mask;
+  TypeIdIndexEntry Entry[];
+} TypeIdIndex;
+
+// Type ids a type may be cast to: its parents and the targets whose
+// phantom class contains one of them. Only the 64-id words that have a
+// bit set are stored. Bit b of Presence[c] marks that word 64 * c + b is
+// stored, at Words[Rank[c] + number of marked words before it in c].
+// A test is three loads whatever the number of rules, which is why the
+// rules are not kept as a sorted array to search.
+typedef struct CastSet {
+  uint32_t Generation;
+  uint32_t NumChunk;
+  uint64_t *Presence;
+  uint64_t *Words;
+  uint32_t *Rank;
+} CastSet;
+
+typedef struct ObjRangeEntry {
+  uint64_t Count;
+  uint32_t Stride;
+  uint32_t TypeId;
+  int Offset;
+} ObjRangeEntry;
+
+// Lowest start and highest end address of a set of records. They only
+// grow while any record is left.
+typedef struct AddrBounds {
+  std::atomic<uptr> Begin;
+  std::atomic<uptr> End;
+} AddrBounds;
+
+// Global objects of a module, emitted by the compiler as one read-only
+// table. An entry describes Count objects Stride bytes apart starting at
+// ObjAddr, which already includes the subobject offset Offset.
+typedef struct GlobalObjDesc {
+  uptr* ObjAddr;
+  uint64_t Count;
+  uint32_t Stride;
+  int Offset;
+  uint64_t TypeHashValue;
+  uptr* RuleAddr;
+} GlobalObjDesc;
+
+// Start address of an Index entry and its position there; these keys
+// are kept in Eytzinger (breadth-first) order for the search.
+typedef struct GlobalObjKey {
+  uptr ObjAddr;
+  uptr Rank;
+} GlobalObjKey;
+
+// The merged global object tables: descriptors sorted by start address
+// and their search keys, Tree[0] unused. Never changed once published;
+// a merge builds a new one.
+typedef struct GlobalObjTable {
+  std::vector<const GlobalObjDesc *> Index;
+  std::vector<GlobalObjKey> Tree;
+} GlobalObjTable;
+
+typedef struct MapBucketInfo {
+  uint32_t Displaced : 8;   // stored in another bucket of the probe group
+  uint32_t Spilled : 24;    // stored in the spill tree
+} MapBucketInfo;
+
+// Sequence lock guarding a stripe of ObjTypeMap slots and their overflow
+// trees. Writers make Seq odd while they modify a slot; readers of the
+// direct slot retry until they see the same even value before and after.
+typedef struct MapSlotLock {
+  std::atomic<uint32_t> Seq;
+  char Pad[60];
+} MapSlotLock;
+
+// 16 bytes, so one set of VerifyResultCache is a cache line. Meta holds
+// the source type id (24 bits), the result (8 bits) and a sequence number
+// (32 bits) that is odd while the way is being written. SrcTypeId 0
+// never matches: ids start at 1.
 typedef struct VerifyResultEntry {
-  uint64_t SrcHValue;
-  uint64_t DstHValue;
-  char VerifyResult;
+  std::atomic<uint64_t> DstHValue;
+  std::atomic<uint64_t> Meta;
 } VerifyResultEntry;
 
+// Stack frame descriptors are emitted by the compiler, one per function
+// whose traced locals were merged into one frame object. An entry
+// describes Count objects Stride bytes apart, starting FrameOffset bytes
+// into the frame; Offset is that of the traced subobject in its object.
+typedef struct FrameDescEntry {
+  uint32_t FrameOffset;
+  int Offset;
+  uint32_t Count;
+  uint32_t Stride;
+  uint64_t TypeHashValue;
+  uptr* RuleAddr;
+} FrameDescEntry;
+
+typedef struct FrameDesc {
+  uint64_t FrameSize;
+  uint32_t NumEntry;
+  uint32_t NumObj;
+  FrameDescEntry Entry[];
+} FrameDesc;
+
+typedef struct FrameRecord {
+  uptr FrameAddr;
+  const FrameDesc *Desc;
+} FrameRecord;
+
+// Entry of the per-thread stack object table. Entries registered without
+// a frame (Gen 0) live until removed or until the stack is popped above
+// them, as do those of placement new; the others die with the call of
+// their function, identified by its frame address FrameAddr and the
+// generation Gen it got on entry.
+typedef struct StackMapEntry {
+  uptr* ObjAddr;
+  uint32_t TypeId;
+  int Offset;
+  uptr FrameAddr;
+  uint32_t Gen;
+} StackMapEntry;
+
+typedef struct StackFrameGen {
+  uptr FrameAddr;
+  uint32_t Gen;
+} StackFrameGen;
+
+// Entry of the per-thread cache in front of VerifyResultCache; holds
+// safe results only
+typedef struct LocalResultEntry {
+  uint64_t DstHValue;
+  uint32_t SrcTypeId;
+  uint32_t VerifyResult;
+} LocalResultEntry;
+
 rbtree rbtree_create();
 void* rbtree_lookup(rbtree t, void* key);
 void rbtree_insert(rbtree t, void* key, void* value);
 int rbtree_delete(rbtree t, void* key);
+void rbtree_walk(rbtree t, void (*fn)(void*, void*, int, void*), void* arg);
 void write_log(char *result, char *filename);
@@ -2,6 +2,9 @@
 #include <inttypes.h>
 #include <execinfo.h>
 #include <unistd.h>
+#include <algorithm>
+#include <mutex>
+#include <vector>
 
 #ifdef HEX_LOG
 #define BT_BUF_SIZE 100
@@ -12,6 +15,10 @@ void IncVal(int index, int count) {
   count_index[index].fetch_add(count);
 }
 
+void SetVal(int index, unsigned long value) {
+  count_index[index].store(value);
+}
+
 unsigned long getVal(int index) {
   return count_index[index].load();
 }
@@ -62,6 +69,53 @@ void printTypeConfusion(int ErrorType, uint64_t SrcHash, uint64_t DstHash) {
 #endif
 }
 
+// Hits and misses of the inline cache of each cast site
+typedef struct SiteStat {
+  const char *Location;
+  unsigned long Hit;
+  unsigned long Miss;
+} SiteStat;
+
+static std::map<void *, SiteStat> *SiteStats;
+static std::mutex SiteStatLock;
+
+void IncSiteVal(void *Site, const char *Location, bool Hit) {
+  IncVal(Hit ? numSiteHit : numSiteMiss, 1);
+  std::lock_guard<std::mutex> Guard(SiteStatLock);
+  if (SiteStats == nullptr)
+    SiteStats = new std::map<void *, SiteStat>;
+  SiteStat &Stat = (*SiteStats)[Site];
+  Stat.Location = Location;
+  if (Hit)
+    Stat.Hit++;
+  else
+    Stat.Miss++;
+}
+
+static void printSiteStat(char *fileName) {
+  char tmp[MAXLEN];
+  std::lock_guard<std::mutex> Guard(SiteStatLock);
+  if (SiteStats == nullptr)
+    return;
+
+  std::vector<SiteStat> Sites;
+  for (auto &Site : *SiteStats)
+    Sites.push_back(Site.second);
+  std::sort(Sites.begin(), Sites.end(),
+            [](const SiteStat &A, const SiteStat &B) {
+              return A.Miss > B.Miss;
+            });
+
+  snprintf(tmp, sizeof(tmp), "== Cast site cache (%zu sites) ==\n",
+           Sites.size());
+  printInfotoFile(tmp, fileName);
+  for (size_t i = 0; i < Sites.size() && i < MAXSITEPRINT; i++) {
+    snprintf(tmp, sizeof(tmp), "\t%lu hit %lu miss: %s\n",
+             Sites[i].Hit, Sites[i].Miss, Sites[i].Location);
+    printInfotoFile(tmp, fileName);
+  }
+}
+
 static void PrintStatResult(void) {
   char tmp[MAXLEN];
   char fileName[MAXLEN] = "/total_result.txt";
@@ -81,6 +135,11 @@ static void PrintStatResult(void) {
            getVal(numUpdateMiss));
   printInfotoFile(tmp, fileName);
 
+  snprintf(tmp, sizeof(tmp),
+           "\t\t%lu: Object update spilled (probe group full)\n",
+           getVal(numUpdateSpill));
+  printInfotoFile(tmp, fileName);
+
   snprintf(tmp, sizeof(tmp), "\t%lu: Global Object Update\n",
           getVal(numGloUp));
   printInfotoFile(tmp, fileName);
@@ -92,6 +151,14 @@ static void PrintStatResult(void) {
           getVal(numStackUp));
   printInfotoFile(tmp, fileName);
 
+  snprintf(tmp, sizeof(tmp), "\t\t%lu: Stack frame registration\n",
+          getVal(numStackFrame));
+  printInfotoFile(tmp, fileName);
+
+  snprintf(tmp, sizeof(tmp), "\t\t%lu: Thread stack table growth\n",
+          getVal(numStackMapGrow));
+  printInfotoFile(tmp, fileName);
+
   snprintf(tmp, sizeof(tmp), "%lu: Object remove\n", getVal(numHeapRm) +
           getVal(numStackRm));
   printInfotoFile(tmp, fileName);
@@ -110,6 +177,54 @@ static void PrintStatResult(void) {
   snprintf(tmp, sizeof(tmp), "\t%lu: Stack object Remove\n",getVal(numStackRm));
   printInfotoFile(tmp, fileName);
 
+  snprintf(tmp, sizeof(tmp), "\t%lu: Stack object found dead\n",
+           getVal(numStackLazyRm));
+  printInfotoFile(tmp, fileName);
+
+  snprintf(tmp, sizeof(tmp), "%lu: ObjTypeMap pages released\n",
+           getVal(numReleasedPage));
+  printInfotoFile(tmp, fileName);
+
+  if (getVal(numSweep) != 0) {
+    snprintf(tmp, sizeof(tmp), "== ObjTypeMap occupancy (sweep %lu) ==\n",
+             getVal(numSweep));
+    printInfotoFile(tmp, fileName);
+
+    snprintf(tmp, sizeof(tmp),
+             "%lu: Entries (load factor %.6f, %.4f of resident slots)\n",
+             getVal(numMapEntry),
+             (double)getVal(numMapEntry) / getVal(numMapSlot),
+             getVal(numMapResident) ?
+             (double)getVal(numMapEntry) / getVal(numMapResident) : 0.0);
+    printInfotoFile(tmp, fileName);
+
+    snprintf(tmp, sizeof(tmp), "\t%lu: In the home slot\n",
+             getVal(numMapDepthHome));
+    printInfotoFile(tmp, fileName);
+
+    snprintf(tmp, sizeof(tmp), "\t%lu: In the home bucket\n",
+             getVal(numMapDepthBucket));
+    printInfotoFile(tmp, fileName);
+
+    snprintf(tmp, sizeof(tmp), "\t%lu: In the probe group\n",
+             getVal(numMapDepthGroup));
+    printInfotoFile(tmp, fileName);
+
+    snprintf(tmp, sizeof(tmp), "\t%lu: In the spill tree (height %lu)\n",
+             getVal(numMapDepthSpill), getVal(numSpillHeight));
+    printInfotoFile(tmp, fileName);
+
+    snprintf(tmp, sizeof(tmp),
+             "%lu: Stale entries (unmapped or dead stack memory)\n",
+             getVal(numMapStale));
+    printInfotoFile(tmp, fileName);
+
+    snprintf(tmp, sizeof(tmp),
+             "%lu %lu: Entries removed, moved back from the spill tree\n",
+             getVal(numSweepRemoved), getVal(numSweepCompacted));
+    printInfotoFile(tmp, fileName);
+  }
+
   snprintf(tmp, sizeof(tmp), "== Casting verification status ==\n");
   printInfotoFile(tmp, fileName);
 
@@ -122,10 +237,30 @@ static void PrintStatResult(void) {
   printInfotoFile(tmp, fileName);
 
   snprintf(tmp, sizeof(tmp),
-           "\t%lu: Object lookup success (find in the RB-tree)\n",
+           "\t%lu: Object lookup success (find in the probe group)\n",
           getVal(numLookMiss));
   printInfotoFile(tmp, fileName);
 
+  snprintf(tmp, sizeof(tmp),
+           "\t%lu: Object lookup success (find in an array range)\n",
+          getVal(numLookRange));
+  printInfotoFile(tmp, fileName);
+
+  snprintf(tmp, sizeof(tmp),
+           "\t%lu: Object lookup success (find in a stack frame)\n",
+          getVal(numLookFrame));
+  printInfotoFile(tmp, fileName);
+
+  snprintf(tmp, sizeof(tmp),
+           "\t%lu: Object lookup success (find in the thread stack table)\n",
+          getVal(numLookStack));
+  printInfotoFile(tmp, fileName);
+
+  snprintf(tmp, sizeof(tmp),
+           "\t%lu: Object lookup success (find in a global object table)\n",
+          getVal(numLookGlobal));
+  printInfotoFile(tmp, fileName);
+
   snprintf(tmp, sizeof(tmp),
            "\t%lu: Object lookup fail (fail to find object)\n",
            getVal(numLookFail));
@@ -147,12 +282,17 @@ static void PrintStatResult(void) {
           getVal(numCastNonBadCast));
   printInfotoFile(tmp, fileName);
 
+  snprintf(tmp, sizeof(tmp),
+           "\t\t\t%lu: Decided by single inheritance labels\n",
+          getVal(numCastLabel));
+  printInfotoFile(tmp, fileName);
+
   snprintf(tmp, sizeof(tmp),
            "\t\t%lu: Type confusion cases\n",getVal(numCastBadCast));
   printInfotoFile(tmp, fileName);
 
   snprintf(tmp, sizeof(tmp),
-           "\t\t%lu: Type confusion type %lu %lu %lu %lu\n",
+           "\t\tType confusion type %lu %lu %lu %lu\n",
            getVal(numBadCastType1),
            getVal(numBadCastType2),
            getVal(numBadCastType3),
@@ -167,11 +307,27 @@ static void PrintStatResult(void) {
            "\t\t%lu: No type relation info\n",getVal(numMissFindObj));
   printInfotoFile(tmp, fileName);
 
+  snprintf(tmp, sizeof(tmp),
+           "\t\t%lu: Cast rule sets built (%lu bytes)\n",
+           getVal(numCastSet), getVal(numCastSetByte));
+  printInfotoFile(tmp, fileName);
+
   snprintf(tmp, sizeof(tmp), "\t%lu :Casting cache use status\n",
+           getVal(numSiteHit) + getVal(numCastLocalHit) +
            getVal(numCastHit) + getVal(numCastMiss) +
            getVal(numCastNoCacheUse));
   printInfotoFile(tmp, fileName);
 
+  snprintf(tmp, sizeof(tmp),
+           "\t\t%lu: Casting operation site cache hit\n",
+           getVal(numSiteHit));
+  printInfotoFile(tmp, fileName);
+
+  snprintf(tmp, sizeof(tmp),
+           "\t\t%lu: Casting operation thread cache hit\n",
+           getVal(numCastLocalHit));
+  printInfotoFile(tmp, fileName);
+
   snprintf(tmp, sizeof(tmp), "\t\t%lu: Casting operation cache hit\n",
           getVal(numCastHit));
   printInfotoFile(tmp, fileName);
@@ -184,6 +340,17 @@ static void PrintStatResult(void) {
           getVal(numCastNoCacheUse));
   printInfotoFile(tmp, fileName);
 
+  snprintf(tmp, sizeof(tmp), "\t\t%lu: Casting operation cache eviction\n",
+          getVal(numCastEvict));
+  printInfotoFile(tmp, fileName);
+
+  unsigned long CacheHits = getVal(numSiteHit) + getVal(numCastLocalHit) +
+    getVal(numCastHit);
+  unsigned long CacheLookups = CacheHits + getVal(numCastMiss);
+  snprintf(tmp, sizeof(tmp), "\t\t%.2f%%: Casting operation cache hit rate\n",
+           CacheLookups ? 100.0 * CacheHits / CacheLookups : 0.0);
+  printInfotoFile(tmp, fileName);
+
   snprintf(tmp, sizeof(tmp), "== Count dynamic and static cast number ==\n");
   printInfotoFile(tmp, fileName);
 
@@ -218,6 +385,8 @@ static void PrintStatResult(void) {
   snprintf(tmp, sizeof(tmp), "Casting: %lu %lu %lu\n",
            getVal(numCasting), getVal(numVerifiedCasting), getVal(numCastBadCast));
   printInfotoFile(tmp, fileName);
+
+  printSiteStat(fileName);
 }
 
 static void HexTypeAtExit(void) {
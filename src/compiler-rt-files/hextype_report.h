@@ -52,7 +52,43 @@
 #define numBadCastType3 34
 #define numBadCastType4 35
 
+#define numReleasedPage 36
+#define numUpdateSpill 37
+#define numLookRange 38
+#define numCastSet 39
+#define numCastSetByte 40
+#define numCastEvict 41
+#define numCastLocalHit 42
+#define numSiteHit 43
+#define numSiteMiss 44
+#define numStackFrame 45
+#define numLookFrame 46
+#define numLookStack 47
+#define numStackMapGrow 48
+#define numStackLazyRm 49
+
+// ObjTypeMap occupancy, set by the last sweep
+#define numSweep 50
+#define numMapEntry 51
+#define numMapResident 52
+#define numMapDepthHome 53
+#define numMapDepthBucket 54
+#define numMapDepthGroup 55
+#define numMapDepthSpill 56
+#define numSpillHeight 57
+#define numMapStale 58
+#define numSweepRemoved 59
+#define numSweepCompacted 60
+#define numMapSlot 61
+#define numLookGlobal 62
+#define numCastLabel 63
+
+// Cast sites listed in total_result.txt, most misses first
+#define MAXSITEPRINT 20
+
 void IncVal(int index, int count);
+void SetVal(int index, unsigned long value);
+void IncSiteVal(void *Site, const char *Location, bool Hit);
 unsigned long getVal(int index);
 void printTypeConfusion(int, uint64_t, uint64_t);
 void InstallAtExitHandler();
@@ -9,20 +9,24 @@
 // The rest is handled by the run-time library.
 //===------------------------------------------------------------------===//
 
+#include "llvm/ADT/SCCIterator.h"
 #include "llvm/Analysis/CallGraph.h"
 #include "llvm/Pass.h"
 #include "llvm/IR/Function.h"
 #include "llvm/IR/LLVMContext.h"
 #include "llvm/IR/LegacyPassManager.h"
 #include "llvm/IR/IntrinsicInst.h"
+#include "llvm/IR/CallSite.h"
 #include "llvm/IR/BasicBlock.h"
 #include "llvm/IR/Module.h"
 #include "llvm/IR/InstIterator.h"
 #include "llvm/IR/Dominators.h"
+#include "llvm/IR/DIBuilder.h"
 #include "llvm/Support/raw_ostream.h"
 #include "llvm/Transforms/IPO/PassManagerBuilder.h"
 #include "llvm/Transforms/Utils/HexTypeUtil.h"
 #include "llvm/Transforms/Utils/ModuleUtils.h"
+#include "llvm/Transforms/Utils/Local.h"
 #include "llvm/Transforms/Instrumentation.h"
 
 using namespace llvm;
@@ -43,6 +47,10 @@ namespace {
     std::map<Function *, std::vector<Instruction *> *> ReturnInstSet;
     std::map<Instruction *, Function *> AllAllocaWithFnSet;
     std::map<Function*, bool> mayCastMap;
+    std::map<Argument*, bool> ArgEscapeMap;
+    unsigned NumMayCastElided;
+    unsigned NumNoEscapeElided;
+    unsigned NumFrameObj;
 
     void getAnalysisUsage(AnalysisUsage &Info) const {
       Info.addRequired<CallGraphWrapperPass>();
@@ -121,6 +129,13 @@ namespace {
         if (HexTypeUtilSet->isInterestingType(AI->getAllocatedType())) {
           if (ClSafeStackOpt && HexTypeUtilSet->isSafeStackAlloca(AI))
             return;
+          if (ClStackEscapeOpt) {
+            std::set<Value *> Visited;
+            if (!mayPointerEscape(AI, Visited)) {
+              NumNoEscapeElided++;
+              return;
+            }
+          }
           AllAllocaWithFnSet.insert(
             std::pair<Instruction *, Function *>(
               dyn_cast<Instruction>(I), AI->getParent()->getParent()));
@@ -200,6 +215,10 @@ namespace {
         Instruction *TargetInst = LocalBegin->first;
         AllocaInst *TargetAlloca = dyn_cast<AllocaInst>(TargetInst);
 
+        // the runtime drops these once their frame is gone
+        if (ClStackLazyOpt && isa<ConstantInt>(TargetAlloca->getArraySize()))
+          continue;
+
         Function *TargetFn = LocalBegin->second;
 
         std::vector<Instruction *> *FnReturnSet;
@@ -250,89 +269,363 @@ namespace {
       }
     }
 
-    // This is typesan's optimization method
-    // to reduce stack object tracing overhead
-    bool mayCast(Function *F, std::set<Function*> &visited, bool *isComplete) {
-      // Externals may cast
-      if (F->isDeclaration())
+    // Whether a call to the declared function F may reach a typecasting
+    // verification. Intrinsics and HexType's own object tracing hooks do
+    // not; any other external code might.
+    bool mayExternalFnCast(Function *F) {
+      StringRef Name = F->getName();
+      if (Name.startswith("__type_casting_verification") ||
+          Name.startswith("__dynamic_casting_verification"))
         return true;
+      if (F->isIntrinsic() || Name.startswith("__update_") ||
+          Name.startswith("__remove_"))
+        return false;
+      return true;
+    }
 
-      // Check previously processed
+    bool mayCalleeCast(Function *F) {
+      if (F->isDeclaration())
+        return mayExternalFnCast(F);
       auto mayCastIterator = mayCastMap.find(F);
-      if (mayCastIterator != mayCastMap.end())
-        return mayCastIterator->second;
-
-      visited.insert(F);
+      return mayCastIterator != mayCastMap.end() && mayCastIterator->second;
+    }
 
-      bool isCurrentComplete = true;
-      for (auto &I : *(*CG)[F]) {
-        return true;
-        Function *calleeFunction = I.second->getFunction();
-        // Default to true to avoid accidental bugs on API changes
-        bool result = false;
-        // Indirect call
-        if (!calleeFunction) {
-          result = true;
-          // Recursion detected, do not process callee
-        } else if (visited.count(calleeFunction)) {
-          isCurrentComplete = false;
-          // Explicit call to checker
-        } else if (
-          calleeFunction->getName().find("__dynamic_casting_verification") !=
-          StringRef::npos ||
-          calleeFunction->getName().find("__type_casting_verification_changing") !=
-          StringRef::npos ||
-          calleeFunction->getName().find("__type_casting_verification") !=
-          StringRef::npos) {
-          result = true;
-          // Check recursively
-        } else {
-          bool isCalleeComplete;
-          result = mayCast(calleeFunction, visited, &isCalleeComplete);
-          // Forbid from caching if callee was not complete (due to recursion)
-          isCurrentComplete &= isCalleeComplete;
+    // Whether F calls a function known to cast. An indirect call may
+    // reach a function of another module, so it may cast unless the
+    // module is the whole program (stack-opt-whole-program, e.g. LTO).
+    // Then it reaches an address-taken function of its type, or external
+    // code if there is none.
+    bool mayCallCast(Function *F, std::map<FunctionType *,
+                     std::vector<Function *>> &AddressTakenFns) {
+      for (inst_iterator I = inst_begin(F), E = inst_end(F); I != E; ++I) {
+        CallSite CS(&*I);
+        if (!CS || CS.isInlineAsm())
+          continue;
+        if (Function *Callee =
+            dyn_cast<Function>(CS.getCalledValue()->stripPointerCasts())) {
+          if (mayCalleeCast(Callee))
+            return true;
+          continue;
         }
-        // Found a potentialy cast, report true
-        if (result) {
-          // Cache and report even if it was incomplete
-          // Missing traversal can never flip it to not found
-          mayCastMap.insert(std::make_pair(F, true));
-          *isComplete = true;
+        if (!ClStackWholeProgramOpt)
           return true;
-        }
+        auto Targets = AddressTakenFns.find(CS.getFunctionType());
+        if (Targets == AddressTakenFns.end())
+          return true;
+        for (Function *Target : Targets->second)
+          if (mayCalleeCast(Target))
+            return true;
       }
-
-      // No cast found anywhere, report false
-      // Do not cache negative results if current traversal
-      // was not complete (due to recursion)
-      /*if (isCurrentComplete) {
-        mayCastMap.insert(std::make_pair(F, false));
-        }*/
-      // Report to caller that this traversal was incomplete
-      *isComplete = isCurrentComplete;
       return false;
     }
 
+    // This is typesan's optimization method to reduce stack object tracing
+    // overhead: functions that can never reach a cast check need not trace
+    // their stack objects. The call graph SCCs are visited bottom-up, and
+    // the traversal repeats until indirect calls, which are not edges of
+    // the call graph, change nothing.
+    void computeMayCast(Module &M) {
+      std::map<FunctionType *, std::vector<Function *>> AddressTakenFns;
+      for (Function &F : M)
+        if (F.hasAddressTaken())
+          AddressTakenFns[F.getFunctionType()].push_back(&F);
+
+      bool isChanged = true;
+      while (isChanged) {
+        isChanged = false;
+        for (scc_iterator<CallGraph *> SCC = scc_begin(CG); !SCC.isAtEnd();
+             ++SCC) {
+          // Functions of one SCC reach each other
+          bool SCCMayCast = false;
+          for (CallGraphNode *Node : *SCC) {
+            Function *F = Node->getFunction();
+            if (!F || F->isDeclaration())
+              continue;
+            mayCastMap.insert(std::make_pair(F, false));
+            if (!SCCMayCast && mayCallCast(F, AddressTakenFns))
+              SCCMayCast = true;
+          }
+          if (!SCCMayCast)
+            continue;
+          for (CallGraphNode *Node : *SCC) {
+            Function *F = Node->getFunction();
+            if (F && !F->isDeclaration() && !mayCastMap[F]) {
+              mayCastMap[F] = true;
+              isChanged = true;
+            }
+          }
+        }
+      }
+    }
+
+    // Functions the call graph does not reach are kept traced
     bool isSafeStackFn(Function *F) {
       assert(F && "Function can't be null");
 
-      std::set<Function*> visitedFunctions;
-      bool tmp;
-      bool mayCurrentCast = mayCast(&*F, visitedFunctions, &tmp);
-      mayCastMap.insert(std::make_pair(&*F, mayCurrentCast));
-      if (!mayCurrentCast)
+      auto mayCastIterator = mayCastMap.find(F);
+      return mayCastIterator == mayCastMap.end() || mayCastIterator->second;
+    }
+
+    unsigned countInterestingAllocas(Function *F) {
+      unsigned NumAlloca = 0;
+      for (inst_iterator I = inst_begin(F), E = inst_end(F); I != E; ++I)
+        if (AllocaInst *AI = dyn_cast<AllocaInst>(&*I))
+          if (HexTypeUtilSet->isInterestingType(AI->getAllocatedType()))
+            NumAlloca++;
+      return NumAlloca;
+    }
+
+    // Whether the callee of CS may cast the pointer passed as U, store it
+    // or pass it on. Only the memory intrinsics and lifetime markers are
+    // known not to; defined callees are analyzed through their argument.
+    bool mayCallEscape(CallSite CS, Use &U) {
+      if (IntrinsicInst *II = dyn_cast<IntrinsicInst>(CS.getInstruction()))
+        switch (II->getIntrinsicID()) {
+        case Intrinsic::lifetime_start:
+        case Intrinsic::lifetime_end:
+        case Intrinsic::memcpy:
+        case Intrinsic::memmove:
+        case Intrinsic::memset:
+          return false;
+        default:
+          return true;
+        }
+
+      if (CS.isCallee(&U))
+        return true;
+      Function *Callee =
+        dyn_cast<Function>(CS.getCalledValue()->stripPointerCasts());
+      if (!Callee || Callee->isDeclaration() || Callee->isInterposable())
+        return true;
+      unsigned ArgNo = CS.getArgumentNo(&U);
+      if (ArgNo >= Callee->arg_size())
+        return true;
+      return mayArgumentEscape(&*std::next(Callee->arg_begin(), ArgNo));
+    }
+
+    // Each argument is analyzed once. An argument reached again while it
+    // is being analyzed (recursion) is assumed to escape.
+    bool mayArgumentEscape(Argument *Arg) {
+      auto ArgEscapeIterator = ArgEscapeMap.find(Arg);
+      if (ArgEscapeIterator != ArgEscapeMap.end())
+        return ArgEscapeIterator->second;
+      ArgEscapeMap[Arg] = true;
+      std::set<Value *> Visited;
+      bool mayEscape = mayPointerEscape(Arg, Visited);
+      ArgEscapeMap[Arg] = mayEscape;
+      return mayEscape;
+    }
+
+    // Whether the stack address in V may be cast, stored to memory,
+    // returned or passed to a callee that may do so. Only an object whose
+    // address may reach a cast check needs to be traced, and a check
+    // always takes the address from a ptrtoint.
+    bool mayPointerEscape(Value *V, std::set<Value *> &Visited) {
+      for (Use &U : V->uses()) {
+        Instruction *I = dyn_cast<Instruction>(U.getUser());
+        if (!I)
+          return true;
+
+        switch (I->getOpcode()) {
+        case Instruction::Load:
+        case Instruction::ICmp:
+          break;
+        case Instruction::Store:
+          // Storing to the pointee is safe, storing the pointer is not
+          if (U.getOperandNo() == 0)
+            return true;
+          break;
+        case Instruction::GetElementPtr:
+        case Instruction::BitCast:
+        case Instruction::AddrSpaceCast:
+        case Instruction::PHI:
+        case Instruction::Select:
+          if (Visited.insert(I).second && mayPointerEscape(I, Visited))
+            return true;
+          break;
+        case Instruction::Call:
+        case Instruction::Invoke:
+          if (mayCallEscape(CallSite(I), U))
+            return true;
+          break;
+        default:
+          // ptrtoint, ret and any other use
+          return true;
+        }
+      }
+      return false;
+    }
+
+    void reportStackOpt(Module &M) {
+      if (!ClMakeLogInfo)
+        return;
+      char fileName[MAXLEN];
+      char tmp[MAXLEN];
+      strcpy(fileName, "/stack_opt_info.txt");
+      snprintf(tmp, sizeof(tmp),
+               "%s : %u stack objects traced, %u elided (%u cannot be cast, "
+               "%u do not escape), %u objects in frame descriptors",
+               M.getName().str().c_str(),
+               (unsigned)AllAllocaSet.size(),
+               NumMayCastElided + NumNoEscapeElided,
+               NumMayCastElided, NumNoEscapeElided, NumFrameObj);
+      HexTypeUtilSet->writeInfoToFile(tmp, fileName);
+    }
+
+    // Static allocas that can be laid out in one frame object: no
+    // alignment beyond the ABI one, not returned, and live for the whole
+    // call. An object with lifetime markers is left alone, so that stack
+    // coloring can still share its slot with objects of other scopes.
+    bool isFrameAlloca(AllocaInst *AI) {
+      if (!AI->isStaticAlloca() || AI->isUsedWithInAlloca() ||
+          AI->isSwiftError())
         return false;
+      ConstantInt *ArraySize = cast<ConstantInt>(AI->getArraySize());
+      if (ArraySize->isZero() ||
+          AI->getAlignment() >
+          HexTypeUtilSet->DL.getABITypeAlignment(AI->getAllocatedType()))
+        return false;
+      for (User *U : AI->users())
+        if (isa<ReturnInst>(U))
+          return false;
+      return !hasLifetimeMarkers(AI);
+    }
 
-      return true;
+    bool hasLifetimeMarkers(Value *V) {
+      for (User *U : V->users()) {
+        if (IntrinsicInst *II = dyn_cast<IntrinsicInst>(U)) {
+          if (II->getIntrinsicID() == Intrinsic::lifetime_start ||
+              II->getIntrinsicID() == Intrinsic::lifetime_end)
+            return true;
+        } else if (isa<BitCastInst>(U) && hasLifetimeMarkers(U)) {
+          return true;
+        }
+      }
+      return false;
+    }
+
+    void forgetAlloca(AllocaInst *AI) {
+      AllAllocaSet.remove(AI);
+      AllAllocaWithFnSet.erase(AI);
+      LifeTimeStartSet.erase(AI);
+      LifeTimeEndSet.erase(AI);
+    }
+
+    // Merge the traced static allocas of F into one frame object and
+    // describe its objects in a constant table, so the whole frame is
+    // registered with one call on entry and unregistered with one call
+    // on return. The runtime resolves the objects from the table.
+    void emitFrameTrace(Module &M, Function *F,
+                        std::vector<AllocaInst *> &Allocas) {
+      std::vector<AllocaInst *> FrameAllocas;
+      std::vector<Type *> FieldTys;
+      for (AllocaInst *AI : Allocas) {
+        if (!isFrameAlloca(AI))
+          continue;
+        uint64_t Count = cast<ConstantInt>(AI->getArraySize())->getZExtValue();
+        FrameAllocas.push_back(AI);
+        FieldTys.push_back(Count == 1 ? AI->getAllocatedType() :
+                           ArrayType::get(AI->getAllocatedType(), Count));
+      }
+      if (FrameAllocas.empty())
+        return;
+
+      StructType *FrameTy = StructType::get(M.getContext(), FieldTys);
+      const StructLayout *SL = HexTypeUtilSet->DL.getStructLayout(FrameTy);
+      std::vector<Constant*> Entries;
+      uint32_t NumObj = 0;
+      for (unsigned i = 0; i < FieldTys.size(); i++) {
+        // arrays are described by their element type and length
+        Type *ObjTy = FieldTys[i];
+        uint64_t Count = 1;
+        while (ArrayType *Array = dyn_cast<ArrayType>(ObjTy)) {
+          Count *= Array->getNumElements();
+          ObjTy = Array->getElementType();
+        }
+        NumObj += HexTypeUtilSet->getFrameDescEntries(
+          ObjTy, SL->getElementOffset(i), Count, Entries);
+      }
+      if (Entries.empty())
+        return;
+
+      BasicBlock &EntryBB = F->getEntryBlock();
+      AllocaInst *FrameAI =
+        new AllocaInst(FrameTy, nullptr, "hextype.frame", &*EntryBB.begin());
+      FrameAI->setAlignment(
+        HexTypeUtilSet->DL.getABITypeAlignment(FrameTy));
+      BasicBlock::iterator InsertPt = EntryBB.begin();
+      while (isa<AllocaInst>(&*InsertPt))
+        ++InsertPt;
+      IRBuilder<> Builder(&*InsertPt);
+
+      DIBuilder DIB(M);
+      for (unsigned i = 0; i < FrameAllocas.size(); i++) {
+        AllocaInst *AI = FrameAllocas[i];
+        Value *Field = Builder.CreateStructGEP(FrameTy, FrameAI, i);
+        if (isa<ArrayType>(FieldTys[i]) && FieldTys[i] != AI->getAllocatedType())
+          Field = Builder.CreateConstInBoundsGEP2_32(FieldTys[i], Field, 0, 0);
+        replaceDbgDeclareForAlloca(AI, FrameAI, DIB, false,
+                                   SL->getElementOffset(i));
+        Field->takeName(AI);
+        AI->replaceAllUsesWith(Field);
+        forgetAlloca(AI);
+        AI->eraseFromParent();
+      }
+
+      GlobalVariable *Desc =
+        HexTypeUtilSet->emitFrameDesc(M, F, SL->getSizeInBytes(), NumObj,
+                                      Entries);
+      Value *FrameAddr =
+        Builder.CreatePtrToInt(FrameAI, HexTypeUtilSet->IntptrTyN);
+      Function *RegisterFn =
+        (Function*)M.getOrInsertFunction("__register_stack_frame",
+                                         HexTypeUtilSet->VoidTy,
+                                         HexTypeUtilSet->IntptrTyN,
+                                         HexTypeUtilSet->Int8PtrTy,
+                                         nullptr);
+      Value *Param[2] = {FrameAddr,
+        Builder.CreatePointerCast(Desc, HexTypeUtilSet->Int8PtrTy)};
+      Builder.CreateCall(RegisterFn, Param);
+
+      // Frames skipped by an exception without landing pad or by longjmp
+      // are dropped by the runtime on the next registration.
+      Function *UnregisterFn =
+        (Function*)M.getOrInsertFunction("__unregister_stack_frame",
+                                         HexTypeUtilSet->VoidTy,
+                                         HexTypeUtilSet->IntptrTyN,
+                                         nullptr);
+      for (BasicBlock &BB : *F) {
+        TerminatorInst *Term = BB.getTerminator();
+        if (isa<ReturnInst>(Term) || isa<ResumeInst>(Term)) {
+          IRBuilder<> BuilderRet(Term);
+          BuilderRet.CreateCall(UnregisterFn, FrameAddr);
+        }
+      }
+      NumFrameObj += NumObj;
+    }
+
+    void stackFrameTracing(Module &M) {
+      std::map<Function *, std::vector<AllocaInst *>> FnAllocas;
+      for (AllocaInst *AI : AllAllocaSet)
+        FnAllocas[AI->getParent()->getParent()].push_back(AI);
+      for (auto &FnAlloca : FnAllocas)
+        emitFrameTrace(M, FnAlloca.first, FnAlloca.second);
     }
 
     void stackObjTracing(Module &M) {
+      NumMayCastElided = 0;
+      NumNoEscapeElided = 0;
+      NumFrameObj = 0;
+      if (ClStackOpt)
+        computeMayCast(M);
       for (Module::iterator F = M.begin(), E = M.end(); F != E; ++F) {
         if(!HexTypeUtilSet->isInterestingFn(&*F))
           continue;
         // Apply stack optimization
-        if (ClStackOpt && !isSafeStackFn(&*F))
+        if (ClStackOpt && !isSafeStackFn(&*F)) {
+          NumMayCastElided += countInterestingAllocas(&*F);
           continue;
+        }
 
         handleFnPrameter(M, &*F);
         for (Function::iterator BB = F->begin(), E = F->end(); BB != E; ++BB)
@@ -343,8 +636,12 @@ namespace {
           }
         findReturnInsts(&*F);
       }
+      if (ClStackFrameOpt)
+        stackFrameTracing(M);
       handleAllocaAdd(M);
       handleAllocaDelete(M);
+      if (ClStackOpt || ClStackEscapeOpt || ClStackFrameOpt)
+        reportStackOpt(M);
     }
 
     void globalObjTracing(Module &M) {
@@ -352,6 +649,9 @@ namespace {
       BasicBlock *BBGlobal = BasicBlock::Create(M.getContext(),
                                                 "entry", FGlobal);
       IRBuilder<> BuilderGlobal(BBGlobal);
+      if (HexTypeUtilSet->AllTypeInfo.size() > 0)
+        HexTypeUtilSet->emitTypeInfoUpdate(M, BuilderGlobal);
+      std::vector<Constant*> GlobalTableEntries;
 
       for (GlobalVariable &GV : M.globals()) {
         if (GV.getName() == "llvm.global_ctors" ||
@@ -376,6 +676,13 @@ namespace {
             NElems = ConstantInt::get(HexTypeUtilSet->Int64Ty, 1);
           }
 
+          if (ClGlobalTableOpt) {
+            HexTypeUtilSet->getGlobalObjDescEntries(
+              &GV, AllocaType, cast<ConstantInt>(NElems)->getZExtValue(),
+              GlobalTableEntries);
+            continue;
+          }
+
           HexTypeUtilSet->getArrayOffsets(AllocaType, offsets, 0);
           if(offsets.size() == 0) continue;
 
@@ -386,11 +693,19 @@ namespace {
                                        NElems, NULL, BBGlobal);
         }
       }
+      if (GlobalTableEntries.size() > 0)
+        HexTypeUtilSet->emitGlobalObjTable(M, BuilderGlobal,
+                                           GlobalTableEntries);
       BuilderGlobal.CreateRetVoid();
       appendToGlobalCtors(M, FGlobal, 0);
     }
 
     void emitTypeInfoAsGlobalVal(Module &M) {
+      if (ClTypeSectionOpt) {
+        HexTypeUtilSet->emitTypeInfoRecords(M);
+        return;
+      }
+
       std::string mname = M.getName();
       HexTypeUtilSet->syncModuleName(mname);
 
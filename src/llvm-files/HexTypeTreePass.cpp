@@ -15,6 +15,11 @@
 #include "llvm/IR/LegacyPassManager.h"
 #include "llvm/IR/Constants.h"
 #include "llvm/IR/Instructions.h"
+#include "llvm/IR/IntrinsicInst.h"
+#include "llvm/IR/CallSite.h"
+#include "llvm/IR/CFG.h"
+#include "llvm/IR/DiagnosticInfo.h"
+#include "llvm/IR/DebugInfoMetadata.h"
 #include "llvm/Transforms/Instrumentation.h"
 #include "llvm/Transforms/IPO/PassManagerBuilder.h"
 #include "llvm/Transforms/Utils/HexTypeUtil.h"
@@ -22,9 +27,16 @@
 #include "llvm/Transforms/Utils/BasicBlockUtils.h"
 #include "llvm/Analysis/TargetLibraryInfo.h"
 #include "llvm/Analysis/MemoryBuiltins.h"
+#include "llvm/Analysis/LoopInfo.h"
+#include "llvm/Analysis/ScalarEvolution.h"
+#include "llvm/Analysis/ScalarEvolutionExpander.h"
+#include "llvm/Analysis/ScalarEvolutionExpressions.h"
+#include "llvm/IR/Dominators.h"
+#include "llvm/IR/InstIterator.h"
 #include "llvm/Support/raw_ostream.h"
 
 #include <cxxabi.h>
+#include <tuple>
 
 #define MAXLEN 10000
 
@@ -40,6 +52,12 @@ namespace {
 
     HexTypeLLVMUtil *HexTypeUtilSet;
 
+    void getAnalysisUsage(AnalysisUsage &Info) const {
+      Info.addRequired<DominatorTreeWrapperPass>();
+      Info.addRequired<LoopInfoWrapperPass>();
+      Info.addRequired<ScalarEvolutionWrapperPass>();
+    }
+
     void emitPhantomTypeInfo(Module &M) {
       FunctionType *FTy = FunctionType::get(HexTypeUtilSet->VoidTy, false);
       Function *F = Function::Create(FTy, GlobalValue::InternalLinkage,
@@ -52,19 +70,50 @@ namespace {
       BasicBlock *BB = BasicBlock::Create(M.getContext(), "entry", F);
       IRBuilder<> Builder(BB);
 
-      std::string initName = "__update_phantom_info";
-      Constant *GCOVInit = M.getOrInsertFunction(initName,
-                                                 HexTypeUtilSet->VoidTy,
-                                                 HexTypeUtilSet->Int64PtrTy,
-                                                 nullptr);
-      Builder.CreateCall(GCOVInit,
-                         Builder.CreatePointerCast(
-                           HexTypeUtilSet->typePhantomInfoArrayGlobal,
-                           HexTypeUtilSet->Int64PtrTy));
+      // the phantom records are registered with the type section
+      if (!ClTypeSectionOpt) {
+        std::string initName = "__update_phantom_info";
+        Constant *GCOVInit = M.getOrInsertFunction(initName,
+                                                   HexTypeUtilSet->VoidTy,
+                                                   HexTypeUtilSet->Int64PtrTy,
+                                                   nullptr);
+        Builder.CreateCall(GCOVInit,
+                           Builder.CreatePointerCast(
+                             HexTypeUtilSet->typePhantomInfoArrayGlobal,
+                             HexTypeUtilSet->Int64PtrTy));
+      }
+      HexTypeUtilSet->emitTypeInfoUpdate(M, Builder);
       Builder.CreateRetVoid();
       appendToGlobalCtors(M, F, 0);
     }
 
+    // Per-site hit and miss counts for HEX_LOG runtimes, reported with the
+    // source location of the cast.
+    void emitSiteCacheCount(Module &M, IRBuilder<> &Builder,
+                            GlobalVariable *SiteCache, CallInst *call,
+                            Value *isSiteHit) {
+      std::string Location;
+      raw_string_ostream LocationStream(Location);
+      LocationStream << call->getFunction()->getName();
+      if (const DILocation *Loc = call->getDebugLoc())
+        LocationStream << " " << Loc->getFilename() << ":" << Loc->getLine()
+                       << ":" << Loc->getColumn();
+      LocationStream.flush();
+
+      Function *SiteCountFunction =
+        (Function*)M.getOrInsertFunction(
+          "__site_cache_count", HexTypeUtilSet->VoidTy,
+          HexTypeUtilSet->Int8PtrTy,
+          HexTypeUtilSet->Int8PtrTy,
+          HexTypeUtilSet->Int8Ty,
+          nullptr);
+      Value *Param[3] = {
+        Builder.CreatePointerCast(SiteCache, HexTypeUtilSet->Int8PtrTy),
+        Builder.CreateGlobalStringPtr(Location),
+        Builder.CreateZExt(isSiteHit, HexTypeUtilSet->Int8Ty) };
+      Builder.CreateCall(SiteCountFunction, Param);
+    }
+
     void emitExtendObjTraceInst(Module &M, int hashIndex,
                                 CallInst *call, int extendTarget) {
       ConstantInt *HashValueConst =
@@ -153,6 +202,12 @@ namespace {
     }
 
     void emitTypeInfoAsGlobalVal(Module &M) {
+      if (ClTypeSectionOpt) {
+        HexTypeUtilSet->emitTypeInfoRecords(M);
+        emitPhantomTypeInfo(M);
+        return;
+      }
+
       std::string mname = M.getName();
       HexTypeUtilSet->syncModuleName(mname);
 
@@ -497,9 +552,347 @@ namespace {
         }
     }
 
+    bool isCastCheck(Instruction *I) {
+      if (CallInst *call = dyn_cast<CallInst>(I))
+        if (Function *Callee = call->getCalledFunction())
+          return Callee->getName() == "__type_casting_verification";
+      return false;
+    }
+
+    // Whether I can free an object or trace a new type at its address:
+    // delete, placement new, reinterpret_cast and any other call that may
+    // write memory, or the end of a stack slot's lifetime. Cast checks
+    // only read the object map.
+    bool mayChangeObjInfo(Instruction *I) {
+      if (isa<DbgInfoIntrinsic>(I))
+        return false;
+      if (IntrinsicInst *II = dyn_cast<IntrinsicInst>(I))
+        return II->getIntrinsicID() == Intrinsic::lifetime_start ||
+          II->getIntrinsicID() == Intrinsic::lifetime_end;
+      CallSite CS(I);
+      if (!CS)
+        return false;
+      if (Function *Callee = CS.getCalledFunction()) {
+        StringRef Name = Callee->getName();
+        if (Name.startswith("__type_casting_verification") ||
+            Name.startswith("__dynamic_casting_verification"))
+          return false;
+      }
+      return !CS.onlyReadsMemory();
+    }
+
+    typedef std::tuple<Function *, Value *, Value *, Value *> CheckKey;
+
+    struct AvailableCheck {
+      CallInst *Check;
+      unsigned Generation;
+    };
+
+    typedef std::map<CheckKey, std::vector<AvailableCheck>> AvailableCheckMap;
+
+    // Checks are identical if they call the same function on the same
+    // pointers and hash; pointers are compared without their casts.
+    bool getCheckKey(CallInst *Check, CheckKey &Key) {
+      Function *Callee = Check->getCalledFunction();
+      if (!Callee || (Callee->getName() != "__type_casting_verification" &&
+                      Callee->getName() != "__type_casting_verification_changing"))
+        return false;
+      Value *Arg[3] = {nullptr, nullptr, nullptr};
+      for (unsigned i = 0; i < Check->getNumArgOperands() && i < 3; i++) {
+        Arg[i] = Check->getArgOperand(i);
+        if (PtrToIntInst *PtrToInt = dyn_cast<PtrToIntInst>(Arg[i]))
+          Arg[i] = PtrToInt->getPointerOperand()->stripPointerCasts();
+      }
+      Key = std::make_tuple(Callee, Arg[0], Arg[1], Arg[2]);
+      return true;
+    }
+
+    // Whether a block on some path from the end of Dom to the start of BB
+    // can change object information. Dom is the immediate dominator of BB.
+    bool isPathKilled(BasicBlock *Dom, BasicBlock *BB,
+                      std::set<BasicBlock *> &KillBlocks) {
+      std::set<BasicBlock *> Visited;
+      std::vector<BasicBlock *> WorkList(pred_begin(BB), pred_end(BB));
+      while (!WorkList.empty()) {
+        BasicBlock *Pred = WorkList.back();
+        WorkList.pop_back();
+        if (Pred == Dom || !Visited.insert(Pred).second)
+          continue;
+        if (KillBlocks.count(Pred))
+          return true;
+        WorkList.insert(WorkList.end(), pred_begin(Pred), pred_end(Pred));
+      }
+      return false;
+    }
+
+    // Walk the dominator tree like EarlyCSE: a check is available below
+    // it until an instruction that may change object information starts
+    // a new generation. Blocks reached through a join start a new one if
+    // any path to them from their dominator is killed.
+    void findRedundantChecks(DomTreeNode *Node, unsigned Generation,
+                             unsigned &LastGeneration,
+                             AvailableCheckMap &Available,
+                             std::set<BasicBlock *> &KillBlocks,
+                             DominatorTree &DT,
+                             std::vector<CallInst *> &Redundant) {
+      BasicBlock *BB = Node->getBlock();
+      if (DomTreeNode *IDom = Node->getIDom())
+        if (BB->getSinglePredecessor() != IDom->getBlock() &&
+            isPathKilled(IDom->getBlock(), BB, KillBlocks))
+          Generation = ++LastGeneration;
+
+      for (Instruction &I : *BB) {
+        CheckKey Key;
+        CallInst *call = dyn_cast<CallInst>(&I);
+        if (call && getCheckKey(call, Key)) {
+          std::vector<AvailableCheck> &Checks = Available[Key];
+          bool isRedundant = false;
+          for (AvailableCheck &Check : Checks)
+            if (Check.Generation == Generation &&
+                DT.dominates(Check.Check, call)) {
+              isRedundant = true;
+              break;
+            }
+          if (isRedundant)
+            Redundant.push_back(call);
+          else
+            Checks.push_back({call, Generation});
+        } else if (mayChangeObjInfo(&I)) {
+          Generation = ++LastGeneration;
+        }
+      }
+
+      for (DomTreeNode *Child : *Node)
+        findRedundantChecks(Child, Generation, LastGeneration, Available,
+                            KillBlocks, DT, Redundant);
+    }
+
+    // Remove checks of a pointer that an identical check dominates, as
+    // long as the object cannot change in between. A bad cast is still
+    // reported once, by the dominating check.
+    void redundantCheckElimination(Module &M) {
+      for (Module::iterator F = M.begin(), E = M.end(); F != E; ++F) {
+        if (F->isDeclaration())
+          continue;
+        std::set<BasicBlock *> KillBlocks;
+        bool hasCheck = false;
+        for (inst_iterator I = inst_begin(&*F), IE = inst_end(&*F);
+             I != IE; ++I) {
+          CheckKey Key;
+          CallInst *call = dyn_cast<CallInst>(&*I);
+          if (call && getCheckKey(call, Key))
+            hasCheck = true;
+          else if (mayChangeObjInfo(&*I))
+            KillBlocks.insert(I->getParent());
+        }
+        if (!hasCheck)
+          continue;
+
+        DominatorTree &DT =
+          getAnalysis<DominatorTreeWrapperPass>(*F).getDomTree();
+        AvailableCheckMap Available;
+        std::vector<CallInst *> Redundant;
+        unsigned LastGeneration = 0;
+        findRedundantChecks(DT.getRootNode(), 0, LastGeneration, Available,
+                            KillBlocks, DT, Redundant);
+        if (Redundant.empty())
+          continue;
+
+        emitOptimizationRemark(M.getContext(), "hextype", *F,
+                               Redundant.front()->getDebugLoc(),
+                               "removed " + Twine(Redundant.size()) +
+                               " redundant typecasting verification(s) in " +
+                               F->getName());
+        for (CallInst *Check : Redundant)
+          Check->eraseFromParent();
+      }
+    }
+
+    bool isCastCheck(CallSite CS) {
+      if (!CS || !CS.getCalledFunction())
+        return false;
+      StringRef Name = CS.getCalledFunction()->getName();
+      return Name.startswith("__type_casting_verification") ||
+        Name.startswith("__dynamic_casting_verification");
+    }
+
+    // Whether I is a call, other than a cast check, that may throw or
+    // never return. A check moved in front of the loop must not verify a
+    // pointer the loop would not have reached past such a call.
+    bool mayLeaveLoop(Instruction *I) {
+      CallSite CS(I);
+      return CS && !isCastCheck(CS) &&
+        (!CS.doesNotThrow() || CS.doesNotReturn());
+    }
+
+    // Checks of array elements may only be batched in a loop that cannot
+    // change memory: the objects and the pointers loaded to reach them are
+    // then the same in every iteration. Other checks only read the object
+    // map. Every other call must return normally, or the batch would
+    // check elements the loop never reached.
+    bool isReadOnlyLoop(Loop *L) {
+      for (BasicBlock *BB : L->blocks())
+        for (Instruction &I : *BB) {
+          if (isCastCheck(CallSite(&I)))
+            continue;
+          if (I.mayWriteToMemory() || mayLeaveLoop(&I))
+            return false;
+        }
+      return true;
+    }
+
+    // Number of times a check runs once loop L is entered: the backedge
+    // count plus one if it runs before the exit test of every iteration,
+    // the backedge count if it runs only after the test passed. nullptr if
+    // the check does not run in every iteration.
+    const SCEV *getCheckCount(Loop *L, Instruction *Check,
+                              DominatorTree &DT, ScalarEvolution &SE,
+                              bool &RunsOnEntry) {
+      BasicBlock *BB = Check->getParent();
+      BasicBlock *Exiting = L->getExitingBlock();
+      BasicBlock *Latch = L->getLoopLatch();
+      if (!Exiting || !Latch || !DT.dominates(BB, Latch))
+        return nullptr;
+
+      const SCEV *BackedgeCount = SE.getBackedgeTakenCount(L);
+      if (isa<SCEVCouldNotCompute>(BackedgeCount))
+        return nullptr;
+      BackedgeCount =
+        SE.getNoopOrZeroExtend(BackedgeCount, HexTypeUtilSet->Int64Ty);
+
+      RunsOnEntry = DT.dominates(BB, Exiting);
+      if (RunsOnEntry)
+        return SE.getAddExpr(BackedgeCount,
+                             SE.getConstant(HexTypeUtilSet->Int64Ty, 1));
+      if (DT.dominates(Exiting, BB))
+        return BackedgeCount;
+      return nullptr;
+    }
+
+    // A check of a loop invariant pointer gives the same result in every
+    // iteration as long as nothing in the loop frees or re-traces objects,
+    // and every iteration gets to it unless the loop exits normally.
+    bool isObjInfoStable(Loop *L) {
+      for (BasicBlock *BB : L->blocks())
+        for (Instruction &I : *BB)
+          if (mayChangeObjInfo(&I) || mayLeaveLoop(&I))
+            return false;
+      return true;
+    }
+
+    // Move a check of the innermost loop around it into the preheader:
+    // one check if the pointer is loop invariant, or one batch call if it
+    // is loaded from an array walked with a constant stride. A hoisted
+    // check of an invariant pointer moves on through the enclosing loops.
+    bool hoistLoopCheck(Module &M, CallInst *Check, LoopInfo &LI,
+                        DominatorTree &DT, ScalarEvolution &SE) {
+      Loop *L = LI.getLoopFor(Check->getParent());
+      if (!L || !L->getLoopPreheader())
+        return false;
+      bool RunsOnEntry;
+      const SCEV *CountSCEV = getCheckCount(L, Check, DT, SE, RunsOnEntry);
+      if (!CountSCEV || !isSafeToExpand(CountSCEV, SE))
+        return false;
+
+      Value *SrcValue = Check->getArgOperand(0);
+      Value *SrcPtr = nullptr;
+      if (PtrToIntInst *PtrToInt = dyn_cast<PtrToIntInst>(SrcValue))
+        SrcPtr = PtrToInt->getPointerOperand();
+
+      Instruction *InsertPt = L->getLoopPreheader()->getTerminator();
+      IRBuilder<> Builder(InsertPt);
+      SCEVExpander Expander(SE, M.getDataLayout(), "hextype");
+
+      if (L->isLoopInvariant(SrcValue) ||
+          (SrcPtr && L->isLoopInvariant(SrcPtr))) {
+        if (!isObjInfoStable(L))
+          return false;
+        if (!L->isLoopInvariant(SrcValue))
+          SrcValue = Builder.CreatePtrToInt(SrcPtr, HexTypeUtilSet->IntptrTyN);
+        // the runtime skips null, which stands for a loop that never
+        // reaches the check
+        if (!RunsOnEntry) {
+          Value *Count = Expander.expandCodeFor(CountSCEV,
+                                                HexTypeUtilSet->Int64Ty,
+                                                InsertPt);
+          SrcValue = Builder.CreateSelect(
+            Builder.CreateIsNotNull(Count), SrcValue,
+            ConstantInt::get(HexTypeUtilSet->IntptrTyN, 0));
+        }
+        Value *Param[2] = {SrcValue, Check->getArgOperand(1)};
+        CallInst *Hoisted =
+          Builder.CreateCall(Check->getCalledFunction(), Param);
+        Check->eraseFromParent();
+        hoistLoopCheck(M, Hoisted, LI, DT, SE);
+        return true;
+      }
+
+      if (!SrcPtr || !isReadOnlyLoop(L))
+        return false;
+      LoadInst *Load = dyn_cast<LoadInst>(SrcPtr->stripPointerCasts());
+      if (!Load || Load->isVolatile() || !Load->getType()->isPointerTy() ||
+          !L->contains(Load))
+        return false;
+      const SCEVAddRecExpr *Elements =
+        dyn_cast<SCEVAddRecExpr>(SE.getSCEV(Load->getPointerOperand()));
+      if (!Elements || Elements->getLoop() != L || !Elements->isAffine() ||
+          !isSafeToExpand(Elements->getStart(), SE))
+        return false;
+      const SCEVConstant *Stride =
+        dyn_cast<SCEVConstant>(Elements->getStepRecurrence(SE));
+      if (!Stride)
+        return false;
+
+      Value *First = Expander.expandCodeFor(Elements->getStart(),
+                                            HexTypeUtilSet->IntptrTyN,
+                                            InsertPt);
+      Value *Count = Expander.expandCodeFor(CountSCEV,
+                                            HexTypeUtilSet->Int64Ty,
+                                            InsertPt);
+      Function *BatchFunction =
+        (Function*)M.getOrInsertFunction(
+          "__type_casting_verification_batch",
+          HexTypeUtilSet->VoidTy,
+          HexTypeUtilSet->IntptrTyN,
+          HexTypeUtilSet->Int64Ty,
+          HexTypeUtilSet->Int64Ty,
+          HexTypeUtilSet->Int64Ty,
+          nullptr);
+      Value *Param[4] = {
+        First, Count,
+        ConstantInt::get(HexTypeUtilSet->Int64Ty,
+                         Stride->getAPInt().getSExtValue()),
+        Check->getArgOperand(1)};
+      Builder.CreateCall(BatchFunction, Param);
+      Check->eraseFromParent();
+      return true;
+    }
+
+    void loopCastOptimization(Module &M) {
+      for (Module::iterator F = M.begin(), E = M.end(); F != E; ++F) {
+        if (F->isDeclaration())
+          continue;
+        std::vector<CallInst *> Checks;
+        for (inst_iterator I = inst_begin(&*F), IE = inst_end(&*F);
+             I != IE; ++I)
+          if (isCastCheck(&*I))
+            Checks.push_back(cast<CallInst>(&*I));
+        if (Checks.empty())
+          continue;
+
+        // Hoisting only adds instructions to preheaders, so the analyses
+        // stay valid for the remaining checks of the function.
+        DominatorTree &DT =
+          getAnalysis<DominatorTreeWrapperPass>(*F).getDomTree();
+        LoopInfo &LI = getAnalysis<LoopInfoWrapperPass>(*F).getLoopInfo();
+        ScalarEvolution &SE =
+          getAnalysis<ScalarEvolutionWrapperPass>(*F).getSE();
+        for (CallInst *Check : Checks)
+          hoistLoopCheck(M, Check, LI, DT, SE);
+      }
+    }
+
     void typecastinginlineoptimization(Module &M)  {
-      GlobalVariable* ResultCache = HexTypeUtilSet->getVerifyResultCache(M);
-      GlobalVariable* GObjTypeMap = HexTypeUtilSet->getObjTypeMap(M);
       for (Module::iterator F = M.begin(), E = M.end(); F != E; ++F)
         for (Function::iterator BB = F->begin(),
              E = F->end(); BB != E;) {
@@ -529,17 +922,14 @@ namespace {
                                            HexTypeUtilSet->IntptrTyN);
                   Value *ptrValueT =
                     Builder.CreateIntToPtr(newPtr, HexTypeUtilSet->IntptrTyN);
-                  Value *ShVal = Builder.CreateLShr(newPtr, 3);
-                  Value *mapSize =
-                    ConstantInt::get(HexTypeUtilSet->IntptrTyN, 268435455);
-                  Value *mapIndex = Builder.CreateAnd(ShVal, mapSize);
+                  Value *mapIndex =
+                    HexTypeUtilSet->emitMapIndex(M, Builder, newPtr);
                   Value *mapIndex64 =
                     Builder.CreatePtrToInt(mapIndex, HexTypeUtilSet->Int64Ty);
 
                   // (3-2) access ObjTypeMap using index
-                  Value* ObjTypeMapInit= Builder.CreateLoad(GObjTypeMap);
                   Value* TargetIndexAddr =
-                    Builder.CreateGEP(ObjTypeMapInit, mapIndex, "");
+                    HexTypeUtilSet->emitMapSlotAddr(M, Builder, mapIndex);
                   Value* TargetIndexAddrValueAddr =
                     Builder.CreateGEP(TargetIndexAddr,
                                       {ConstantInt::get(
@@ -547,10 +937,42 @@ namespace {
                                       ConstantInt::get(
                                         HexTypeUtilSet->Int32Ty, 0)}, "");
 
+                  // (3-3) read the slot under its sequence counter; a
+                  // slot that is being written takes the runtime path
+                  Value *LockAddr =
+                    HexTypeUtilSet->getSlotLockAddr(M, Builder, mapIndex);
+                  LoadInst *SeqBegin = Builder.CreateLoad(LockAddr);
+                  SeqBegin->setAtomic(AtomicOrdering::Acquire);
+                  SeqBegin->setAlignment(4);
+
                   Value* TargetIndexAddrValue =
                     Builder.CreateLoad(TargetIndexAddrValueAddr);
                   Value* isEqual = Builder.CreateICmpEQ(ptrValueT,
                                                         TargetIndexAddrValue);
+                  // (3-4) get src type id
+                  Value *SrcTypeIdAddr =
+                    Builder.CreateGEP(TargetIndexAddr,
+                                      {ConstantInt::get(
+                                          HexTypeUtilSet->Int32Ty, 0),
+                                      ConstantInt::get(
+                                        HexTypeUtilSet->Int32Ty, 1)}, "");
+                  Value *SrcTypeId =
+                    Builder.CreateAnd(Builder.CreateLoad(SrcTypeIdAddr),
+                                      ConstantInt::get(
+                                        HexTypeUtilSet->Int32Ty, 0xffffff));
+
+                  Builder.CreateFence(AtomicOrdering::Acquire);
+                  LoadInst *SeqEnd = Builder.CreateLoad(LockAddr);
+                  SeqEnd->setAtomic(AtomicOrdering::Monotonic);
+                  SeqEnd->setAlignment(4);
+                  Value *isStable =
+                    Builder.CreateAnd(
+                      Builder.CreateICmpEQ(SeqBegin, SeqEnd),
+                      Builder.CreateIsNull(
+                        Builder.CreateAnd(SeqBegin,
+                                          ConstantInt::get(
+                                            HexTypeUtilSet->Int32Ty, 1))));
+                  isEqual = Builder.CreateAnd(isEqual, isStable);
                   Instruction *InsertPt = &*Builder.GetInsertPoint();
                   TerminatorInst *ThenTerm , *ElseTerm ;
                   SplitBlockAndInsertIfThenElse(isEqual,
@@ -559,115 +981,61 @@ namespace {
 
                   // (4) check whether ObjTypeMap[index].addr == src
                   Builder.SetInsertPoint(ThenTerm);
-                  // (4-1) get src hash value
-                  TargetIndexAddrValueAddr =
-                    Builder.CreateGEP(TargetIndexAddr,
-                                      {ConstantInt::get(
-                                          HexTypeUtilSet->Int32Ty, 0),
-                                      ConstantInt::get(
-                                        HexTypeUtilSet->Int32Ty, 2)}, "");
-                  // (4-2) get index using src and dst Hash Value
-                  TargetIndexAddrValue =
-                    Builder.CreateLoad(TargetIndexAddrValueAddr);
-
-                  // (4-3), (src & 0xfff);
-                  Value *srcIndex =
-                    Builder.CreateBitCast(TargetIndexAddrValue,
-                                          HexTypeUtilSet->Int64Ty);
-                  Value *andValue =
-                    ConstantInt::get(HexTypeUtilSet->Int64Ty, 4095);
-                  Value *leftMapIndex = Builder.CreateAnd(srcIndex, andValue);
-
-                  // (4-4), idxCache <<= 12;
-                  Value *curValue = Builder.CreateShl(leftMapIndex, 12);
-
-                  // (4-5), idxCache |= (dst & 0xfff);
                   ConstantInt *constantHashValue2 =
                     dyn_cast<ConstantInt>(call->getArgOperand(1));
                   Value *dstValue = ConstantInt::get(
                     HexTypeUtilSet->Int64Ty,
                     constantHashValue2->getZExtValue());
-                  Value *rightValue = Builder.CreateAnd(dstValue, andValue);
-                  Value *cacheIndex = Builder.CreateOr(curValue, rightValue);
-
-                  // (4-6), verifiedResultCache[idxCache].srcHValue == src &&
-                  //        verifiedResultCache[idxCache].dstHValue == dst
-                  Value* ResultCacheInit = Builder.CreateLoad(ResultCache);
-                  TargetIndexAddr =
-                    Builder.CreateGEP(ResultCacheInit, cacheIndex, "");
-                  Value* TargetIndexAddrValueAddrT =
-                    Builder.CreateGEP(TargetIndexAddr,
-                                      {ConstantInt::get(
-                                          HexTypeUtilSet->Int32Ty, 0),
-                                      ConstantInt::get(
-                                        HexTypeUtilSet->Int32Ty, 0)}, "");
-                  TargetIndexAddrValue =
-                    Builder.CreateLoad(TargetIndexAddrValueAddrT);
-                  Value *srcisEqual =
-                    Builder.CreateICmpEQ(srcIndex, TargetIndexAddrValue);
-                  TargetIndexAddrValueAddrT =
-                    Builder.CreateGEP(TargetIndexAddr,
-                                      {ConstantInt::get(
-                                          HexTypeUtilSet->Int32Ty, 0),
-                                      ConstantInt::get(
-                                        HexTypeUtilSet->Int32Ty, 1)}, "");
-                  TargetIndexAddrValue =
-                    Builder.CreateLoad(TargetIndexAddrValueAddrT);
-                  Value *dstisEqual =
-                    Builder.CreateICmpEQ(dstValue, TargetIndexAddrValue);
-                  llvm::Value *isSatisfied =
-                    Builder.CreateAnd(srcisEqual, dstisEqual);
+                  Value *srcIndex =
+                    Builder.CreateZExt(SrcTypeId, HexTypeUtilSet->Int64Ty);
+
+                  // (4-1) source types already verified at this site
+                  GlobalVariable *SiteCache =
+                    HexTypeUtilSet->createSiteCache(M);
+                  Value *isSiteHit =
+                    HexTypeUtilSet->emitSiteCacheLookup(Builder, SiteCache,
+                                                        SrcTypeId);
+                  if (ClMakeLogInfo)
+                    emitSiteCacheCount(M, Builder, SiteCache, call,
+                                       isSiteHit);
+                  Instruction *SiteInsertPt = &*Builder.GetInsertPoint();
+                  TerminatorInst *SiteMissTerm =
+                    SplitBlockAndInsertIfThen(Builder.CreateNot(isSiteHit),
+                                              SiteInsertPt, false);
+
+                  // (4-2) look (src type id, dst) up in the thread's cache
+                  Builder.SetInsertPoint(SiteMissTerm);
+                  Value *cacheIndex, *TargetIndexAddrValueCache;
+                  Value *isSatisfied =
+                    HexTypeUtilSet->emitLocalCacheLookup(
+                      M, Builder, SrcTypeId,
+                      constantHashValue2->getZExtValue(),
+                      cacheIndex, TargetIndexAddrValueCache);
                   Instruction *InInsertPt = &*Builder.GetInsertPoint();
                   TerminatorInst *InThenTerm , *InElseTerm;
                   SplitBlockAndInsertIfThenElse(isSatisfied,
                                                 InInsertPt, &InThenTerm,
                                                 &InElseTerm, nullptr);
-                  // (4-7) print cache result
+                  // (4-3) the caches hold safe results only
                   Builder.SetInsertPoint(InThenTerm);
-                  Value *GetCacheResult =
-                    Builder.CreateGEP(TargetIndexAddr,
-                                      {ConstantInt::get(
-                                          HexTypeUtilSet->Int32Ty, 0),
-                                      ConstantInt::get(
-                                        HexTypeUtilSet->Int32Ty, 2)}, "");
-                  Value *TargetIndexAddrValueCache =
-                    Builder.CreateLoad(GetCacheResult);
-                  Value *BadCast = ConstantInt::get(HexTypeUtilSet->Int8Ty, 0);
-                  Value *isEqualCacheResult =
-                    Builder.CreateICmpEQ(TargetIndexAddrValueCache, BadCast);
-                  Instruction *InInsertCachePt = &*Builder.GetInsertPoint();
-                  TerminatorInst *InThenCacheTerm , *InElseCacheTerm ;
-
                   if (ClMakeLogInfo) {
                     Function *objUpdateFunction =
                       (Function*)M.getOrInsertFunction(
                         "__lookup_success_count", HexTypeUtilSet->VoidTy,
                         HexTypeUtilSet->Int8Ty, nullptr);
-                    Value *Param[1] = { TargetIndexAddrValueCache };
+                    Value *Param[1] = {
+                      Builder.CreateTrunc(TargetIndexAddrValueCache,
+                                          HexTypeUtilSet->Int8Ty) };
                     Builder.CreateCall(objUpdateFunction, Param);
                   }
-
-                  SplitBlockAndInsertIfThenElse(isEqualCacheResult,
-                                                InInsertCachePt,
-                                                &InThenCacheTerm,
-                                                &InElseCacheTerm, nullptr);
-                  Builder.SetInsertPoint(InThenCacheTerm);
-                  Function *initFunction =
-                    (Function*)M.getOrInsertFunction(
-                      "__type_casting_verification_print_cache_result",
-                      HexTypeUtilSet->VoidTy,
-                      HexTypeUtilSet->Int64Ty, nullptr);
-                  Value *ParamTypeCache[1] = { cacheIndex };
-                  Builder.CreateCall(initFunction, ParamTypeCache);
-                  Builder.SetInsertPoint(InInsertCachePt);
-                  Builder.SetInsertPoint(InElseCacheTerm);
-                  Builder.SetInsertPoint(InInsertCachePt);
+                  HexTypeUtilSet->emitSiteCacheUpdate(
+                    Builder, SiteCache, SrcTypeId, TargetIndexAddrValueCache);
                   Builder.SetInsertPoint(InInsertPt);
                   Builder.SetInsertPoint(InElseTerm);
-                  initFunction =
+                  Function *initFunction =
                     (Function*)M.getOrInsertFunction(
                       "__type_casting_verification_inline",
-                      HexTypeUtilSet->VoidTy,
+                      HexTypeUtilSet->Int32Ty,
                       HexTypeUtilSet->Int64Ty,
                       HexTypeUtilSet->Int64Ty,
                       HexTypeUtilSet->Int64Ty,
@@ -675,7 +1043,9 @@ namespace {
                       nullptr);
                   Value *Param[4] = {srcIndex, dstValue,
                     mapIndex64, cacheIndex};
-                  Builder.CreateCall(initFunction, Param);
+                  Value *VerifyResult = Builder.CreateCall(initFunction, Param);
+                  HexTypeUtilSet->emitSiteCacheUpdate(
+                    Builder, SiteCache, SrcTypeId, VerifyResult);
                   Builder.SetInsertPoint(InInsertPt);
                   Builder.SetInsertPoint(InsertPt);
                   Builder.SetInsertPoint(ElseTerm);
@@ -720,6 +1090,14 @@ namespace {
       if (ClCreateCastRelatedTypeList)
         HexTypeUtilSet->extendCastingRelatedTypeSet();
 
+      // Remove checks repeated on the same object
+      if (ClRedundantCheckOpt)
+        redundantCheckElimination(M);
+
+      // Move checks out of simple loops
+      if (ClLoopCastOpt)
+        loopCastOptimization(M);
+
       // Apply typecasting inline optimization
       if (ClInlineOpt)
         typecastinginlineoptimization(M);
@@ -742,9 +1120,15 @@ namespace {
 //register pass
 char HexTypeTree::ID = 0;
 
-INITIALIZE_PASS(HexTypeTree, "HexTypeTree",
-                "HexTypePass: fast type safety for C++ programs.",
-                false, false)
+INITIALIZE_PASS_BEGIN(HexTypeTree, "HexTypeTree",
+                      "HexTypePass: fast type safety for C++ programs.",
+                      false, false)
+INITIALIZE_PASS_DEPENDENCY(DominatorTreeWrapperPass)
+INITIALIZE_PASS_DEPENDENCY(LoopInfoWrapperPass)
+INITIALIZE_PASS_DEPENDENCY(ScalarEvolutionWrapperPass)
+INITIALIZE_PASS_END(HexTypeTree, "HexTypeTree",
+                    "HexTypePass: fast type safety for C++ programs.",
+                    false, false)
 
 ModulePass *llvm::createHexTypeTreePass() {
   return new HexTypeTree();
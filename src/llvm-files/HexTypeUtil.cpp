@@ -8,6 +8,7 @@
 ////===--------------------------------------------------------------------===//
 
 #include "llvm/Pass.h"
+#include "llvm/ADT/StringExtras.h"
 #include "llvm/IR/Function.h"
 #include "llvm/IR/Module.h"
 #include "llvm/Support/raw_ostream.h"
@@ -36,6 +37,42 @@ namespace llvm {
     "stack-opt", cl::desc("stack object optimization (from typesan)"),
     cl::Hidden, cl::init(false));
 
+  cl::opt<bool> ClStackWholeProgramOpt(
+    "stack-opt-whole-program",
+    cl::desc("with stack-opt, resolve indirect calls to the address-taken "
+             "functions of the module (whole program only, e.g. LTO)"),
+    cl::Hidden, cl::init(false));
+
+  cl::opt<bool> ClStackEscapeOpt(
+    "stack-escape-opt",
+    cl::desc("skip tracing stack objects whose address cannot be cast"),
+    cl::Hidden, cl::init(false));
+
+  cl::opt<bool> ClStackFrameOpt(
+    "stack-frame-opt",
+    cl::desc("register the stack objects of a frame with one call"),
+    cl::Hidden, cl::init(false));
+
+  cl::opt<bool> ClStackLocalOpt(
+    "stack-local-opt",
+    cl::desc("track stack objects in a per-thread table"),
+    cl::Hidden, cl::init(false));
+
+  cl::opt<bool> ClStackLazyOpt(
+    "stack-lazy-opt",
+    cl::desc("drop stack object removal, entries die with their frame"),
+    cl::Hidden, cl::init(false));
+
+  cl::opt<bool> ClTypeSectionOpt(
+    "type-section-opt",
+    cl::desc("emit type info as linker-merged records in their own sections"),
+    cl::Hidden, cl::init(false));
+
+  cl::opt<bool> ClGlobalTableOpt(
+    "global-table-opt",
+    cl::desc("register global objects with one table per module"),
+    cl::Hidden, cl::init(false));
+
   cl::opt<bool> ClSafeStackOpt(
     "safestack-opt",
     cl::desc("stack object tracing optimization using safestack"),
@@ -51,6 +88,21 @@ namespace llvm {
     cl::desc("reduce runtime library function call overhead"),
     cl::Hidden, cl::init(false));
 
+  cl::opt<bool> ClFixedShadowOpt(
+    "fixed-shadow-opt",
+    cl::desc("index the object map at its fixed address OBJTYPEMAPBASE"),
+    cl::Hidden, cl::init(false));
+
+  cl::opt<bool> ClLoopCastOpt(
+    "loop-cast-opt",
+    cl::desc("batch or hoist typecasting verification in simple loops"),
+    cl::Hidden, cl::init(false));
+
+  cl::opt<bool> ClRedundantCheckOpt(
+    "redundant-check-opt",
+    cl::desc("remove typecasting verification dominated by the same check"),
+    cl::Hidden, cl::init(false));
+
   cl::opt<bool> ClCompileTimeVerifyOpt(
     "compile-time-verify-opt",
     cl::desc("compile time verification"),
@@ -267,7 +319,7 @@ namespace llvm {
           ST->getName().endswith(".base"))
         continue;
 
-      if (ST->getName().startswith("struct.VerifyResultCache") ||
+      if (ST->getName().startswith("struct.LocalResultCache") ||
           ST->getName().startswith("struct.ObjTypeMap"))
         continue;
 
@@ -395,6 +447,10 @@ namespace llvm {
 
       typeInfoArrayInt.push_back(AllTypeInfo[i].DetailInfo.TypeHashValue);
 
+      // type id, assigned by the runtime
+      typeInfoArray.push_back(ConstantInt::get(Int64Ty, 0));
+      typeInfoArrayInt.push_back(0);
+
       std::set<uint64_t> TmpSet;
       for (unsigned long j=0;j<AllTypeInfo[i].AllParents.size();j++)
         TmpSet.insert(AllTypeInfo[i].AllParents[j].TypeHashValue);
@@ -646,42 +702,137 @@ namespace llvm {
     }
   }
 
-  GlobalVariable *HexTypeLLVMUtil::getVerifyResultCache(Module &M) {
-    llvm::SmallString<32> ResultCacheTyName("struct.VerifyResultCache");
-    llvm::Type *FieldTypes[] = {
-      Int64Ty,
-      Int64Ty,
-      Int8Ty };
-    llvm::StructType *ResultCacheTy =
-      llvm::StructType::create(M.getContext(),
-                               FieldTypes, ResultCacheTyName);
-    PointerType* ResultCacheTyP = PointerType::get(ResultCacheTy, 0);
+  // The runtime's per-thread cache; initial-exec TLS, so an access is a
+  // single %fs-relative load.
+  GlobalVariable *HexTypeLLVMUtil::getLocalResultCache(Module &M) {
     GlobalVariable* ResultCache =
-      M.getGlobalVariable("VerifyResultCache", true);
+      M.getGlobalVariable("LocalResultCache", true);
 
     if (!ResultCache) {
+      llvm::SmallString<32> ResultCacheTyName("struct.LocalResultCache");
+      llvm::Type *FieldTypes[] = {
+        Int64Ty,
+        Int32Ty,
+        Int32Ty };
+      llvm::StructType *ResultCacheTy =
+        llvm::StructType::create(M.getContext(),
+                                 FieldTypes, ResultCacheTyName);
+      ArrayType *ResultCacheArrayTy =
+        ArrayType::get(ResultCacheTy, NUMLOCALCACHE);
       ResultCache =
         new GlobalVariable(M,
-                           ResultCacheTyP,
+                           ResultCacheArrayTy,
                            false,
                            GlobalValue::ExternalLinkage,
                            0,
-                           "VerifyResultCache");
-      ResultCache->setAlignment(8);
+                           "LocalResultCache",
+                           nullptr,
+                           GlobalVariable::InitialExecTLSModel);
     }
 
     return ResultCache;
   }
 
+  // Same lookup as lookupLocalCache() in the runtime. Returns an i1 hit
+  // flag; CacheSet (i64, the set number the runtime indexes the thread
+  // cache with) and CachedResult (i32) are set too.
+  Value *HexTypeLLVMUtil::emitLocalCacheLookup(Module &M,
+                                               IRBuilder<> &Builder,
+                                               Value *SrcTypeId,
+                                               uint64_t DstHash,
+                                               Value *&CacheSet,
+                                               Value *&CachedResult) {
+    GlobalVariable *ResultCache = getLocalResultCache(M);
+    Value *DstValue = ConstantInt::get(Int64Ty, DstHash);
+    Value *Mixed =
+      Builder.CreateMul(
+        Builder.CreateXor(Builder.CreateZExt(SrcTypeId, Int64Ty), DstValue),
+        ConstantInt::get(Int64Ty, CACHESETMIX));
+    CacheSet = Builder.CreateLShr(Mixed, 64 - CACHESETSHIFT);
+    Value *LocalIndex =
+      Builder.CreateAnd(CacheSet, ConstantInt::get(Int64Ty, NUMLOCALCACHE - 1));
+
+    Value *Entry =
+      Builder.CreateGEP(ResultCache, {ConstantInt::get(Int32Ty, 0),
+                                      LocalIndex});
+    Value *EntryDst = Builder.CreateLoad(
+      Builder.CreateGEP(Entry, {ConstantInt::get(Int32Ty, 0),
+                                ConstantInt::get(Int32Ty, 0)}));
+    Value *EntrySrc = Builder.CreateLoad(
+      Builder.CreateGEP(Entry, {ConstantInt::get(Int32Ty, 0),
+                                ConstantInt::get(Int32Ty, 1)}));
+    CachedResult = Builder.CreateLoad(
+      Builder.CreateGEP(Entry, {ConstantInt::get(Int32Ty, 0),
+                                ConstantInt::get(Int32Ty, 2)}));
+    return Builder.CreateAnd(Builder.CreateICmpEQ(EntryDst, DstValue),
+                             Builder.CreateICmpEQ(EntrySrc, SrcTypeId));
+  }
+
+  // Source type ids already verified for the destination of one cast
+  // site, newest first. Ids are 24 bits, so the all-ones initial value
+  // never matches; only safe results are stored, and stay safe.
+  GlobalVariable *HexTypeLLVMUtil::createSiteCache(Module &M) {
+    ArrayType *SiteCacheTy = ArrayType::get(Int32Ty, NUMSITEWAYS);
+    GlobalVariable *SiteCache =
+      new GlobalVariable(M,
+                         SiteCacheTy,
+                         false,
+                         GlobalValue::InternalLinkage,
+                         Constant::getAllOnesValue(SiteCacheTy),
+                         "__hextype_site_cache");
+    SiteCache->setAlignment(8);
+    return SiteCache;
+  }
+
+  Value *HexTypeLLVMUtil::emitSiteCacheLookup(IRBuilder<> &Builder,
+                                              GlobalVariable *SiteCache,
+                                              Value *SrcTypeId) {
+    Value *Hit = ConstantInt::getFalse(SiteCache->getContext());
+    for (int i = 0; i < NUMSITEWAYS; i++) {
+      LoadInst *WayId = Builder.CreateLoad(
+        Builder.CreateConstGEP2_32(nullptr, SiteCache, 0, i));
+      WayId->setAtomic(AtomicOrdering::Monotonic);
+      WayId->setAlignment(4);
+      Hit = Builder.CreateOr(Hit, Builder.CreateICmpEQ(WayId, SrcTypeId));
+    }
+    return Hit;
+  }
+
+  // Called with the result of a lookup that missed the site cache; a safe
+  // result pushes SrcTypeId in front and drops the oldest id. Racing
+  // updates may lose an id but never store an unverified one.
+  void HexTypeLLVMUtil::emitSiteCacheUpdate(IRBuilder<> &Builder,
+                                            GlobalVariable *SiteCache,
+                                            Value *SrcTypeId,
+                                            Value *VerifyResult) {
+    Value *isSafe =
+      Builder.CreateICmpUGE(VerifyResult,
+                            ConstantInt::get(Int32Ty, SAFECASTSAME));
+    TerminatorInst *UpdateTerm =
+      SplitBlockAndInsertIfThen(isSafe, &*Builder.GetInsertPoint(), false);
+    IRBuilder<> UpdateBuilder(UpdateTerm);
+    for (int i = NUMSITEWAYS - 1; i >= 0; i--) {
+      Value *WayId = SrcTypeId;
+      if (i > 0) {
+        LoadInst *PrevId = UpdateBuilder.CreateLoad(
+          UpdateBuilder.CreateConstGEP2_32(nullptr, SiteCache, 0, i - 1));
+        PrevId->setAtomic(AtomicOrdering::Monotonic);
+        PrevId->setAlignment(4);
+        WayId = PrevId;
+      }
+      StoreInst *Store = UpdateBuilder.CreateStore(
+        WayId, UpdateBuilder.CreateConstGEP2_32(nullptr, SiteCache, 0, i));
+      Store->setAtomic(AtomicOrdering::Monotonic);
+      Store->setAlignment(4);
+    }
+  }
+
   GlobalVariable *HexTypeLLVMUtil::getObjTypeMap(Module &M) {
     llvm::SmallString<32> ObjTypeMapName("struct.ObjHaspMap");
     llvm::Type *FieldTypesObj[] = {
       IntptrTyN,
-      IntptrTyN,
-      Int64Ty,
       Int32Ty,
-      Int32Ty,
-      IntptrTyN};
+      Int32Ty};
     llvm::StructType *ObjTypeMapTy =
       llvm::StructType::create(M.getContext(),
                                FieldTypesObj, ObjTypeMapName);
@@ -701,6 +852,427 @@ namespace llvm {
     return GObjTypeMap;
   }
 
+  // One type or phantom record, named after its content and put in its
+  // own COMDAT: the linker keeps one copy of each distinct record per
+  // executable or shared library. The id slot of a type record is written
+  // by the runtime, so the records are not constant.
+  GlobalVariable *HexTypeLLVMUtil::emitTypeRecord(Module &M,
+                                                  StringRef Prefix,
+                                                  StringRef Section,
+                                                  std::vector<uint64_t> &Record) {
+    std::string Content;
+    for (uint64_t Word : Record)
+      Content += utostr(Word) + ",";
+    std::string Name = (Prefix + utohexstr(Record[0]) + "." +
+      utohexstr(crc64c((unsigned char *)Content.c_str()))).str();
+    if (GlobalVariable *GV = M.getGlobalVariable(Name, true))
+      return GV;
+
+    std::vector<Constant*> Words;
+    for (uint64_t Word : Record)
+      Words.push_back(ConstantInt::get(Int64Ty, Word));
+    ArrayType *RecordTy = ArrayType::get(Int64Ty, Words.size());
+    GlobalVariable *GV =
+      new GlobalVariable(M, RecordTy, false, GlobalValue::WeakODRLinkage,
+                         ConstantArray::get(RecordTy, Words), Name);
+    GV->setComdat(M.getOrInsertComdat(Name));
+    GV->setVisibility(GlobalValue::HiddenVisibility);
+    GV->setSection(Section);
+    GV->setAlignment(8);
+    return GV;
+  }
+
+  // -type-section-opt: the type info of the module as records in the
+  // hextype_rules and hextype_phantoms sections instead of module arrays.
+  // The runtime reads the merged sections as a whole.
+  void HexTypeLLVMUtil::emitTypeInfoRecords(Module &M) {
+    uint64_t pos = 1;
+    for (uint64_t i = 0; i < typeInfoArrayInt.at(0); i++) {
+      uint64_t RuleSize = typeInfoArrayInt.at(pos + 2);
+      std::vector<uint64_t> Record(typeInfoArrayInt.begin() + pos,
+                                   typeInfoArrayInt.begin() + pos + 3 +
+                                   RuleSize);
+      TypeRecords[Record[0]] =
+        emitTypeRecord(M, "__hextype_rule.", "hextype_rules", Record);
+      pos += RuleSize + 3;
+    }
+
+    std::vector<uint64_t> PhantomInfo;
+    for (Constant *Word : typePhantomInfoArray)
+      PhantomInfo.push_back(cast<ConstantInt>(Word)->getZExtValue());
+    pos = 1;
+    for (uint64_t i = 0; i < PhantomInfo.at(0); i++) {
+      uint64_t PhantomNum = PhantomInfo.at(pos + 1);
+      std::vector<uint64_t> Record(PhantomInfo.begin() + pos,
+                                   PhantomInfo.begin() + pos + 2 +
+                                   PhantomNum);
+      emitTypeRecord(M, "__hextype_phantom.", "hextype_phantoms", Record);
+      pos += PhantomNum + 2;
+    }
+  }
+
+  // Bounds of a type record section in the object being linked. They are
+  // weak, as a program may have no phantom records at all.
+  Constant *HexTypeLLVMUtil::getSectionBound(Module &M, StringRef Name) {
+    GlobalVariable *Bound = M.getGlobalVariable(Name, true);
+    if (!Bound) {
+      Bound = new GlobalVariable(M, Int64Ty, false,
+                                 GlobalValue::ExternalWeakLinkage,
+                                 nullptr, Name);
+      Bound->setVisibility(GlobalValue::HiddenVisibility);
+    }
+    return Bound;
+  }
+
+  // Address of the rules (n, parents...) of a type, preceded by its id slot
+  Constant *HexTypeLLVMUtil::getRuleAddr(uint64_t TypeHashValue) {
+    // types of placement new and reinterpret_cast may have no rules
+    if (ClTypeSectionOpt) {
+      auto it = TypeRecords.find(TypeHashValue);
+      if (it == TypeRecords.end())
+        return ConstantPointerNull::get(cast<PointerType>(Int64PtrTy));
+      GlobalVariable *Record = it->second;
+      Constant *Idx[2] = {ConstantInt::get(Int64Ty, 0),
+        ConstantInt::get(Int64Ty, 2)};
+      return ConstantExpr::getInBoundsGetElementPtr(Record->getValueType(),
+                                                    Record, Idx);
+    }
+    uint64_t RuleIndex = getRuleIndex(TypeHashValue);
+    if (RuleIndex == 0)
+      return ConstantPointerNull::get(cast<PointerType>(Int64PtrTy));
+    Constant *Idx[2] = {ConstantInt::get(Int64Ty, 0),
+      ConstantInt::get(Int64Ty, RuleIndex)};
+    return ConstantExpr::getInBoundsGetElementPtr(
+      typeInfoArrayGlobal->getValueType(), typeInfoArrayGlobal, Idx);
+  }
+
+  // Hands the type info array of this module to the runtime, which assigns
+  // the type ids and builds cast rules from it. With -type-section-opt it
+  // gets the bounds of the record sections instead.
+  void HexTypeLLVMUtil::emitTypeInfoUpdate(Module &M, IRBuilder<> &Builder) {
+    if (ClTypeSectionOpt) {
+      Constant *UpdateTypeSection =
+        M.getOrInsertFunction("__update_type_section", VoidTy, Int64PtrTy,
+                              Int64PtrTy, Int64PtrTy, Int64PtrTy, nullptr);
+      Builder.CreateCall(UpdateTypeSection,
+                         {getSectionBound(M, "__start_hextype_rules"),
+                         getSectionBound(M, "__stop_hextype_rules"),
+                         getSectionBound(M, "__start_hextype_phantoms"),
+                         getSectionBound(M, "__stop_hextype_phantoms")});
+      return;
+    }
+    Constant *UpdateTypeInfo =
+      M.getOrInsertFunction("__update_type_info", VoidTy, Int64PtrTy,
+                            nullptr);
+    Builder.CreateCall(UpdateTypeInfo,
+                       Builder.CreatePointerCast(typeInfoArrayGlobal,
+                                                 Int64PtrTy));
+  }
+
+  // ObjTypeMapLock mirrors MapSlotLock in the runtime: one sequence counter
+  // per 64-byte line. Writers make it odd while they modify a slot.
+  GlobalVariable *HexTypeLLVMUtil::getObjTypeMapLock(Module &M) {
+    GlobalVariable* GObjTypeMapLock =
+      M.getGlobalVariable("ObjTypeMapLock", true);
+    if (!GObjTypeMapLock) {
+      llvm::Type *FieldTypesLock[] = {
+        Int32Ty,
+        ArrayType::get(Int8Ty, 60)};
+      llvm::StructType *MapSlotLockTy =
+        llvm::StructType::create(M.getContext(),
+                                 FieldTypesLock, "struct.MapSlotLock");
+      ArrayType *ObjTypeMapLockTy = ArrayType::get(MapSlotLockTy, NUMMAPLOCK);
+      GObjTypeMapLock =
+        new GlobalVariable(M,
+                           ObjTypeMapLockTy,
+                           false,
+                           GlobalValue::ExternalLinkage,
+                           0,
+                           "ObjTypeMapLock");
+      GObjTypeMapLock->setAlignment(64);
+    }
+
+    return GObjTypeMapLock;
+  }
+
+  // The runtime sizes ObjTypeMap at startup (HEXTYPE_MAP_BITS) and
+  // exports the index mask.
+  GlobalVariable *HexTypeLLVMUtil::getObjTypeMapMask(Module &M) {
+    GlobalVariable* GObjTypeMapMask =
+      M.getGlobalVariable("ObjTypeMapMask", true);
+    if (!GObjTypeMapMask) {
+      GObjTypeMapMask =
+        new GlobalVariable(M,
+                           IntptrTyN,
+                           false,
+                           GlobalValue::ExternalLinkage,
+                           0,
+                           "ObjTypeMapMask");
+      GObjTypeMapMask->setAlignment(8);
+    }
+
+    return GObjTypeMapMask;
+  }
+
+  // Per-bucket counts of entries stored outside their home bucket, one
+  // 32-bit MapBucketInfo per bucket of MAPWAYS slots.
+  GlobalVariable *HexTypeLLVMUtil::getObjTypeMapInfo(Module &M) {
+    GlobalVariable* GObjTypeMapInfo =
+      M.getGlobalVariable("ObjTypeMapInfo", true);
+    if (!GObjTypeMapInfo) {
+      GObjTypeMapInfo =
+        new GlobalVariable(M,
+                           PointerType::get(Int32Ty, 0),
+                           false,
+                           GlobalValue::ExternalLinkage,
+                           0,
+                           "ObjTypeMapInfo");
+      GObjTypeMapInfo->setAlignment(8);
+    }
+
+    return GObjTypeMapInfo;
+  }
+
+  // Same as getHash() in the runtime.
+  Value *HexTypeLLVMUtil::emitMapIndex(Module &M, IRBuilder<> &Builder,
+                                       Value *Addr) {
+    Value *ShVal = Builder.CreateLShr(Addr, 3);
+    Value *Region = Builder.CreateLShr(Addr, MAPREGIONSHIFT);
+    Value *RegionMix =
+      Builder.CreateMul(Region, ConstantInt::get(IntptrTyN, MAPREGIONMIX));
+    LoadInst *MapMask = Builder.CreateLoad(getObjTypeMapMask(M));
+    MapMask->setAlignment(8);
+    return Builder.CreateAnd(Builder.CreateAdd(ShVal, RegionMix), MapMask);
+  }
+
+  // Address of slot MapIndex of ObjTypeMap. With -fixed-shadow-opt the map
+  // base is an immediate instead of a load of ObjTypeMap.
+  Value *HexTypeLLVMUtil::emitMapSlotAddr(Module &M, IRBuilder<> &Builder,
+                                          Value *MapIndex) {
+    GlobalVariable *GObjTypeMap = getObjTypeMap(M);
+    Value *MapBase;
+    if (ClFixedShadowOpt && OBJTYPEMAPBASE != 0)
+      MapBase = ConstantExpr::getIntToPtr(
+        ConstantInt::get(IntptrTyN, OBJTYPEMAPBASE),
+        GObjTypeMap->getValueType());
+    else
+      MapBase = Builder.CreateLoad(GObjTypeMap);
+    return Builder.CreateGEP(MapBase, MapIndex, "");
+  }
+
+  // An i1 that is true if Addr cannot be stored outside of slot MapIndex:
+  // no way of its bucket holds it and no entry of the bucket was displaced
+  // to another bucket or spilled, as removeSlot in the runtime searches.
+  // Callers hold the slot lock.
+  Value *HexTypeLLVMUtil::emitNoOtherCopy(Module &M, IRBuilder<> &Builder,
+                                          Value *MapIndex, Value *Addr) {
+    Value *Bucket =
+      Builder.CreateAnd(MapIndex,
+                        ConstantInt::get(IntptrTyN, ~(uint64_t)0 <<
+                                         MAPWAYSSHIFT));
+    Value *NoCopy = nullptr;
+    for (unsigned i = 0; i < (1U << MAPWAYSSHIFT); i++) {
+      Value *Way = emitMapSlotAddr(
+        M, Builder, Builder.CreateAdd(Bucket, ConstantInt::get(IntptrTyN, i)));
+      Value *WayAddr = Builder.CreateLoad(
+        Builder.CreateGEP(Way, {ConstantInt::get(Int32Ty, 0),
+                          ConstantInt::get(Int32Ty, 0)}, ""));
+      Value *Differs = Builder.CreateICmpNE(WayAddr, Addr);
+      NoCopy = NoCopy ? Builder.CreateAnd(NoCopy, Differs) : Differs;
+    }
+    Value *InfoAddr =
+      Builder.CreateGEP(Builder.CreateLoad(getObjTypeMapInfo(M)),
+                        Builder.CreateLShr(MapIndex, MAPWAYSSHIFT));
+    Value *Info = Builder.CreateLoad(InfoAddr);
+    return Builder.CreateAnd(NoCopy, Builder.CreateIsNull(Info));
+  }
+
+  // One lock covers a probe group of MAPGROUP slots.
+  Value *HexTypeLLVMUtil::getSlotLockAddr(Module &M, IRBuilder<> &Builder,
+                                          Value *MapIndex) {
+    Value *Stripe =
+      Builder.CreateAnd(Builder.CreateLShr(MapIndex, MAPGROUPSHIFT),
+                        ConstantInt::get(IntptrTyN, NUMMAPLOCK - 1));
+    return Builder.CreateGEP(getObjTypeMapLock(M),
+                             {ConstantInt::get(Int32Ty, 0), Stripe,
+                             ConstantInt::get(Int32Ty, 0)}, "");
+  }
+
+  // Try to take the slot lock once. Returns an i1 that is true if the lock
+  // was taken; LockSeq is the even sequence value it was taken at.
+  Value *HexTypeLLVMUtil::emitSlotTryLock(IRBuilder<> &Builder,
+                                          Value *LockAddr, Value *&LockSeq) {
+    LoadInst *CurSeq = Builder.CreateLoad(LockAddr);
+    CurSeq->setAtomic(AtomicOrdering::Monotonic);
+    CurSeq->setAlignment(4);
+    LockSeq = Builder.CreateAnd(CurSeq, ConstantInt::get(Int32Ty, -2));
+    Value *LockedSeq = Builder.CreateAdd(LockSeq, ConstantInt::get(Int32Ty, 1));
+    Value *Pair = Builder.CreateAtomicCmpXchg(LockAddr, LockSeq, LockedSeq,
+                                              AtomicOrdering::Acquire,
+                                              AtomicOrdering::Monotonic);
+    return Builder.CreateExtractValue(Pair, 1);
+  }
+
+  void HexTypeLLVMUtil::emitSlotUnlock(IRBuilder<> &Builder, Value *LockAddr,
+                                       Value *LockSeq) {
+    StoreInst *Unlock =
+      Builder.CreateStore(Builder.CreateAdd(LockSeq,
+                                            ConstantInt::get(Int32Ty, 2)),
+                          LockAddr);
+    Unlock->setAtomic(AtomicOrdering::Release);
+    Unlock->setAlignment(4);
+  }
+
+  // Index of the rules of a type in typeInfoArrayGlobal, [N, (hash, id, n,
+  // parents...)*]; RuleAddr points at its n. 0 if the type is not there.
+  uint64_t HexTypeLLVMUtil::getRuleIndex(uint64_t TypeHashValue) {
+    uint64_t pos = 1;
+    for (uint64_t i = 0 ; i < typeInfoArrayInt.at(0); i++) {
+      uint64_t TypeHash = typeInfoArrayInt.at(pos);
+      pos += 2;
+      if (TypeHash == TypeHashValue)
+        return pos;
+      uint64_t interSize = typeInfoArrayInt.at(pos);
+      pos += (interSize + 1);
+    }
+    return 0;
+  }
+
+  StructType *HexTypeLLVMUtil::getFrameDescEntryTy() {
+    return StructType::get(Int32Ty, Int32Ty, Int32Ty, Int32Ty, Int64Ty,
+                           Int64PtrTy, nullptr);
+  }
+
+  // Append the frame descriptor entries of Count objects of type ObjTy
+  // placed FrameOffset bytes into a frame, one entry per traced subobject:
+  // (frame offset, offset in the object, count, stride, type hash, rules).
+  // Returns the number of traced objects.
+  uint32_t HexTypeLLVMUtil::getFrameDescEntries(Type *ObjTy,
+                                                uint32_t FrameOffset,
+                                                uint32_t Count,
+                                                std::vector<Constant*> &Entries) {
+    StructElementInfoTy Elements;
+    getArrayOffsets(ObjTy, Elements, 0);
+    if (ClCastObjOpt)
+      removeNonCastingRelatedObj(Elements);
+
+    uint32_t Stride = DL.getTypeAllocSize(ObjTy);
+    for (auto &entry : Elements) {
+      uint64_t TypeHashValue = getHashValueFromSTy(entry.second);
+      Constant *RuleAddr = getRuleAddr(TypeHashValue);
+      Constant *Fields[6] = {
+        ConstantInt::get(Int32Ty, FrameOffset + entry.first),
+        ConstantInt::get(Int32Ty, entry.first),
+        ConstantInt::get(Int32Ty, Count),
+        ConstantInt::get(Int32Ty, Stride),
+        ConstantInt::get(Int64Ty, TypeHashValue),
+        RuleAddr};
+      Entries.push_back(ConstantStruct::get(getFrameDescEntryTy(), Fields));
+    }
+    return Elements.size() * Count;
+  }
+
+  // FrameDesc of the runtime: frame size, number of entries and of
+  // objects, then the entries.
+  GlobalVariable *HexTypeLLVMUtil::emitFrameDesc(Module &M, Function *F,
+                                                 uint64_t FrameSize,
+                                                 uint32_t NumObj,
+                                                 std::vector<Constant*> &Entries) {
+    ArrayType *EntryArrayTy =
+      ArrayType::get(getFrameDescEntryTy(), Entries.size());
+    StructType *DescTy =
+      StructType::get(Int64Ty, Int32Ty, Int32Ty, EntryArrayTy, nullptr);
+    Constant *Fields[4] = {
+      ConstantInt::get(Int64Ty, FrameSize),
+      ConstantInt::get(Int32Ty, Entries.size()),
+      ConstantInt::get(Int32Ty, NumObj),
+      ConstantArray::get(EntryArrayTy, Entries)};
+    return new GlobalVariable(M, DescTy, true,
+                              GlobalVariable::PrivateLinkage,
+                              ConstantStruct::get(DescTy, Fields),
+                              "__hextype_frame_desc." + F->getName());
+  }
+
+  StructType *HexTypeLLVMUtil::getGlobalObjDescTy() {
+    return StructType::get(Int64PtrTy, Int64Ty, Int32Ty, Int32Ty, Int64Ty,
+                           Int64PtrTy, nullptr);
+  }
+
+  // Append the global object table entries of GV, Count objects of type
+  // ObjTy, one entry per traced subobject: (address, count, stride,
+  // offset in the object, type hash, rules). Returns the number of
+  // entries added.
+  uint32_t HexTypeLLVMUtil::getGlobalObjDescEntries(GlobalVariable *GV,
+                                                    Type *ObjTy,
+                                                    uint64_t Count,
+                                                    std::vector<Constant*> &Entries) {
+    StructElementInfoTy Elements;
+    getArrayOffsets(ObjTy, Elements, 0);
+    if (ClCastObjOpt)
+      removeNonCastingRelatedObj(Elements);
+
+    uint32_t Stride = DL.getTypeAllocSize(ObjTy);
+    Constant *GVAddr = ConstantExpr::getBitCast(GV, Int8PtrTy);
+    for (auto &entry : Elements) {
+      uint64_t TypeHashValue = getHashValueFromSTy(entry.second);
+      Constant *RuleAddr = getRuleAddr(TypeHashValue);
+      Constant *ObjAddr =
+        ConstantExpr::getInBoundsGetElementPtr(
+          Int8Ty, GVAddr, ConstantInt::get(Int64Ty, entry.first));
+      Constant *Fields[6] = {
+        ConstantExpr::getBitCast(ObjAddr, Int64PtrTy),
+        ConstantInt::get(Int64Ty, Count),
+        ConstantInt::get(Int32Ty, Stride),
+        ConstantInt::get(Int32Ty, entry.first),
+        ConstantInt::get(Int64Ty, TypeHashValue),
+        RuleAddr};
+      Entries.push_back(ConstantStruct::get(getGlobalObjDescTy(), Fields));
+    }
+    return Elements.size();
+  }
+
+  // One read-only table for all global objects of the module, handed to
+  // the runtime with a single __update_global_table call.
+  void HexTypeLLVMUtil::emitGlobalObjTable(Module &M, IRBuilder<> &Builder,
+                                           std::vector<Constant*> &Entries) {
+    ArrayType *TableTy = ArrayType::get(getGlobalObjDescTy(), Entries.size());
+    GlobalVariable *Table =
+      new GlobalVariable(M, TableTy, true, GlobalVariable::PrivateLinkage,
+                         ConstantArray::get(TableTy, Entries),
+                         "__hextype_global_table");
+    Constant *UpdateGlobalTable =
+      M.getOrInsertFunction("__update_global_table", VoidTy, Int8PtrTy,
+                            Int64Ty, nullptr);
+    Builder.CreateCall(UpdateGlobalTable,
+                       {Builder.CreatePointerCast(Table, Int8PtrTy),
+                       ConstantInt::get(Int64Ty, Entries.size())});
+  }
+
+  // Frame address and generation of the current call of F, taken once on
+  // entry and shared by all lazy traces of F. A stack save at each trace
+  // point would give a later call at the same address the generation of
+  // an earlier one, and move with the VLA scopes of F.
+  std::pair<Value *, Value *> HexTypeLLVMUtil::getFrameToken(Module *SrcM,
+                                                             Function *F) {
+    auto it = FrameTokens.find(F);
+    if (it != FrameTokens.end())
+      return it->second;
+
+    IRBuilder<> EntryBuilder(&*F->getEntryBlock().getFirstInsertionPt());
+    Function *FrameAddress =
+      Intrinsic::getDeclaration(SrcM, Intrinsic::frameaddress);
+    Value *FrameAddr = EntryBuilder.CreatePtrToInt(
+      EntryBuilder.CreateCall(FrameAddress, ConstantInt::get(Int32Ty, 0)),
+      IntptrTyN);
+    Function *EnterFn =
+      (Function*)SrcM->getOrInsertFunction("__enter_stack_frame", Int32Ty,
+                                           IntptrTyN, nullptr);
+    Value *Gen = EntryBuilder.CreateCall(EnterFn, FrameAddr);
+    std::pair<Value *, Value *> Token(FrameAddr, Gen);
+    FrameTokens.insert(std::make_pair(F, Token));
+    return Token;
+  }
+
   void HexTypeLLVMUtil::emitInstForObjTrace(Module *SrcM, IRBuilder<> &Builder,
                                             StructElementInfoTy &Elements,
                                             uint32_t EmitType,
@@ -725,6 +1297,19 @@ namespace llvm {
     Value *TypeSize = ConstantInt::get(Int32Ty, TypeSizeInt);
     ConstantInt *constantTypeSize = dyn_cast<ConstantInt>(TypeSize);
 
+    // Stack objects tracked per thread never go to ObjTypeMap directly.
+    // Without removal, they are tied to the call of their function.
+    bool StackLocal = (ClStackLocalOpt || ClStackLazyOpt) &&
+      AllocType == STACKALLOC;
+    bool StackLazy = StackLocal && ClStackLazyOpt && EmitType == CONOBJADD;
+    // A placement new may reuse a traced local, so it goes through the
+    // runtime, which replaces the entry in the thread's table
+    bool StackPlaced = (ClStackLocalOpt || ClStackLazyOpt) &&
+      AllocType == PLACEMENTNEW;
+    std::pair<Value *, Value *> FrameToken;
+    if (StackLazy)
+      FrameToken = getFrameToken(SrcM, Builder.GetInsertBlock()->getParent());
+
     bool isFristEntry = true;
     for (auto &entry : Elements) {
       uint32_t OffsetInt;
@@ -747,18 +1332,11 @@ namespace llvm {
       Value *TypeHashValue = ConstantInt::get(Int64Ty, TypeHashValueInt);
       Value *AllocTypeV = ConstantInt::get(Int32Ty, AllocType);
       Value *RuleAddr = nullptr;
+      bool HasRules = false;
       if (EmitType != CONOBJDEL && EmitType != VLAOBJDEL) {
-        uint64_t pos = 1;
-        for (uint64_t i = 0 ; i < typeInfoArrayInt.at(0); i++) {
-          if (typeInfoArrayInt.at(pos++) == TypeHashValueInt)
-            break;
-          uint64_t interSize = typeInfoArrayInt.at(pos);
-          pos += (interSize + 1);
-        }
-        Value *first = ConstantInt::get(IntptrTyN, (pos * sizeof(uint64_t)));
-        Value *second = Builder.CreatePtrToInt(typeInfoArrayGlobal, IntptrTyN);
-        RuleAddr = Builder.CreateIntToPtr(Builder.CreateAdd(first, second),
-                                          IntptrTyN);
+        Constant *Rules = getRuleAddr(TypeHashValueInt);
+        HasRules = !Rules->isNullValue();
+        RuleAddr = Builder.CreatePtrToInt(Rules, IntptrTyN);
       }
 
       // apply Inline optimization
@@ -767,21 +1345,31 @@ namespace llvm {
       Value *TargetIndexAddr;
       Value *TargetIndexAddrValue;
       Value *mapIndex64;
+      Value *LockAddr, *LockSeq;
+      Instruction *LockInsertPt;
+      TerminatorInst *LockedTerm, *BusyTerm;
 
-      static GlobalVariable* GObjTypeMap;
-      if (ClInlineOpt && (EmitType == CONOBJADD || EmitType == CONOBJDEL) &&
-          (AllocType != REINTERPRET && AllocType != GLOBALALLOC)) {
-        GObjTypeMap = getObjTypeMap(*SrcM);
+      // The inline store reads the type id slot before the rules, so a
+      // type without rules (e.g. of a placement new) goes to the runtime
+      bool InlineTrace = ClInlineOpt && !StackLocal && !StackPlaced &&
+        AllocType != REINTERPRET && AllocType != GLOBALALLOC &&
+        (EmitType != CONOBJADD || HasRules);
 
+      if (InlineTrace && (EmitType == CONOBJADD || EmitType == CONOBJDEL)) {
         // create hashmap index
-        Value *ShVal = Builder.CreateLShr(NewAddr, 3);
-        Value *mapSize = ConstantInt::get(IntptrTyN, 268435455);
-        mapIndex = Builder.CreateAnd(ShVal, mapSize);
+        mapIndex = emitMapIndex(*SrcM, Builder, NewAddr);
         mapIndex64 = Builder.CreatePtrToInt(mapIndex, Int64Ty);
 
         // get value from the ObjTypeMap table using index
-        Value* ObjTypeMapInit = Builder.CreateLoad(GObjTypeMap);
-        TargetIndexAddr = Builder.CreateGEP(ObjTypeMapInit, mapIndex, "");
+        TargetIndexAddr = emitMapSlotAddr(*SrcM, Builder, mapIndex);
+
+        // Take the slot lock; if it is busy, let the runtime wait for it
+        LockAddr = getSlotLockAddr(*SrcM, Builder, mapIndex);
+        Value *isLocked = emitSlotTryLock(Builder, LockAddr, LockSeq);
+        LockInsertPt = &*Builder.GetInsertPoint();
+        SplitBlockAndInsertIfThenElse(isLocked, LockInsertPt, &LockedTerm,
+                                      &BusyTerm, nullptr);
+        Builder.SetInsertPoint(LockedTerm);
 
         // Load index
         Value* TargetIndexAddrValueAddr =
@@ -795,11 +1383,23 @@ namespace llvm {
       switch (EmitType) {
       case CONOBJADD :
         {
-          if (ClInlineOpt &&
-              AllocType != REINTERPRET &&
-              AllocType != GLOBALALLOC) {
-            isNull = Builder.CreateIsNull(TargetIndexAddrValue);
-            llvm::Value *isNullandEqual = Builder.CreateOr(isNull, isEqual);
+          if (InlineTrace) {
+            // The type id is cached right before RuleAddr once the runtime
+            // has seen the type; until then let the runtime assign it.
+            Value *TypeIdAddr =
+              Builder.CreateIntToPtr(
+                Builder.CreateSub(RuleAddr, ConstantInt::get(IntptrTyN, 8)),
+                Int64PtrTy);
+            Value *TypeId =
+              Builder.CreateTrunc(Builder.CreateLoad(TypeIdAddr), Int32Ty);
+            Value *hasTypeId = Builder.CreateIsNotNull(TypeId);
+            // An empty home slot is only taken here if no older copy of
+            // the object is left elsewhere; otherwise the runtime drops it.
+            isNull = Builder.CreateAnd(
+              Builder.CreateIsNull(TargetIndexAddrValue),
+              emitNoOtherCopy(*SrcM, Builder, mapIndex, ObjAddrT));
+            llvm::Value *isNullandEqual =
+              Builder.CreateAnd(Builder.CreateOr(isNull, isEqual), hasTypeId);
             Instruction *InsertPt = &*Builder.GetInsertPoint();
             TerminatorInst *ThenTerm, *ElseTerm;
             SplitBlockAndInsertIfThenElse(isNullandEqual,
@@ -811,20 +1411,19 @@ namespace llvm {
               Builder.CreateGEP(TargetIndexAddr, {ConstantInt::get(Int32Ty, 0),
                                 ConstantInt::get(Int32Ty, 0)}, "");
             Builder.CreateStore(ObjAddrT, TargetIndexAddrValueAddrT);
+            // TypeId with HeapArraySize 0 (a single object)
             TargetIndexAddrValueAddrT =
               Builder.CreateGEP(TargetIndexAddr, {ConstantInt::get(Int32Ty, 0),
                                 ConstantInt::get(Int32Ty, 1)}, "");
-            Builder.CreateStore(RuleAddr, TargetIndexAddrValueAddrT);
+            Builder.CreateStore(TypeId, TargetIndexAddrValueAddrT);
             TargetIndexAddrValueAddrT =
               Builder.CreateGEP(TargetIndexAddr, {ConstantInt::get(Int32Ty, 0),
                                 ConstantInt::get(Int32Ty, 2)}, "");
-            Builder.CreateStore(TypeHashValue, TargetIndexAddrValueAddrT);
-            TargetIndexAddrValueAddrT =
-              Builder.CreateGEP(TargetIndexAddr, {ConstantInt::get(Int32Ty, 0),
-                                ConstantInt::get(Int32Ty, 4)}, "");
             Builder.CreateStore(OffsetV, TargetIndexAddrValueAddrT);
+            emitSlotUnlock(Builder, LockAddr, LockSeq);
 
             Builder.SetInsertPoint(ElseTerm);
+            emitSlotUnlock(Builder, LockAddr, LockSeq);
             Function *initFunction =
               (Function*)SrcM->getOrInsertFunction(
                 "__update_direct_oinfo_inline", VoidTy,
@@ -832,12 +1431,34 @@ namespace llvm {
             Value *Param[5] = {ObjAddrT, TypeHashValue, OffsetV,
               RuleAddr, mapIndex64};
             Builder.CreateCall(initFunction, Param);
-            Builder.SetInsertPoint(InsertPt);
+
+            // if the slot lock was busy
+            Builder.SetInsertPoint(BusyTerm);
+            initFunction =
+              (Function*)SrcM->getOrInsertFunction(
+                "__update_direct_oinfo", VoidTy,
+                IntptrTyN, Int64Ty, Int32Ty, IntptrTyN, nullptr);
+            Value *ParamBusy[4] = {ObjAddrT, TypeHashValue, OffsetV, RuleAddr};
+            Builder.CreateCall(initFunction, ParamBusy);
+            Builder.SetInsertPoint(LockInsertPt);
+          }
+          else if (StackLazy) {
+            Value *Param[6] = {ObjAddrT, TypeHashValue, OffsetV, RuleAddr,
+              FrameToken.first, FrameToken.second};
+            Function *initFunction =
+              (Function*)SrcM->getOrInsertFunction(
+                "__update_stack_oinfo_lazy", VoidTy, IntptrTyN, Int64Ty,
+                Int32Ty, IntptrTyN, IntptrTyN, Int32Ty, nullptr);
+            Builder.CreateCall(initFunction, Param);
           }
           else {
             char TargetFn[MAXLEN];
             if (AllocType == REINTERPRET)
-              strcpy(TargetFn, "__handle_reinterpret_cast");
+              strcpy(TargetFn, (ClStackLocalOpt || ClStackLazyOpt) ?
+                     "__handle_stack_reinterpret_cast" :
+                     "__handle_reinterpret_cast");
+            else if (StackLocal || StackPlaced)
+              strcpy(TargetFn, "__update_stack_oinfo");
             else
               strcpy(TargetFn, "__update_direct_oinfo");
 
@@ -900,7 +1521,7 @@ namespace llvm {
         }
       case CONOBJDEL:
         {
-         if (ClInlineOpt) {
+         if (InlineTrace) {
             // Insert if/else statement
             Instruction *InsertPt = &*Builder.GetInsertPoint();
             TerminatorInst *ThenTerm, *ElseTerm;
@@ -914,21 +1535,32 @@ namespace llvm {
                                 ConstantInt::get(Int32Ty, 0)}, "");
             Builder.CreateStore(Constant::getNullValue(IntptrTyN),
                                 TargetIndexAddrValueAddrT);
+            emitSlotUnlock(Builder, LockAddr, LockSeq);
             // if ObjTypeMap[index].addr is not equal, try to remove from RBTree
             Builder.SetInsertPoint(ElseTerm);
+            emitSlotUnlock(Builder, LockAddr, LockSeq);
             Function *initFunction =
               (Function*)SrcM->getOrInsertFunction(
                 "__remove_direct_oinfo_inline", VoidTy,
                 IntptrTyN, Int64Ty, nullptr);
             Value *Param[2] = {ObjAddrT, mapIndex64};
             Builder.CreateCall(initFunction, Param);
-            Builder.SetInsertPoint(InsertPt);
+
+            // if the slot lock was busy
+            Builder.SetInsertPoint(BusyTerm);
+            initFunction =
+              (Function*)SrcM->getOrInsertFunction(
+                "__remove_direct_oinfo", VoidTy,
+                IntptrTyN, nullptr);
+            Value *ParamBusy[1] = {ObjAddrT};
+            Builder.CreateCall(initFunction, ParamBusy);
+            Builder.SetInsertPoint(LockInsertPt);
           }
           else {
             Function *initFunction =
               (Function*)SrcM->getOrInsertFunction(
-                "__remove_direct_oinfo", VoidTy,
-                IntptrTyN, nullptr);
+                StackLocal ? "__remove_stack_oinfo" : "__remove_direct_oinfo",
+                VoidTy, IntptrTyN, nullptr);
             Value *ParamCONDEL[1] = {ObjAddrT};
             Builder.CreateCall(initFunction, ParamCONDEL);
           }
@@ -17,6 +17,22 @@
 #include <list>
 
 #define MAXNODE 1000000
+#define NUMMAPLOCK 4096
+#ifndef OBJTYPEMAPBASE
+#define OBJTYPEMAPBASE 0x100000000000ULL
+#endif
+#define MAPWAYSSHIFT 2
+#define MAPGROUPSHIFT 4
+#define MAPREGIONSHIFT 31
+#define MAPREGIONMIX 0x9e3779b1UL
+#define CACHESETSHIFT 12
+#define CACHESETMIX 0x9e3779b97f4a7c15ULL
+#define NUMLOCALCACHE 64
+#define NUMSITEWAYS 2
+
+#define BADCAST 0
+#define FAILINFO 1
+#define SAFECASTSAME 2
 
 #define STACKALLOC 1
 #define HEAPALLOC 2
@@ -35,9 +51,19 @@ namespace llvm {
   extern cl::opt<bool> ClStackOpt;
   extern cl::opt<bool> ClCastObjOpt;
   extern cl::opt<bool> ClSafeStackOpt;
+  extern cl::opt<bool> ClStackEscapeOpt;
+  extern cl::opt<bool> ClStackFrameOpt;
+  extern cl::opt<bool> ClStackLocalOpt;
+  extern cl::opt<bool> ClStackLazyOpt;
+  extern cl::opt<bool> ClStackWholeProgramOpt;
+  extern cl::opt<bool> ClGlobalTableOpt;
+  extern cl::opt<bool> ClTypeSectionOpt;
   extern cl::opt<bool> ClCompileTimeVerifyOpt;
   extern cl::opt<bool> ClCreateCastRelatedTypeList;
   extern cl::opt<bool> ClInlineOpt;
+  extern cl::opt<bool> ClFixedShadowOpt;
+  extern cl::opt<bool> ClLoopCastOpt;
+  extern cl::opt<bool> ClRedundantCheckOpt;
   extern cl::opt<bool> ClMakeLogInfo;
   extern cl::opt<bool> ClMakeTypeInfo;
 
@@ -123,9 +149,35 @@ namespace llvm {
     bool isSafeStackAlloca(AllocaInst *);
     void setCastingRelatedSet();
     void extendCastingRelatedTypeSet();
-    GlobalVariable *getVerifyResultCache(Module &);
+    GlobalVariable *getLocalResultCache(Module &);
+    Value *emitLocalCacheLookup(Module &, IRBuilder<> &, Value *, uint64_t,
+                                Value *&, Value *&);
+    GlobalVariable *createSiteCache(Module &);
+    Value *emitSiteCacheLookup(IRBuilder<> &, GlobalVariable *, Value *);
+    void emitSiteCacheUpdate(IRBuilder<> &, GlobalVariable *, Value *,
+                             Value *);
     GlobalVariable *getObjTypeMap(Module &);
+    GlobalVariable *getObjTypeMapLock(Module &);
+    GlobalVariable *getObjTypeMapMask(Module &);
+    GlobalVariable *getObjTypeMapInfo(Module &);
+    void emitTypeInfoUpdate(Module &, IRBuilder<> &);
+    void emitTypeInfoRecords(Module &);
+    Constant *getRuleAddr(uint64_t);
+    Value *emitMapIndex(Module &, IRBuilder<> &, Value *);
+    Value *emitMapSlotAddr(Module &, IRBuilder<> &, Value *);
+    Value *emitNoOtherCopy(Module &, IRBuilder<> &, Value *, Value *);
+    Value *getSlotLockAddr(Module &, IRBuilder<> &, Value *);
+    Value *emitSlotTryLock(IRBuilder<> &, Value *, Value *&);
+    void emitSlotUnlock(IRBuilder<> &, Value *, Value *);
     GlobalVariable *emitAsGlobalVal(Module &, char *, std::vector<Constant*> *);
+    uint32_t getFrameDescEntries(Type *, uint32_t, uint32_t,
+                                 std::vector<Constant*> &);
+    GlobalVariable *emitFrameDesc(Module &, Function *, uint64_t, uint32_t,
+                                  std::vector<Constant*> &);
+    uint32_t getGlobalObjDescEntries(GlobalVariable *, Type *, uint64_t,
+                                     std::vector<Constant*> &);
+    void emitGlobalObjTable(Module &, IRBuilder<> &,
+                            std::vector<Constant*> &);
     void getTypeInfoFromClang();
 
   private:
@@ -141,6 +193,15 @@ namespace llvm {
     void getSortedAllParentSet();
     void getSortedAllPhantomSet();
     void removeNonCastingRelatedObj(StructElementInfoTy &);
+    uint64_t getRuleIndex(uint64_t);
+    StructType *getFrameDescEntryTy();
+    StructType *getGlobalObjDescTy();
+    std::map<uint64_t, GlobalVariable *> TypeRecords;
+    GlobalVariable *emitTypeRecord(Module &, StringRef, StringRef,
+                                   std::vector<uint64_t> &);
+    Constant *getSectionBound(Module &, StringRef);
+    std::map<Function *, std::pair<Value *, Value *>> FrameTokens;
+    std::pair<Value *, Value *> getFrameToken(Module *, Function *);
     void emitInstForObjTrace(Module *, IRBuilder<> &, StructElementInfoTy &,
                              uint32_t , Value *, Value *, uint32_t , uint32_t,
                              uint32_t , Value *, BasicBlock *);
@@ -0,0 +1,45 @@
+// Benchmark for large array allocation and free with HexType.
+// Usage: ./largeArrayTest [array size] [rounds]
+#include<stdio.h>
+#include<stdlib.h>
+#include<chrono>
+
+class S {
+ int t;
+};
+
+class P {
+ int t;
+};
+
+class T : public S, public P {
+  int m;
+};
+
+int main(int argc, char **argv) {
+  long size = argc > 1 ? atol(argv[1]) : 1000000;
+  int rounds = argc > 2 ? atoi(argv[2]) : 10;
+  double allocTime = 0, freeTime = 0;
+
+  for (int r = 0; r < rounds; r++) {
+    auto start = std::chrono::steady_clock::now();
+    T *pt = new T[size];
+    auto allocated = std::chrono::steady_clock::now();
+
+    static_cast<T*>((S*)&pt[size / 2]);
+    static_cast<T*>((P*)&pt[size - 1]);
+
+    auto freeStart = std::chrono::steady_clock::now();
+    delete[] pt;
+    auto freed = std::chrono::steady_clock::now();
+
+    allocTime += std::chrono::duration<double, std::milli>(
+      allocated - start).count();
+    freeTime += std::chrono::duration<double, std::milli>(
+      freed - freeStart).count();
+  }
+
+  printf("new T[%ld]: %.3f ms\n", size, allocTime / rounds);
+  printf("delete[]: %.3f ms\n", freeTime / rounds);
+  return 0;
+}
@@ -0,0 +1,56 @@
+// Cast sites with one, two and four dynamic source types. Build with the
+// inline optimization; with a HEX_LOG runtime, total_result.txt lists
+// the site cache hits and misses of each site. The first two sites
+// should miss only on their first casts, the last one keeps missing.
+// No type confusion is expected.
+// Usage: ./cast_site [rounds]
+#include <stdio.h>
+#include <stdlib.h>
+#include <chrono>
+
+class Base {
+public:
+  virtual ~Base() {}
+  int b;
+};
+
+class Mid : public Base {
+public:
+  int m;
+};
+
+class D1 : public Mid { public: int d; };
+class D2 : public Mid { public: int d; };
+class D3 : public Mid { public: int d; };
+class D4 : public Mid { public: int d; };
+
+__attribute__((noinline)) Mid *monoSite(Base *Obj) {
+  return static_cast<Mid*>(Obj);
+}
+
+__attribute__((noinline)) Mid *polySite(Base *Obj) {
+  return static_cast<Mid*>(Obj);
+}
+
+__attribute__((noinline)) Mid *megaSite(Base *Obj) {
+  return static_cast<Mid*>(Obj);
+}
+
+int main(int argc, char **argv) {
+  long Rounds = argc > 1 ? atol(argv[1]) : 1000000;
+  Base *Objs[4] = { new D1(), new D2(), new D3(), new D4() };
+
+  auto Start = std::chrono::steady_clock::now();
+  for (long i = 0; i < Rounds; i++) {
+    monoSite(Objs[0]);
+    polySite(Objs[i & 1]);
+    megaSite(Objs[i & 3]);
+  }
+  double Ns = std::chrono::duration<double, std::nano>(
+    std::chrono::steady_clock::now() - Start).count();
+  printf("%.1f ns/cast\n", Ns / (Rounds * 3));
+
+  for (int i = 0; i < 4; i++)
+    delete Objs[i];
+  return 0;
+}
@@ -0,0 +1,54 @@
+// Casts decided by the single inheritance labels and by the cast sets.
+// A, B and C form a chain and D branches off A, so casts between them are
+// answered from the labels ("Decided by single inheritance labels" in
+// total_result.txt). M inherits from both B and D and falls back to the
+// cast set, as do casts to PB, a phantom class of B. Expect two reports:
+// the C object cast to D, and the M object cast to C.
+#include <stdio.h>
+
+class A {
+public:
+  virtual ~A() {}
+  int a;
+};
+
+class B : public A {
+public:
+  int b;
+};
+
+class C : public B {
+public:
+  int c;
+};
+
+class PB : public B {
+};
+
+class D : public A {
+public:
+  int d;
+};
+
+class M : public B, public D {
+public:
+  int m;
+};
+
+int main() {
+  C *ObjC = new C();
+  M *ObjM = new M();
+  A *ObjA = ObjC;
+
+  printf("%p\n", (void *)static_cast<B*>(ObjA));
+  printf("%p\n", (void *)static_cast<C*>(ObjA));
+  printf("%p\n", (void *)static_cast<PB*>((B *)ObjC));
+  printf("%p\n", (void *)static_cast<M*>((B *)ObjM));
+  printf("%p\n", (void *)static_cast<M*>((D *)ObjM));
+  printf("%p\n", (void *)static_cast<D*>(ObjA));       // bad cast
+  printf("%p\n", (void *)static_cast<C*>((B *)ObjM));  // bad cast
+
+  delete ObjC;
+  delete ObjM;
+  return 0;
+}
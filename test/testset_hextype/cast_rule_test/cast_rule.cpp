@@ -0,0 +1,77 @@
+// Cast rule checks over a deep hierarchy with phantom classes.
+// Chain<N> derives from Chain<N-1>; Phantom<N> derives from Chain<N>
+// without adding fields, so casting a Chain<N> object to Phantom<N> is
+// allowed. Casts to a deeper Chain are type confusion; expect DEPTH - 1
+// reports per round in total_result.txt ("Type confusion cases").
+// Usage: ./cast_rule [rounds]
+#include <stdio.h>
+#include <stdlib.h>
+#include <chrono>
+
+#define DEPTH 48
+
+template <int N>
+class Chain : public Chain<N - 1> {
+public:
+  int v;
+};
+
+template <>
+class Chain<0> {
+public:
+  virtual ~Chain() {}
+  int v;
+};
+
+template <int N>
+class Phantom : public Chain<N> {
+};
+
+template <int N>
+struct Caster {
+  static void run(Chain<0> **Objs) {
+    Chain<0> *Obj = Objs[N];
+    static_cast<Chain<N>*>(Obj);
+    static_cast<Chain<N / 2>*>(Obj);
+    static_cast<Phantom<N>*>(Obj);
+    static_cast<Chain<N + 1>*>(Obj);    // bad cast
+    Caster<N - 1>::run(Objs);
+  }
+};
+
+template <>
+struct Caster<0> {
+  static void run(Chain<0> **Objs) {}
+};
+
+template <int N>
+struct Maker {
+  static void run(Chain<0> **Objs) {
+    Objs[N] = new Chain<N>();
+    Maker<N - 1>::run(Objs);
+  }
+};
+
+template <>
+struct Maker<0> {
+  static void run(Chain<0> **Objs) {
+    Objs[0] = new Chain<0>();
+  }
+};
+
+int main(int argc, char **argv) {
+  long Rounds = argc > 1 ? atol(argv[1]) : 1;
+  Chain<0> *Objs[DEPTH + 1];
+  Maker<DEPTH>::run(Objs);
+
+  auto Start = std::chrono::steady_clock::now();
+  for (long i = 0; i < Rounds; i++)
+    Caster<DEPTH - 1>::run(Objs);
+  double Ns = std::chrono::duration<double, std::nano>(
+    std::chrono::steady_clock::now() - Start).count();
+  printf("%.1f ns/cast\n", Ns / (Rounds * (DEPTH - 1) * 4));
+
+  for (int i = 0; i <= DEPTH; i++)
+    delete Objs[i];
+  return 0;
+}
@@ -0,0 +1,59 @@
+// Allocation-heavy benchmark for ObjTypeMap collisions.
+// Small objects (8 bytes apart) are placed in several regions that are
+// 2GB apart, so with a plain (addr >> 3) index every region maps onto the
+// same slots. Compare numUpdateMiss / numLookMiss in total_result.txt.
+// Usage: ./collision [regions] [objects per region]
+#include <stdio.h>
+#include <stdlib.h>
+#include <new>
+#include <sys/mman.h>
+#include <chrono>
+
+class S {
+public:
+  int t;
+};
+
+class T : public S {
+public:
+  int m;
+};
+
+#define REGIONSTRIDE (1UL << 31)
+
+int main(int argc, char **argv) {
+  int NumRegion = argc > 1 ? atoi(argv[1]) : 4;
+  long NumObj = argc > 2 ? atol(argv[2]) : 1000000;
+
+  char *Base = (char *)mmap(NULL, REGIONSTRIDE * NumRegion,
+                            PROT_READ | PROT_WRITE,
+                            MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE,
+                            -1, 0);
+  if (Base == MAP_FAILED)
+    return 1;
+
+  auto Start = std::chrono::steady_clock::now();
+  for (int r = 0; r < NumRegion; r++) {
+    T *Region = (T *)(Base + REGIONSTRIDE * r);
+    for (long i = 0; i < NumObj; i++)
+      new (&Region[i]) T();
+  }
+  auto Updated = std::chrono::steady_clock::now();
+
+  for (int r = 0; r < NumRegion; r++) {
+    T *Region = (T *)(Base + REGIONSTRIDE * r);
+    for (long i = 0; i < NumObj; i++)
+      static_cast<T*>((S*)&Region[i]);
+  }
+  auto Checked = std::chrono::steady_clock::now();
+
+  double Total = (double)NumRegion * NumObj;
+  printf("update: %.1f ns/object\n",
+         std::chrono::duration<double, std::nano>(Updated - Start).count() /
+         Total);
+  printf("check: %.1f ns/cast\n",
+         std::chrono::duration<double, std::nano>(Checked - Updated).count() /
+         Total);
+  munmap(Base, REGIONSTRIDE * NumRegion);
+  return 0;
+}
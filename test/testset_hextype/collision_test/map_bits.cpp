@@ -0,0 +1,39 @@
+// Many live heap objects in a small object map. Run with
+// HEXTYPE_MAP_BITS=12: the 4096 slots fill up and most objects spill, yet
+// every object must still be found. Only the last cast is type
+// confusion: expect one report.
+// Usage: HEXTYPE_MAP_BITS=12 ./map_bits [objects]
+#include <stdio.h>
+#include <stdlib.h>
+#include <vector>
+
+class S {
+public:
+  virtual ~S() {}
+  int t;
+};
+
+class T : public S {
+public:
+  int m;
+};
+
+class U : public S {
+public:
+  int u;
+};
+
+int main(int argc, char **argv) {
+  long NumObj = argc > 1 ? atol(argv[1]) : 100000;
+  std::vector<S *> Objs;
+
+  for (long i = 0; i < NumObj; i++)
+    Objs.push_back(new T());
+  for (long i = 0; i < NumObj; i++)
+    static_cast<T*>(Objs[i])->m = i;
+  printf("%p\n", (void *)static_cast<U*>(Objs[NumObj / 2]));
+
+  for (long i = 0; i < NumObj; i++)
+    delete Objs[i];
+  return 0;
+}
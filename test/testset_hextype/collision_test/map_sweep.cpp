@@ -0,0 +1,60 @@
+// Stale ObjTypeMap entries and their sweep. Objects are placed (with
+// -mllvm -handle-placement-new) in regions 2GB apart, so many of them
+// share probe groups and spill. The first region is unmapped without
+// removing its objects; __hextype_sweep_map then drops those entries and
+// moves spilled entries of the other regions back into the freed slots.
+// Build with HEX_LOG for the occupancy section of total_result.txt.
+// No type confusion is expected.
+// Usage: ./map_sweep [regions] [objects per region]
+#include <stdio.h>
+#include <stdlib.h>
+#include <new>
+#include <sys/mman.h>
+#include <chrono>
+
+class S {
+public:
+  int t;
+};
+
+class T : public S {
+public:
+  int m;
+};
+
+#define REGIONSTRIDE (1UL << 31)
+
+extern "C" unsigned long __hextype_sweep_map();
+
+int main(int argc, char **argv) {
+  int NumRegion = argc > 1 ? atoi(argv[1]) : 24;
+  long NumObj = argc > 2 ? atol(argv[2]) : 100000;
+
+  char *Base = (char *)mmap(NULL, REGIONSTRIDE * NumRegion,
+                            PROT_READ | PROT_WRITE,
+                            MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE,
+                            -1, 0);
+  if (Base == MAP_FAILED)
+    return 1;
+
+  for (int r = 0; r < NumRegion; r++) {
+    T *Region = (T *)(Base + REGIONSTRIDE * r);
+    for (long i = 0; i < NumObj; i++)
+      new (&Region[i]) T();
+  }
+  munmap(Base, REGIONSTRIDE);
+
+  auto Start = std::chrono::steady_clock::now();
+  unsigned long Swept = __hextype_sweep_map();
+  printf("sweep: %lu entries in %.1f ms\n", Swept,
+         std::chrono::duration<double, std::milli>(
+           std::chrono::steady_clock::now() - Start).count());
+
+  for (int r = 1; r < NumRegion; r++) {
+    T *Region = (T *)(Base + REGIONSTRIDE * r);
+    for (long i = 0; i < NumObj; i++)
+      static_cast<T*>((S*)&Region[i]);
+  }
+  munmap(Base + REGIONSTRIDE, REGIONSTRIDE * (NumRegion - 1));
+  return 0;
+}
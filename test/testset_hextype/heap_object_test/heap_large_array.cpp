@@ -0,0 +1,52 @@
+// Benchmark for large heap arrays: allocation, casts on elements spread
+// over the array, and free.
+// Usage: ./heap_large_array [array size]
+#include <stdio.h>
+#include <stdlib.h>
+#include <chrono>
+
+class parent {
+public:
+  int t[4];
+};
+
+class child : public parent {
+public:
+  int m;
+};
+
+class child2 : public child {
+};
+
+int main (int argc, char **argv)
+{
+  long n = argc > 1 ? atol(argv[1]) : 1000000;
+
+  auto start = std::chrono::steady_clock::now();
+  child *pData = (child*) calloc (n, sizeof(child));
+  child *buffer = (child*) malloc (sizeof(child) * n);
+  child *ptr = new child[n];
+  auto allocated = std::chrono::steady_clock::now();
+
+  for (long i = 0; i < n; i += n / 1000 + 1) {
+    static_cast<child*>((parent*)&pData[i]);
+    static_cast<child*>((parent*)&buffer[i]);
+    static_cast<child*>((parent*)&ptr[i]);
+  }
+  static_cast<child2*>((parent*)&ptr[n / 2]); // bad-casting!
+  auto checked = std::chrono::steady_clock::now();
+
+  buffer = (child*) realloc(buffer, sizeof(child) * n * 2);
+  free(pData);
+  free(buffer);
+  delete[] ptr;
+  auto freed = std::chrono::steady_clock::now();
+
+  printf("alloc: %.3f ms\n",
+         std::chrono::duration<double, std::milli>(allocated - start).count());
+  printf("cast: %.3f ms\n",
+         std::chrono::duration<double, std::milli>(checked - allocated).count());
+  printf("free: %.3f ms\n",
+         std::chrono::duration<double, std::milli>(freed - checked).count());
+  return 0;
+}
@@ -0,0 +1,59 @@
+// Casts every element of a vector in a counted loop. Built with
+// -mllvm -loop-cast-opt, the checks of sumDerived are replaced by one
+// __type_casting_verification_batch call before the loop. Every seventh
+// element is a Base, so expect one confusion report per seven elements
+// and round ("Type confusion cases" in total_result.txt).
+// Usage: ./loop_cast [elements] [rounds]
+#include <stdio.h>
+#include <stdlib.h>
+#include <vector>
+#include <algorithm>
+#include <chrono>
+
+class Base {
+public:
+  virtual ~Base() {}
+  int b;
+};
+
+class Derived : public Base {
+public:
+  int d;
+};
+
+__attribute__((noinline))
+long sumDerived(Base *const *Objs, long Num) {
+  long Sum = 0;
+  for (long i = 0; i < Num; i++)
+    Sum += static_cast<Derived*>(Objs[i])->b;
+  return Sum;
+}
+
+int main(int argc, char **argv) {
+  long Num = argc > 1 ? atol(argv[1]) : 1000000;
+  long Rounds = argc > 2 ? atol(argv[2]) : 10;
+
+  std::vector<Base*> Objs;
+  for (long i = 0; i < Num; i++) {
+    if (i % 7 == 0)
+      Objs.push_back(new Base());
+    else
+      Objs.push_back(new Derived());
+    Objs.back()->b = 1;
+  }
+  // scattered objects, so that object map lookups miss the cache
+  srand(1);
+  std::random_shuffle(Objs.begin(), Objs.end());
+
+  long Sum = 0;
+  auto Start = std::chrono::steady_clock::now();
+  for (long i = 0; i < Rounds; i++)
+    Sum += sumDerived(Objs.data(), Num);
+  double Ns = std::chrono::duration<double, std::nano>(
+    std::chrono::steady_clock::now() - Start).count();
+  printf("%ld casts: %.1f ns/cast\n", Sum, Ns / (Rounds * Num));
+
+  for (Base *Obj : Objs)
+    delete Obj;
+  return 0;
+}
@@ -0,0 +1,94 @@
+// Casts one object in every iteration of a loop nest. Built with
+// -mllvm -loop-cast-opt, the check of castNest leaves both loops and
+// runs once per call, so its cost per iteration drops to that of the
+// loop itself. castWithCall keeps its check in the loop, since the
+// opaque call might free the object, and so does castAfterValidate: its
+// readonly validate throws before the cast is reached, here for a plain
+// Base. No type confusion is expected.
+// Usage: ./loop_invariant [outer] [inner]
+#include <stdio.h>
+#include <stdlib.h>
+#include <chrono>
+
+class Base {
+public:
+  virtual ~Base() {}
+  int b;
+};
+
+class Derived : public Base {
+public:
+  int d;
+};
+
+__attribute__((noinline))
+long castNest(Base *Obj, long Outer, long Inner) {
+  long Sum = 0;
+  for (long i = 0; i < Outer; i++)
+    for (long j = 0; j < Inner; j++)
+      Sum += static_cast<Derived*>(Obj)->d + j;
+  return Sum;
+}
+
+__attribute__((noinline))
+void opaque(Base *Obj) {
+  asm volatile("" : : "r"(Obj) : "memory");
+}
+
+__attribute__((noinline))
+long castWithCall(Base *Obj, long Num) {
+  long Sum = 0;
+  for (long i = 0; i < Num; i++) {
+    Sum += static_cast<Derived*>(Obj)->d;
+    opaque(Obj);
+  }
+  return Sum;
+}
+
+__attribute__((noinline, pure))
+int validate(const Base *Obj) {
+  if (Obj->b != 1)
+    throw Obj->b;
+  return Obj->b;
+}
+
+__attribute__((noinline))
+long castAfterValidate(Base *Obj, long Num) {
+  long Sum = 0;
+  for (long i = 0; i < Num; i++)
+    Sum += validate(Obj) + static_cast<Derived*>(Obj)->d;
+  return Sum;
+}
+
+int main(int argc, char **argv) {
+  long Outer = argc > 1 ? atol(argv[1]) : 1000;
+  long Inner = argc > 2 ? atol(argv[2]) : 10000;
+  Derived *Obj = new Derived();
+  Obj->d = 1;
+
+  auto Start = std::chrono::steady_clock::now();
+  long Sum = castNest(Obj, Outer, Inner);
+  double Ns = std::chrono::duration<double, std::nano>(
+    std::chrono::steady_clock::now() - Start).count();
+  printf("%ld invariant casts: %.2f ns/iteration\n", Sum,
+         Ns / (Outer * Inner));
+
+  Start = std::chrono::steady_clock::now();
+  Sum = castWithCall(Obj, Outer * Inner);
+  Ns = std::chrono::duration<double, std::nano>(
+    std::chrono::steady_clock::now() - Start).count();
+  printf("%ld casts around a call: %.2f ns/iteration\n", Sum,
+         Ns / (Outer * Inner));
+
+  Base *Plain = new Base();
+  Plain->b = 0;
+  try {
+    printf("%ld\n", castAfterValidate(Plain, Outer * Inner));
+  } catch (int) {
+    printf("validate rejected the object\n");
+  }
+
+  delete Plain;
+  delete Obj;
+  return 0;
+}
@@ -0,0 +1,113 @@
+// Concurrent cast checks over shared (source, destination) pairs.
+// Node<N> derives from Node<N / 2>. Every thread owns one object of each
+// type and casts them to the same targets, so all threads look up and
+// insert the same cache entries. Casts to a non-ancestor are type
+// confusion; the expected count is printed for each run and should match
+// "Type confusion cases" in total_result.txt.
+// Usage: ./cast_contention [casts per thread]
+#include <stdio.h>
+#include <stdlib.h>
+#include <thread>
+#include <vector>
+#include <atomic>
+#include <chrono>
+
+#define NUMNODE 64
+
+template <int N>
+class Node : public Node<N / 2> {
+public:
+  int v;
+};
+
+template <>
+class Node<1> {
+public:
+  virtual ~Node() {}
+  int v;
+};
+
+typedef void (*CastFn)(Node<1> *);
+typedef Node<1> *(*MakeFn)();
+static CastFn Casts[NUMNODE];
+static MakeFn Makes[NUMNODE];
+
+template <int N>
+static void castTo(Node<1> *Obj) {
+  static_cast<Node<N>*>(Obj);
+}
+
+template <int N>
+static Node<1> *make() {
+  return new Node<N>();
+}
+
+template <int N>
+struct Setup {
+  static void run() {
+    Casts[N] = castTo<N>;
+    Makes[N] = make<N>;
+    Setup<N - 1>::run();
+  }
+};
+
+template <>
+struct Setup<0> {
+  static void run() {}
+};
+
+static bool isAncestor(int Dst, int Src) {
+  for (; Src >= Dst; Src /= 2)
+    if (Src == Dst)
+      return true;
+  return false;
+}
+
+static std::atomic<long> NumBadCast;
+
+static void worker(int Seed, long NumCast) {
+  Node<1> *Objs[NUMNODE];
+  for (int i = 1; i < NUMNODE; i++)
+    Objs[i] = Makes[i]();
+
+  unsigned Rand = Seed;
+  long Bad = 0;
+  for (long i = 0; i < NumCast; i++) {
+    Rand = Rand * 1103515245 + 12345;
+    // most casts are upcasts to a close ancestor
+    int Src = 1 + (Rand >> 8) % (NUMNODE - 1);
+    int Dst = 1 + (Rand >> 16) % (NUMNODE - 1);
+    if ((Rand >> 28) < 12) {
+      Dst = Src >> (Rand >> 24) % 4;
+      if (Dst == 0)
+        Dst = 1;
+    }
+    if (!isAncestor(Dst, Src))
+      Bad++;
+    Casts[Dst](Objs[Src]);
+  }
+  NumBadCast += Bad;
+
+  for (int i = 1; i < NUMNODE; i++)
+    delete Objs[i];
+}
+
+int main(int argc, char **argv) {
+  long NumCast = argc > 1 ? atol(argv[1]) : 1000000;
+  Setup<NUMNODE - 1>::run();
+
+  for (int NumThread = 1; NumThread <= 32; NumThread *= 2) {
+    NumBadCast = 0;
+    auto Start = std::chrono::steady_clock::now();
+    std::vector<std::thread> Threads;
+    for (int i = 0; i < NumThread; i++)
+      Threads.emplace_back(worker, i + 1, NumCast);
+    for (auto &Thread : Threads)
+      Thread.join();
+    double Ns = std::chrono::duration<double, std::nano>(
+      std::chrono::steady_clock::now() - Start).count();
+    printf("%2d threads: %.1f ns/cast, %ld bad casts expected\n", NumThread,
+           Ns / (NumThread * NumCast), NumBadCast.load());
+  }
+  return 0;
+}
@@ -0,0 +1,70 @@
+// Stress test and throughput benchmark for concurrent object tracing.
+// Each thread allocates, casts and frees objects; some of the addresses
+// collide in ObjTypeMap across threads. No type confusion is expected.
+// Usage: ./multithread [iterations per thread]
+#include <stdio.h>
+#include <stdlib.h>
+#include <thread>
+#include <vector>
+#include <chrono>
+
+class S {
+public:
+  virtual ~S() {}
+  int t;
+};
+
+class T : public S {
+public:
+  int m;
+};
+
+class Z : public T {
+public:
+  int n;
+};
+
+#define NUMLIVE 64
+
+static void worker(long Iterations) {
+  S *live[NUMLIVE] = {};
+  for (long i = 0; i < Iterations; i++) {
+    int idx = i % NUMLIVE;
+    delete live[idx];
+    if (i & 1)
+      live[idx] = new Z();
+    else
+      live[idx] = new T[2];
+
+    T *pt = static_cast<T*>(live[idx]);
+    if (i & 1) {
+      static_cast<Z*>(pt);
+    } else {
+      delete[] pt;
+      live[idx] = NULL;
+    }
+
+    T stack[4];
+    static_cast<T*>((S*)&stack[i % 4]);
+  }
+  for (int i = 0; i < NUMLIVE; i++)
+    delete live[i];
+}
+
+int main(int argc, char **argv) {
+  long Iterations = argc > 1 ? atol(argv[1]) : 200000;
+
+  for (int NumThread = 1; NumThread <= 64; NumThread *= 2) {
+    auto Start = std::chrono::steady_clock::now();
+    std::vector<std::thread> Threads;
+    for (int i = 0; i < NumThread; i++)
+      Threads.emplace_back(worker, Iterations);
+    for (auto &Thread : Threads)
+      Thread.join();
+    double Sec = std::chrono::duration<double>(
+      std::chrono::steady_clock::now() - Start).count();
+    printf("%2d threads: %8.3f s, %12.0f ops/s\n", NumThread, Sec,
+           NumThread * Iterations / Sec);
+  }
+  return 0;
+}
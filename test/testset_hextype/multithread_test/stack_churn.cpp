@@ -0,0 +1,77 @@
+// Threads that create and cast stack objects in a tight loop while one
+// thread keeps updating heap objects. Built with -mllvm -stack-local-opt,
+// the stack objects go to the table of their thread and are found there
+// ("find in the thread stack table" in total_result.txt), so the stack
+// threads never write ObjTypeMap. Every cast to Other is type confusion:
+// expect one report per stack thread and round of 1000 casts.
+// Usage: ./stack_churn [threads] [casts per thread]
+#include <stdio.h>
+#include <stdlib.h>
+#include <thread>
+#include <vector>
+#include <atomic>
+#include <chrono>
+
+class Base {
+public:
+  virtual ~Base() {}
+  int b;
+};
+
+class Derived : public Base {
+public:
+  int d;
+};
+
+class Other : public Base {
+public:
+  int o;
+};
+
+static std::atomic<bool> Done;
+
+__attribute__((noinline))
+static int castLocal(Base *Obj, long i) {
+  if (i % 1000 == 0)
+    return static_cast<Other*>(Obj)->o;
+  return static_cast<Derived*>(Obj)->d;
+}
+
+__attribute__((noinline))
+static long stackWork(long Num) {
+  long Sum = 0;
+  for (long i = 0; i < Num; i++) {
+    Derived Obj;
+    Obj.d = 1;
+    Sum += castLocal(&Obj, i);
+  }
+  return Sum;
+}
+
+static void heapWork() {
+  while (!Done.load()) {
+    Derived *Obj = new Derived();
+    delete Obj;
+  }
+}
+
+int main(int argc, char **argv) {
+  int NumThread = argc > 1 ? atoi(argv[1]) : 4;
+  long Num = argc > 2 ? atol(argv[2]) : 1000000;
+  std::vector<std::thread> Threads;
+  std::thread Heap(heapWork);
+
+  auto Start = std::chrono::steady_clock::now();
+  for (int t = 0; t < NumThread; t++)
+    Threads.emplace_back([Num] { stackWork(Num); });
+  for (auto &T : Threads)
+    T.join();
+  double Ns = std::chrono::duration<double, std::nano>(
+    std::chrono::steady_clock::now() - Start).count();
+  Done.store(true);
+  Heap.join();
+
+  printf("%d threads: %.2f ns/object, %ld confusions expected\n",
+         NumThread, Ns / Num, NumThread * ((Num + 999) / 1000));
+  return 0;
+}
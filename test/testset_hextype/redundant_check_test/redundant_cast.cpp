@@ -0,0 +1,75 @@
+// Casts the same pointer to the same type several times in a row, as
+// accessor chains do once inlined. Built with -mllvm -redundant-check-opt, only the
+// first cast of sumFields is checked (-Rpass=hextype reports the removed
+// checks). The checks of reTraced must all stay, since the object is
+// replaced in between: expect one confusion report per reTraced call,
+// four in total ("Type confusion cases" in total_result.txt).
+// Usage: ./redundant_cast [rounds]
+#include <stdio.h>
+#include <stdlib.h>
+#include <new>
+#include <chrono>
+
+class Base {
+public:
+  virtual ~Base() {}
+  int b;
+};
+
+class Derived : public Base {
+public:
+  int x, y, z;
+};
+
+class Other : public Base {
+public:
+  int o;
+};
+
+// the pass runs before the inliner, so the accessors are macros
+#define getX(Obj) (static_cast<Derived*>(Obj)->x)
+#define getY(Obj) (static_cast<Derived*>(Obj)->y)
+#define getZ(Obj) (static_cast<Derived*>(Obj)->z)
+
+__attribute__((noinline))
+int sumFields(Base *Obj, bool Twice) {
+  int Sum = getX(Obj) + getY(Obj);
+  if (Twice)
+    Sum += getY(Obj);
+  return Sum + getZ(Obj);
+}
+
+// Obj changes type between the casts
+__attribute__((noinline))
+int reTraced(Base *Obj) {
+  int Sum = getX(Obj);
+  Obj->~Base();
+  new (Obj) Other();
+  Sum += getY(Obj);
+  Obj->~Base();
+  new (Obj) Derived();
+  Sum += getZ(Obj);
+  return Sum;
+}
+
+int main(int argc, char **argv) {
+  long Rounds = argc > 1 ? atol(argv[1]) : 10000000;
+  Derived *Obj = new Derived();
+  Obj->x = Obj->y = Obj->z = 1;
+
+  long Sum = 0;
+  auto Start = std::chrono::steady_clock::now();
+  for (long i = 0; i < Rounds; i++)
+    Sum += sumFields(Obj, i & 1);
+  double Ns = std::chrono::duration<double, std::nano>(
+    std::chrono::steady_clock::now() - Start).count();
+  printf("%ld: %.1f ns/call\n", Sum, Ns / Rounds);
+
+  Sum = 0;
+  for (long i = 0; i < 4; i++)
+    Sum += reTraced(Obj);
+  printf("%ld\n", Sum);
+
+  delete Obj;
+  return 0;
+}
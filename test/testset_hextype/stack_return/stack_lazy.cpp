@@ -0,0 +1,101 @@
+// Stack objects left behind without a remove call. Built with
+// -mllvm -stack-lazy-opt, no removal is emitted for the locals; the frame
+// of leak is gone when main casts the returned pointer, and the objects
+// skipped by the exception and by longjmp die with their frames. Only the
+// cast in castLive is type confusion: expect one report, and the dead
+// objects counted as "Stack object found dead" in total_result.txt.
+// With -mllvm -handle-placement-new as well, the Base placed over the
+// local of placeLocal replaces its entry: expect a second report.
+// castUntraced usually gets the frame of traceOther back; the Other left
+// there belongs to the earlier call and must not be found.
+#include <stdio.h>
+#include <setjmp.h>
+#include <new>
+
+class Base {
+public:
+  virtual ~Base() {}
+  int b;
+};
+
+class Derived : public Base {
+public:
+  int d;
+};
+
+class Other : public Base {
+public:
+  int o;
+};
+
+static jmp_buf Env;
+static Base *Escaped;
+
+__attribute__((noinline)) Base *leak(int Depth) {
+  Other Obj;
+  if (Depth > 0)
+    return leak(Depth - 1);
+  Escaped = &Obj;
+  return &Obj;
+}
+
+__attribute__((noinline)) void thrower(int Depth) {
+  Other Obj;
+  if (Depth > 0)
+    thrower(Depth - 1);
+  Escaped = &Obj;
+  throw 1;
+}
+
+__attribute__((noinline)) void jumper(int Depth) {
+  Other Obj;
+  if (Depth > 0)
+    jumper(Depth - 1);
+  Escaped = &Obj;
+  longjmp(Env, 1);
+}
+
+__attribute__((noinline)) void castLive() {
+  Other Obj;
+  printf("%p\n", (void *)static_cast<Derived*>((Base *)&Obj));
+}
+
+__attribute__((noinline)) void placeLocal() {
+  Derived Obj;
+  Base *Placed = new (&Obj) Base();
+  printf("%p\n", (void *)static_cast<Derived*>(Placed));
+  new (&Obj) Derived();
+}
+
+__attribute__((noinline)) void traceOther() {
+  Other Obj;
+  Obj.o = 1;
+  printf("%p\n", (void *)&Obj);
+}
+
+__attribute__((noinline)) void castUntraced() {
+  alignas(Other) char Buf[sizeof(Other)];
+  printf("%p\n", (void *)static_cast<Derived*>((Base *)Buf));
+}
+
+int main() {
+  Derived Live;
+  printf("%p\n", (void *)static_cast<Derived*>(leak(16)));
+
+  try {
+    thrower(16);
+  } catch (int) {
+  }
+  printf("%p\n", (void *)static_cast<Derived*>(Escaped));
+
+  if (!setjmp(Env))
+    jumper(16);
+  printf("%p\n", (void *)static_cast<Derived*>(Escaped));
+
+  castLive();
+  placeLocal();
+  traceOther();
+  castUntraced();
+  printf("%p\n", (void *)static_cast<Derived*>((Base *)&Live));
+  return 0;
+}
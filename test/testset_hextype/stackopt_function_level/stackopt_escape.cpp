@@ -0,0 +1,89 @@
+// Stack objects whose address does or does not escape. With
+// -mllvm -stack-escape-opt (and -mllvm -make-loginfo for the counts in
+// stack_opt_info.txt), the objects of local_only, no_cast_callee and
+// local_and_cast are not traced. The object of stored is published
+// through a global and the one of cast_callee reaches a cast, so both
+// stay traced: expect two confusion reports, and numStackUp/numStackRm
+// in total_result.txt to count only those objects.
+//
+// Of the 5 stack objects, stack_opt_info.txt should list:
+//   no option:                      5 traced, numStackUp 2003
+//   -stack-opt (typesan):           3 traced, 2 cannot be cast,
+//                                   numStackUp 3
+//   -stack-escape-opt:              2 traced, 3 do not escape,
+//                                   numStackUp 2
+//   -stack-opt -stack-escape-opt:   2 traced, 2 cannot be cast and
+//                                   1 does not escape, numStackUp 2
+// Function level stack-opt keeps the object of local_and_cast, whose
+// function casts another pointer.
+#include <stdio.h>
+
+class S {
+public:
+  int t;
+  __attribute__((noinline)) void set(int v) { t = v; }
+};
+
+class T : public S {
+public:
+  int m;
+};
+
+S *published;
+
+__attribute__((noinline)) int read_only(S *s) {
+  return s->t;
+}
+
+__attribute__((noinline)) void do_cast(S *s) {
+  T *pt = static_cast<T*>(s);
+  printf("%p\n", (void *)pt);
+}
+
+__attribute__((noinline)) int local_only() {
+  S test1;
+  test1.t = 1;
+  return test1.t;
+}
+
+__attribute__((noinline)) int no_cast_callee() {
+  S test1;
+  test1.set(2);
+  return read_only(&test1);
+}
+
+__attribute__((noinline)) void cast_published() {
+  T *pt = static_cast<T*>(published);
+  printf("%p\n", (void *)pt);
+}
+
+__attribute__((noinline)) void stored() {
+  S test1;
+  published = &test1;
+  cast_published();
+  published = nullptr;
+}
+
+__attribute__((noinline)) void cast_callee() {
+  S test1;
+  test1.set(3);
+  do_cast(&test1);
+}
+
+__attribute__((noinline)) void local_and_cast(S *other) {
+  S test1;
+  test1.t = 4;
+  do_cast(other);
+  printf("%d\n", test1.t);
+}
+
+int main() {
+  int sum = 0;
+  for (int i = 0; i < 1000; i++)
+    sum += local_only() + no_cast_callee();
+  stored();
+  cast_callee();
+  local_and_cast(new T());
+  printf("%d\n", sum);
+  return 0;
+}
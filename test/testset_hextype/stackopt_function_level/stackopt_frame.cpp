@@ -0,0 +1,81 @@
+// Functions with several traced stack objects. With -mllvm -stack-frame-opt
+// each call of recurse and with_array registers its locals with one call,
+// and their casts are resolved from the frame descriptor. The frame of
+// thrower is unregistered on its unwind path before the exception leaves.
+// With -mllvm -handle-placement-new as well, the Base placed over a local
+// of placed is found instead of the Derived of the descriptor. Expect two
+// confusion reports, for the cast of the Base element in with_array and
+// of the placed Base. The scoped objects of scoped have lifetime markers
+// and are not merged, so they may still share one stack slot; they are
+// traced one by one.
+#include <stdio.h>
+#include <new>
+
+class Base {
+public:
+  virtual ~Base() {}
+  int b;
+};
+
+class Derived : public Base {
+public:
+  int d;
+};
+
+__attribute__((noinline)) void do_cast(Base *Obj) {
+  Derived *D = static_cast<Derived*>(Obj);
+  printf("%p\n", (void *)D);
+}
+
+__attribute__((noinline)) int recurse(int Depth) {
+  Derived First, Second;
+  Base *Obj = Depth & 1 ? &First : &Second;
+  if (Depth > 0)
+    return recurse(Depth - 1) + static_cast<Derived*>(Obj)->d;
+  do_cast(&First);
+  return 0;
+}
+
+__attribute__((noinline)) void with_array() {
+  Derived Objs[4];
+  Base Plain;
+  for (int i = 0; i < 4; i++)
+    do_cast(&Objs[i]);
+  do_cast(&Plain);
+}
+
+__attribute__((noinline)) void thrower() {
+  Derived Obj;
+  do_cast(&Obj);
+  throw 1;
+}
+
+__attribute__((noinline)) void placed() {
+  Derived Obj, Other;
+  do_cast(&Other);
+  do_cast(new (&Obj) Base());
+  new (&Obj) Derived();
+}
+
+__attribute__((noinline)) void scoped(int Which) {
+  if (Which) {
+    Derived First;
+    do_cast(&First);
+  } else {
+    Derived Second;
+    do_cast(&Second);
+  }
+}
+
+int main() {
+  try {
+    thrower();
+  } catch (int) {
+  }
+  printf("%d\n", recurse(16));
+  with_array();
+  placed();
+  scoped(0);
+  scoped(1);
+  return 0;
+}
@@ -0,0 +1,60 @@
+// Stack objects whose functions reach a cast only through other calls.
+// With -mllvm -stack-opt (and -mllvm -make-loginfo for the count in
+// stack_opt_info.txt), the objects of leaf_fn and safe_caller are not
+// traced, while those of indirect_caller and recursive_fn are, since
+// their callees may cast them. Expect two confusion reports.
+#include <stdio.h>
+
+class S {
+public:
+  int t;
+};
+
+class T : public S {
+public:
+  int m;
+};
+
+typedef void (*Handler)(S *);
+
+__attribute__((noinline)) void no_cast(S *s) {
+  s->t = 1;
+}
+
+__attribute__((noinline)) void do_cast(S *s) {
+  T *pt = static_cast<T*>(s);
+  printf("%p\n", (void *)pt);
+}
+
+__attribute__((noinline)) void leaf_fn() {
+  S test1;
+  no_cast(&test1);
+}
+
+__attribute__((noinline)) void safe_caller() {
+  S test1;
+  leaf_fn();
+  no_cast(&test1);
+}
+
+__attribute__((noinline)) void indirect_caller(Handler h) {
+  S test1;
+  h(&test1);
+}
+
+__attribute__((noinline)) void recursive_fn(int depth) {
+  S test1;
+  if (depth > 0)
+    recursive_fn(depth - 1);
+  else
+    do_cast(&test1);
+}
+
+Handler handlers[2] = { no_cast, do_cast };
+
+int main(int argc, char **argv) {
+  safe_caller();
+  indirect_caller(handlers[argc > 1 ? 0 : 1]);
+  recursive_fn(3);
+  return 0;
+}
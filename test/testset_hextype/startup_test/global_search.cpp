@@ -0,0 +1,59 @@
+// Casts of objects found in the global object table. The 4096 globals G*
+// are 4096 entries of the table built with -mllvm -global-table-opt, and
+// every cast of one of them searches it, since they are not in the object
+// map. Compare the time per cast with a build without -global-table-opt,
+// where each global is an entry of the object map. No cast is type
+// confusion: expect no report.
+// Usage: ./global_search [casts]
+#include <stdio.h>
+#include <stdlib.h>
+#include <chrono>
+
+class S {
+public:
+  virtual ~S() {}
+  int s;
+};
+
+class T : public S {
+public:
+  int t;
+};
+
+#define DEF4(p) T p##0, p##1, p##2, p##3;
+#define DEF16(p) DEF4(p##0) DEF4(p##1) DEF4(p##2) DEF4(p##3)
+#define DEF64(p) DEF16(p##0) DEF16(p##1) DEF16(p##2) DEF16(p##3)
+#define DEF256(p) DEF64(p##0) DEF64(p##1) DEF64(p##2) DEF64(p##3)
+#define DEF1024(p) DEF256(p##0) DEF256(p##1) DEF256(p##2) DEF256(p##3)
+#define DEF4096(p) DEF1024(p##0) DEF1024(p##1) DEF1024(p##2) DEF1024(p##3)
+
+#define REF4(p) &p##0, &p##1, &p##2, &p##3,
+#define REF16(p) REF4(p##0) REF4(p##1) REF4(p##2) REF4(p##3)
+#define REF64(p) REF16(p##0) REF16(p##1) REF16(p##2) REF16(p##3)
+#define REF256(p) REF64(p##0) REF64(p##1) REF64(p##2) REF64(p##3)
+#define REF1024(p) REF256(p##0) REF256(p##1) REF256(p##2) REF256(p##3)
+#define REF4096(p) REF1024(p##0) REF1024(p##1) REF1024(p##2) REF1024(p##3)
+
+DEF4096(G)
+
+static S *Globals[] = { REF4096(G) };
+static const unsigned NumGlobal = sizeof(Globals) / sizeof(Globals[0]);
+
+__attribute__((noinline)) T *do_cast(S *Obj) {
+  return static_cast<T*>(Obj);
+}
+
+int main(int argc, char **argv) {
+  long NumCast = argc > 1 ? atol(argv[1]) : 10000000;
+  unsigned r = 1;
+  long Sum = 0;
+  auto Start = std::chrono::steady_clock::now();
+  for (long i = 0; i < NumCast; i++) {
+    r = r * 1103515245 + 12345;
+    Sum += do_cast(Globals[(r >> 8) % NumGlobal])->t;
+  }
+  double Ns = std::chrono::duration<double, std::nano>(
+    std::chrono::steady_clock::now() - Start).count() / NumCast;
+  printf("%u globals: %.1f ns per cast (%ld)\n", NumGlobal, Ns, Sum);
+  return 0;
+}
@@ -0,0 +1,73 @@
+// Large static tables of traced objects. Without -mllvm -global-table-opt
+// the global constructor registers every element of Table and Pair with
+// its own runtime call; with it, the module registers one table and the
+// objects are found by binary search on the first cast. Compare the time
+// to main (and binary size) of the two builds. Only the last cast is
+// type confusion: expect one report.
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+class S {
+public:
+  int t;
+};
+
+class T : public S {
+public:
+  int m;
+};
+
+class U : public S {
+public:
+  int u;
+};
+
+struct Pair {
+  T First;
+  U Second;
+};
+
+T Table[4096];
+Pair Pairs[1024];
+U Single;
+
+static double getTimeToMain() {
+  unsigned long long StartTicks = 0;
+  char buf[4096];
+  FILE *fp = fopen("/proc/self/stat", "r");
+  if (fp == NULL)
+    return -1;
+  size_t len = fread(buf, 1, sizeof(buf) - 1, fp);
+  fclose(fp);
+  buf[len] = 0;
+
+  // starttime is the 22nd field, counted after the command name.
+  char *p = strrchr(buf, ')');
+  for (int field = 2; p != NULL && field < 22; field++)
+    p = strchr(p + 1, ' ');
+  if (p == NULL)
+    return -1;
+  StartTicks = strtoull(p + 1, NULL, 10);
+
+  struct timespec now;
+  clock_gettime(CLOCK_BOOTTIME, &now);
+  double Start = (double)StartTicks / sysconf(_SC_CLK_TCK);
+  return (now.tv_sec + now.tv_nsec / 1e9) - Start;
+}
+
+int main(int argc, char **argv) {
+  double TimeToMain = getTimeToMain();
+  int i = argc > 1 ? atoi(argv[1]) : 100;
+
+  static_cast<T*>((S*)&Table[i]);
+  static_cast<T*>((S*)&Pairs[i].First);
+  static_cast<U*>((S*)&Pairs[i].Second);
+  static_cast<U*>((S*)&Single);
+  static_cast<U*>((S*)&Table[i + 1]);
+
+  printf("time to main: %.3f s\n", TimeToMain);
+  return 0;
+}
@@ -0,0 +1,70 @@
+// Reports time to main and resident memory of a HexType binary.
+// Compare a build with and without -fsanitize=hextype.
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+class S {
+  int t;
+};
+
+class T : public S {
+  int m;
+};
+
+T global[10];
+
+static double getTimeToMain() {
+  unsigned long long StartTicks = 0;
+  char buf[4096];
+  FILE *fp = fopen("/proc/self/stat", "r");
+  if (fp == NULL)
+    return -1;
+  size_t len = fread(buf, 1, sizeof(buf) - 1, fp);
+  fclose(fp);
+  buf[len] = 0;
+
+  // starttime is the 22nd field, counted after the command name.
+  char *p = strrchr(buf, ')');
+  for (int field = 2; p != NULL && field < 22; field++)
+    p = strchr(p + 1, ' ');
+  if (p == NULL)
+    return -1;
+  StartTicks = strtoull(p + 1, NULL, 10);
+
+  struct timespec now;
+  clock_gettime(CLOCK_BOOTTIME, &now);
+  double Start = (double)StartTicks / sysconf(_SC_CLK_TCK);
+  return (now.tv_sec + now.tv_nsec / 1e9) - Start;
+}
+
+static long getRSSKB() {
+  char line[256];
+  long rss = -1;
+  FILE *fp = fopen("/proc/self/status", "r");
+  if (fp == NULL)
+    return -1;
+  while (fgets(line, sizeof(line), fp))
+    if (strncmp(line, "VmRSS:", 6) == 0)
+      rss = strtol(line + 6, NULL, 10);
+  fclose(fp);
+  return rss;
+}
+
+int main() {
+  double TimeToMain = getTimeToMain();
+  long RSSAtMain = getRSSKB();
+
+  T *heap = new T[100000];
+  long RSSAfterAlloc = getRSSKB();
+  static_cast<T*>((S*)&heap[10]);
+  delete[] heap;
+
+  printf("time to main: %.3f s\n", TimeToMain);
+  printf("RSS at main: %ld KB\n", RSSAtMain);
+  printf("RSS after 100000 objects: %ld KB\n", RSSAfterAlloc);
+  printf("RSS after free: %ld KB\n", getRSSKB());
+  return 0;
+}
@@ -0,0 +1,53 @@
+// One class hierarchy used by two translation units. Build the file twice
+// with -mllvm -type-section-opt, once with -DSECOND_TU, and link both
+// objects: `readelf -S` shows a hextype_rules section no larger than that
+// of one object, since the linker keeps one record per type. Without the
+// option every object carries its own .cinfo arrays. Only the cast in
+// the second unit is type confusion: expect one report.
+// Also built with -mllvm -inline-opt -mllvm -handle-placement-new, the
+// placement new of V, a type without a record, is traced through the
+// runtime instead of the inline store.
+#include <stdio.h>
+#include <new>
+
+class S {
+public:
+  virtual ~S() {}
+  int t;
+};
+
+class T : public S {
+public:
+  int m;
+};
+
+class U : public S {
+public:
+  int u;
+};
+
+class V {
+public:
+  long v[4];
+};
+
+#ifdef SECOND_TU
+__attribute__((noinline)) void castSecond(S *s) {
+  printf("%p\n", (void *)static_cast<U*>(s));
+}
+#else
+void castSecond(S *s);
+
+int main() {
+  T Obj;
+  printf("%p\n", (void *)static_cast<T*>((S *)&Obj));
+  castSecond(&Obj);
+
+  alignas(V) char Buf[sizeof(V) > sizeof(T) ? sizeof(V) : sizeof(T)];
+  V *ObjV = new (Buf) V();
+  ObjV->v[0] = 1;
+  T *ObjT = new (Buf) T();
+  printf("%p\n", (void *)static_cast<T*>((S *)ObjT));
+  return 0;
+}
+#endif